@@ -1,11 +1,14 @@
 #pragma once
 #define GL_SILENCE_DEPRECATION
 
-#include "map.hpp"
+#include "levelfile.hpp"
 #include "math.hpp"
 #include "debug.hpp"
+#include "frustum.hpp"
+#include "gpuprofiler.hpp"
 
-// These constants control vertical movement:
+// These constants control vertical movement, per simulation tick
+// (see timestep.hpp):
 const double gravity = -0.011, terminalvelocity = -2.0, jump = 0.18;
 
 class Actor {
@@ -13,45 +16,86 @@ class Actor {
     XYZ<double> camera; // Where the actor is situated
     XYZ<double> dir;    // Where actor is looking (updated from look_angle, y=always zero)
     XYZ<double> up;     // What is the "up" direction for this actor
+    static constexpr double ViewDistance = 30.0; // Of the far plane
     Actor() : dir{{0, 0, 0}}, up{{0, 1, 0}} {}
     virtual ~Actor() {}
 
+    // Where the actor is and looks. The one at the previous tick is kept,
+    // so that frames rendered between ticks can interpolate between them.
+    struct Pose { XYZ<double> camera, dir, up; };
+    Pose previous;
+
+    Pose Current() const { return Pose{ camera, dir, up }; }
+    void Place(const Pose& p) { camera = p.camera; dir = p.dir; up = p.up; }
+    void BeginTick() { previous = Current(); }
+    // alpha = 0 gives the previous tick's pose, alpha = 1 the current one.
+    Pose Interpolated(double alpha) const {
+        Pose p;
+        p.camera = previous.camera + (camera - previous.camera) * alpha;
+        p.dir = previous.dir + (dir - previous.dir) * alpha;
+        p.up  = previous.up  + (up  - previous.up)  * alpha;
+        if (p.dir.Squared() > 1e-12) p.dir = p.dir.Normalized();
+        if (p.up.Squared()  > 1e-12) p.up  = p.up.Normalized();
+        return p;
+    }
+
+    // What Render with the same arguments shows.
+    Frustum View(double FoV, double aspect, double near = 1e-3) const {
+        return Frustum(camera, dir, up, FoV, aspect, near, ViewDistance);
+    }
+
+    // Errors are left for the once-per-frame CheckGLError in PC::Render.
     template <typename Func>
-    bool Render(Func &DrawWorld, double FoV, double aspect, double near = 1e-3) {
+    void Render(Func &DrawWorld, double FoV, double aspect, double near = 1e-3) {
+        PROFILE_GPU_SCOPE("Actor::Render");
+        frameStats.BeginView();
         // Decide upon how the viewport is to be projected.
-        if (CheckGLError("Actor::Render Start")) return true;
         glMatrixMode(GL_PROJECTION); // Target matrix: Projection
-        if (CheckGLError("Actor::Render 1")) return true;
         glLoadIdentity();            // Reset any transformations
-        if (CheckGLError("Actor::Render 2")) return true;
-        gluPerspective(FoV, aspect, near, 30.0);
-        if (CheckGLError("Actor::Render 3")) return true;
+        gluPerspective(FoV, aspect, near, ViewDistance);
 
         // Decide upon the manner in which the world is transformed from the
         // perspective of the viewport. In OpenGL, the camera never moves.
         // The world is simply rotated/scaled/shorn around the camera.
         glMatrixMode(GL_MODELVIEW); // Target matrix: World
-        if (CheckGLError("Actor::Render 4")) return true;
         glLoadIdentity();           // Reset any transformations
-        if (CheckGLError("Actor::Render 5")) return true;
         gluLookAt(camera.d[0], camera.d[1], camera.d[2], camera.d[0] + dir.d[0],
                 camera.d[1] + dir.d[1], camera.d[2] + dir.d[2], up.d[0], up.d[1],
                 up.d[2]);
-        if (CheckGLError("Actor::Render 6")) return true;
 
+        Draw(DrawWorld, View(FoV, aspect, near));
+    }
+
+    // Renders view, which needs not start where the actor is: the view
+    // through a portal starts behind the portal it is seen out of (see
+    // Frustum::Through). DrawWorld still gets this actor, as the one not
+    // to draw and the place to look up what can be seen from.
+    template <typename Func>
+    void Render(Func &DrawWorld, const Frustum& view) {
+        PROFILE_GPU_SCOPE("Actor::Render");
+        frameStats.BeginView();
+        GLdouble m[16];
+        glMatrixMode(GL_PROJECTION);
+        view.Projection(m);
+        glLoadMatrixd(m);
+        glMatrixMode(GL_MODELVIEW);
+        view.LookAt(m);
+        glLoadMatrixd(m);
+        Draw(DrawWorld, view);
+    }
+
+    private:
+    template <typename Func>
+    void Draw(Func &DrawWorld, const Frustum& view) {
         // Enable depth calculations to work on the new frame.
         glClear(GL_DEPTH_BUFFER_BIT);
-        if (CheckGLError("Actor::Render 7")) return true;
 
-        // Draw everything that should be rendered.
-        DrawWorld(*this);
-        if (CheckGLError("Actor::Render 8")) return true;
+        // Draw everything that should be rendered, in view.
+        DrawWorld(*this, view);
 
         // Tell OpenGL to render and display stuff.
         glFlush();
-
-        if (CheckGLError("Actor::Render End")) return true;
-        return false;
+        frameStats.EndView();
     }
 };
 
@@ -75,9 +119,10 @@ class BlobActor : public Actor {
 
     BlobActor()
         : fatness{{1, 1, 1}}, center{{0, 0, 0}}, moving(true), ground(false),
-            move_angle(0), vel{{0, 0, 0}}, pushing(0) {}
+            move_angle(0), vel{{0, 0, 0}}, pushing(0), walls(NULL), walls_level(0) {}
     virtual ~BlobActor() {}
     virtual void Update() {
+        PROFILE_SCOPE("BlobActor::Update");
         ground = true;
         if (pushing) {
             // Try to push into the looking-towards direction
@@ -110,8 +155,9 @@ class BlobActor : public Actor {
             double yvel = std::max(vel.d[1] + gravity, terminalvelocity);
             vel.d[1] = 0.0;
             camera -= center;
-            CollideAndSlide(camera, vel, fatness, map);
-            if (CollideAndSlide(camera, {{0, yvel, 0}}, fatness, map)) {
+            const EllipsoidWalls<GLfloat>& walls = Walls();
+            CollideAndSlide(camera, vel, fatness, walls);
+            if (CollideAndSlide(camera, {{0, yvel, 0}}, fatness, walls)) {
                 if (yvel < 0) ground = true;
                 yvel = 0.0;
             }
@@ -124,7 +170,11 @@ class BlobActor : public Actor {
             }
         }
         if (pushing) pushing = -1;
+        Orient();
+    }
 
+    // Points dir and up where the actor is looking.
+    void Orient() {
         double yaw_angle = yaw + vel.d[1] * 35.;
         dir = {{1, 0, 0}};
         up  = {{0, 1, 0}};
@@ -166,4 +216,21 @@ class BlobActor : public Actor {
         }
         fatness *= fatsize / fatness.Len();
     }
+
+    private:
+    const EllipsoidWalls<GLfloat>* walls; // The level, scaled for walls_shape
+    XYZ<double> walls_shape;
+    unsigned walls_level;                 // LevelFile::Generation() they are of
+
+    // The walls to collide with, looked up again only when the shape or
+    // the level has changed since the last time.
+    const EllipsoidWalls<GLfloat>& Walls() {
+        const LevelFile& level = LevelFile::Current();
+        if (!walls || !(walls_shape == fatness) || walls_level != level.Generation()) {
+            walls = &EllipsoidWalls<GLfloat>::For(level.walls, fatness);
+            walls_shape = fatness;
+            walls_level = level.Generation();
+        }
+        return *walls;
+    }
 };
\ No newline at end of file
@@ -0,0 +1,102 @@
+// Texture atlas for the per-wall lightmaps.
+// Every wall has its own lightmap rectangle. Instead of giving each one
+// a texture of its own, the rectangles are packed into a few large pages,
+// so that all walls sharing a page can be drawn with a single bind.
+#pragma once
+
+#include <algorithm> // For std::sort, std::max
+#include <cstdio>    // For std::fprintf
+#include <vector>    // For std::vector, in which we store the rectangles
+
+struct AtlasRect {
+    unsigned page;       // Which page the rectangle went to
+    unsigned x, y, w, h; // Texel area, not including the padding
+    bool fits;           // False if it was too large for a page, see Pack
+};
+
+class LightmapAtlas {
+    public:
+    unsigned page_size; // Width and height of every page, in texels
+    unsigned padding;   // Texels of replicated edge around each rectangle
+    unsigned npages;
+    std::vector<AtlasRect> rects; // Indexed by wall number
+    std::vector<unsigned> order;  // Wall numbers, sorted by page
+    std::vector<unsigned> first;  // Index into order where each page starts
+    std::vector<unsigned> count;  // Number of walls on each page
+
+    LightmapAtlas() : page_size(0), padding(0), npages(0) {}
+
+    // Shelf packer: tallest rectangles first, left to right along a shelf,
+    // a new shelf when the row is full and a new page when the shelves are.
+    // A rectangle that would not fit even on a page of its own is reported
+    // and shrunk to a single texel, which stays neutral: its wall is drawn
+    // unlit, and nothing is ever uploaded past the edge of a page.
+    void Pack(const std::vector<AtlasRect>& sizes, unsigned size, unsigned pad) {
+        page_size = size;
+        padding = pad;
+        npages = 0;
+        rects = sizes;
+
+        const unsigned most = size > pad * 2 ? size - pad * 2 : 0;
+        std::vector<unsigned> todo;
+        for (unsigned n = 0; n < rects.size(); ++n) {
+            AtlasRect& r = rects[n];
+            r.fits = r.w <= most && r.h <= most;
+            if (!r.fits) {
+                std::fprintf(stderr, "Lightmap of wall %u (%ux%u) is too large for an atlas page of %u,"
+                             " drawing it unlit\n", n, r.w, r.h, size);
+                r.w = r.h = 1;
+            }
+            todo.push_back(n);
+        }
+        std::sort(todo.begin(), todo.end(), [this](unsigned a, unsigned b) {
+            return rects[a].h != rects[b].h ? rects[a].h > rects[b].h : a < b;
+        });
+
+        unsigned x = 0, y = 0, shelf = 0;
+        for (unsigned n : todo) {
+            AtlasRect& r = rects[n];
+            unsigned w = r.w + pad * 2, h = r.h + pad * 2;
+            if (x + w > size) { x = 0; y += shelf; shelf = 0; }
+            if (npages == 0 || y + h > size) { ++npages; x = y = shelf = 0; }
+            r.page = npages - 1;
+            r.x = x + pad;
+            r.y = y + pad;
+            x += w;
+            shelf = std::max(shelf, h);
+        }
+
+        order.clear();
+        first.assign(npages, 0);
+        count.assign(npages, 0);
+        for (unsigned p = 0; p < npages; ++p) {
+            first[p] = order.size();
+            for (unsigned n = 0; n < rects.size(); ++n)
+                if (rects[n].page == p) order.push_back(n);
+            count[p] = order.size() - first[p];
+        }
+    }
+
+    // Converts a texture coordinate in [0,1] of rectangle n into page space.
+    void Map(unsigned n, float s, float t, float& u, float& v) const {
+        const AtlasRect& r = rects[n];
+        u = (r.x + s * r.w) / page_size;
+        v = (r.y + t * r.h) / page_size;
+    }
+
+    // Surrounds a w*h image of RGB texels with copies of its edge texels,
+    // so that bilinear filtering near the edges never picks up a neighbour.
+    template <typename T>
+    void Pad(const T* src, unsigned w, unsigned h, std::vector<T>& out) const {
+        const unsigned pw = w + padding * 2, ph = h + padding * 2;
+        out.resize(pw * ph * 3);
+        for (unsigned y = 0; y < ph; ++y) {
+            unsigned sy = std::min(std::max(y, padding) - padding, h - 1);
+            for (unsigned x = 0; x < pw; ++x) {
+                unsigned sx = std::min(std::max(x, padding) - padding, w - 1);
+                for (unsigned c = 0; c < 3; ++c)
+                    out[(y * pw + x) * 3 + c] = src[(sy * w + sx) * 3 + c];
+            }
+        }
+    }
+};
@@ -0,0 +1,357 @@
+// Headless lightmap baker.
+// Computes lmap/lmapN.raw and smap/smapN.raw from the walls and lights in
+// map.hpp, or in a level file given with -level (see levelfile.hpp), in
+// the layout the renderer expects: 32 texels per unit of wall, RGB floats,
+// s running from p[0] towards p[3] and t from p[0] towards p[1]. They go
+// to light-baked/ rather than over the shipped light/.
+//
+// Each texel's irradiance E is the direct light from every light source
+// (with shadows cast by IntersectRay over a BVH, whose leaves are tested with
+// the SIMD kernel of raysimd.hpp), plus light bounced off other walls,
+// estimated by tracing cosine-distributed rays. Since textures are clamped
+// into [0,1], E is split into a multiply-map min(E,1) and an add-map
+// AddScale*(1-1/E) for the part that brightens beyond the texture's own colour.
+//
+// The bake runs in passes; after each one the current estimate is written
+// out along with a checkpoint, so a long bake can be looked at while it
+// progresses and resumed with -r if interrupted.
+//
+// With -check dir, the result is then compared with the maps in dir, such
+// as the shipped light/, and the baker fails if they differ by more than
+// the Check* tolerances.
+//
+// Usage: baker [-level file] [-o dir] [-check dir] [-s samples] [-b bounces] [-p passes] [-t threads] [-r]
+#include <chrono>  // For std::chrono::steady_clock
+#include <cmath>   // For std::pow, std::abs
+#include <cstdint> // For uint32_t, uint64_t
+#include <cstdio>  // For std::fopen, std::fwrite, std::remove
+#include <cstdlib> // For std::atoi
+#include <cstring> // For std::strcmp, std::memcmp
+#include <string>  // For std::string
+#include <vector>  // For std::vector, in which we accumulate the texels
+
+#include <sys/stat.h> // For mkdir
+
+#include "levelfile.hpp"
+#include "math.hpp"
+#include "jobs.hpp"
+#include "bvh.hpp"
+#include "raysimd.hpp"
+
+static const LevelFile &Level = LevelFile::Current();
+static unsigned nwalls;
+// The light model, fitted to the shipped light/ maps (see -check): light
+// falls off as 1/d^1.5 rather than 1/d^2, and a flat ambient term stands
+// in for the many bounces of the radiosity they were made with.
+const double DirectScale = 10.0; // Of each light's dif
+const double Falloff = 1.5;      // Power of the distance
+const double Albedo = 0.1;       // Part of the light a wall reflects
+const double Ambient = 0.09;     // Added to every texel
+const double AddScale = 0.2;     // Largest value in the add-map
+const double SurfaceOffset = 1e-3; // Keeps rays from hitting their own wall
+
+// How far -check lets the maps be from the reference: the mean absolute
+// difference of their texels, and the relative difference of their sums.
+// The defaults (-s 4 -b 1) give about 0.067 and 1% for the lmaps, and 0.020
+// and 4% for the smaps of map.hpp. The smaps fit less well, as the shipped
+// ones also depend on the texture of each wall.
+const double CheckLmapError = 0.08, CheckLmapEnergy = 0.05;
+const double CheckSmapError = 0.03, CheckSmapEnergy = 0.10;
+
+static BVH LevelBVH;
+static WallSoA LevelLeaves; // The walls of each leaf of LevelBVH, packed for the kernel
+
+struct BakeSettings {
+	std::string dir;
+	std::string check; // Where the maps to compare with are, if anywhere
+	unsigned samples;  // Per texel per pass
+	unsigned bounces;  // 0 = direct light only
+	unsigned passes;
+	unsigned threads;  // 0 = one per core
+	bool resume;
+};
+
+// Where each wall's texels start in the arrays covering all walls.
+struct WallLayout {
+	unsigned w, h;
+	size_t first;
+};
+
+// Random numbers that depend only on the texel, pass and sample, so that
+// a bake gives the same result however its texels are spread over threads.
+struct Rng {
+	uint64_t s;
+	Rng(uint64_t a, uint64_t b) : s((a * 0x9E3779B97F4A7C15ull) ^ (b + 0x632BE59BD9B4E019ull)) {
+		for (int n = 0; n < 4; ++n) Next();
+	}
+	double Next() { // xorshift64*
+		s ^= s >> 12; s ^= s << 25; s ^= s >> 27;
+		return ((s * 0x2545F4914F6CDD1Dull) >> 11) * (1.0 / 9007199254740992.0);
+	}
+};
+
+// Light arriving directly from the light sources.
+static XYZ<double> Direct(const XYZ<double> &p, const XYZ<double> &n) {
+	XYZ<double> e = {{0, 0, 0}};
+	for (const auto &l : Level.lights) {
+		XYZ<double> to = XYZ<double>(l.pos) - p;
+		double d = to.Len(), cosine = n.Dot(to) / d;
+		if (cosine <= 0) continue;
+		HitRec r = IntersectRay(p, to, LevelBVH, LevelLeaves);
+		if (r.set() && r.distance < 1.0) continue; // In shadow
+		e += XYZ<double>(l.dif) * (DirectScale * cosine / std::pow(d, Falloff));
+	}
+	return e;
+}
+
+// Direction around n, distributed according to the cosine of its angle.
+static XYZ<double> CosineSample(const XYZ<double> &n, Rng &rng) {
+	double u1 = rng.Next(), u2 = rng.Next();
+	double r = std::sqrt(u1), phi = 2 * M_PI * u2;
+	XYZ<double> a = std::abs(n.d[0]) > 0.5 ? XYZ<double>{{0, 1, 0}} : XYZ<double>{{1, 0, 0}};
+	XYZ<double> t = a.Cross(n).Normalized(), b = n.Cross(t);
+	return t * (r * std::cos(phi)) + b * (r * std::sin(phi)) + n * std::sqrt(1 - u1);
+}
+
+// One sample of the irradiance at p, following up to depth bounces.
+static XYZ<double> Irradiance(const XYZ<double> &p, const XYZ<double> &n, unsigned depth, Rng &rng) {
+	XYZ<double> e = Direct(p, n);
+	if (depth == 0) return e;
+	XYZ<double> d = CosineSample(n, rng);
+	HitRec r = IntersectRay(p, d, LevelBVH, LevelLeaves);
+	if (!r.set()) return e;
+	XYZ<double> hn = Level.walls[r.wallno].normal;
+	if (hn.Dot(d) >= 0) return e; // Reached the back of a wall
+	XYZ<double> q = XYZ<double>(r.hit) + hn * SurfaceOffset;
+	return e + Irradiance(q, hn, depth - 1, rng) * Albedo;
+}
+
+// Checkpoint: the settings it was made with, then the sums of samples.
+struct CheckpointHeader {
+	char     magic[4]; // "LBCK"
+	uint32_t nwalls, bounces, samples, passes_done;
+	uint64_t texels;
+};
+
+static std::string CheckpointPath(const BakeSettings &s) { return s.dir + "/bake.ckpt"; }
+
+static void SaveCheckpoint(const BakeSettings &s, unsigned passes_done, const std::vector<float> &accum) {
+	CheckpointHeader h = {{'L', 'B', 'C', 'K'}, nwalls, s.bounces, s.samples, passes_done, accum.size() / 3};
+	std::string path = CheckpointPath(s), tmp = path + ".tmp";
+	FILE *fp = std::fopen(tmp.c_str(), "wb");
+	if (!fp) { std::perror(tmp.c_str()); return; }
+	bool ok = std::fwrite(&h, sizeof(h), 1, fp) == 1
+	       && std::fwrite(&accum[0], sizeof(float), accum.size(), fp) == accum.size();
+	ok = (std::fclose(fp) == 0) && ok;
+	if (ok) ok = std::rename(tmp.c_str(), path.c_str()) == 0;
+	if (!ok) std::fprintf(stderr, "%s: could not write checkpoint\n", path.c_str());
+}
+
+// Returns the number of passes already in accum, or 0 if there is no
+// usable checkpoint.
+static unsigned LoadCheckpoint(const BakeSettings &s, std::vector<float> &accum) {
+	FILE *fp = std::fopen(CheckpointPath(s).c_str(), "rb");
+	if (!fp) return 0;
+	CheckpointHeader h;
+	bool ok = std::fread(&h, sizeof(h), 1, fp) == 1 && !std::memcmp(h.magic, "LBCK", 4)
+	       && h.nwalls == nwalls && h.texels * 3 == accum.size()
+	       && h.bounces == s.bounces && h.samples == s.samples
+	       && std::fread(&accum[0], sizeof(float), accum.size(), fp) == accum.size();
+	std::fclose(fp);
+	if (!ok) {
+		std::fprintf(stderr, "%s: does not match these settings, starting over\n",
+					 CheckpointPath(s).c_str());
+		std::fill(accum.begin(), accum.end(), 0.f);
+		return 0;
+	}
+	return h.passes_done;
+}
+
+static bool WriteRaw(const std::string &path, const std::vector<float> &data) {
+	FILE *fp = std::fopen(path.c_str(), "wb");
+	if (!fp) { std::perror(path.c_str()); return false; }
+	bool ok = std::fwrite(&data[0], sizeof(float), data.size(), fp) == data.size();
+	return (std::fclose(fp) == 0) && ok;
+}
+
+// Turns the sums into lightmaps and writes them. Walls that are nowhere
+// brighter than 1.0 get no add-map, and any stale one is removed.
+static bool WriteLightmaps(const BakeSettings &s, const std::vector<WallLayout> &layout,
+						   const std::vector<float> &accum, unsigned nsamples) {
+	bool ok = true;
+	std::vector<float> lmap, smap;
+	for (unsigned wallno = 0; wallno < nwalls; ++wallno) {
+		const WallLayout &l = layout[wallno];
+		lmap.resize(l.w * l.h * 3);
+		smap.resize(l.w * l.h * 3);
+		bool bright = false;
+		for (size_t n = 0; n < lmap.size(); ++n) {
+			float e = accum[l.first * 3 + n] / nsamples + Ambient;
+			lmap[n] = std::min(e, 1.f);
+			smap[n] = e > 1 ? AddScale * (1 - 1 / e) : 0;
+			bright = bright || smap[n] > 0;
+		}
+		char Buf[64];
+		std::snprintf(Buf, 64, "/lmap/lmap%u.raw", wallno);
+		ok = WriteRaw(s.dir + Buf, lmap) && ok;
+		std::snprintf(Buf, 64, "/smap/smap%u.raw", wallno);
+		if (bright)
+			ok = WriteRaw(s.dir + Buf, smap) && ok;
+		else
+			std::remove((s.dir + Buf).c_str());
+	}
+	return ok;
+}
+
+// Reads a whole .raw file of exactly count floats. A missing add-map
+// reads as zeros, as the renderer treats it.
+static bool ReadRaw(const std::string &path, size_t count, std::vector<float> &out, bool optional) {
+	out.assign(count, 0.f);
+	FILE *fp = std::fopen(path.c_str(), "rb");
+	if (!fp) {
+		if (!optional) std::perror(path.c_str());
+		return optional;
+	}
+	size_t got = std::fread(&out[0], sizeof(float), count, fp);
+	bool extra = std::fgetc(fp) != EOF;
+	std::fclose(fp);
+	if (got != count || extra) std::fprintf(stderr, "%s: expected %zu floats\n", path.c_str(), count);
+	return got == count && !extra;
+}
+
+// Compares the maps in s.dir with those in s.check. Prints the difference
+// of each kind of map and of the walls that differ most, and returns
+// whether they are within the tolerances.
+static bool CheckLightmaps(const BakeSettings &s, const std::vector<WallLayout> &layout) {
+	static const char *const kinds[2] = {"lmap", "smap"};
+	const double max_error[2] = {CheckLmapError, CheckSmapError};
+	const double max_energy[2] = {CheckLmapEnergy, CheckSmapEnergy};
+	bool ok = true;
+	std::printf("Comparing %s with %s\n", s.dir.c_str(), s.check.c_str());
+	for (unsigned k = 0; k < 2; ++k) {
+		double error = 0, baked = 0, reference = 0, worst = 0;
+		unsigned worst_wall = 0;
+		size_t count = 0;
+		std::vector<float> a, b;
+		for (unsigned wallno = 0; wallno < nwalls; ++wallno) {
+			const size_t n = size_t(layout[wallno].w) * layout[wallno].h * 3;
+			char Buf[64];
+			std::snprintf(Buf, 64, "/%s/%s%u.raw", kinds[k], kinds[k], wallno);
+			if (!ReadRaw(s.dir + Buf, n, a, k == 1) || !ReadRaw(s.check + Buf, n, b, k == 1)) return false;
+			double wall_error = 0;
+			for (size_t i = 0; i < n; ++i) {
+				wall_error += std::abs(a[i] - b[i]);
+				baked += a[i];
+				reference += b[i];
+			}
+			error += wall_error;
+			count += n;
+			if (wall_error / n > worst) { worst = wall_error / n; worst_wall = wallno; }
+		}
+		error /= count;
+		double energy = reference > 0 ? baked / reference - 1 : 0;
+		bool good = error <= max_error[k] && std::abs(energy) <= max_energy[k];
+		std::printf("%s: mean difference %.4f (at most %.2f), energy %+.1f%% (at most %.0f%%), "
+					"worst wall %u at %.4f: %s\n", kinds[k], error, max_error[k], energy * 100,
+					max_energy[k] * 100, worst_wall, worst, good ? "ok" : "FAILED");
+		ok = ok && good;
+	}
+	return ok;
+}
+
+static bool ParseArgs(int argc, char **argv, BakeSettings &s) {
+	s.dir = "light-baked";
+	s.samples = 4;
+	s.bounces = 1;
+	s.passes = 1;
+	s.threads = 0;
+	s.resume = false;
+	for (int a = 1; a < argc; ++a) {
+		std::string arg = argv[a];
+		if (arg == "-r") { s.resume = true; continue; }
+		if (a + 1 >= argc) return false;
+		const char *v = argv[++a];
+		if      (arg == "-o") s.dir = v;
+		else if (arg == "-check") s.check = v;
+		else if (arg == "-level") { if (!LevelFile::Current().Open(v)) return false; }
+		else if (arg == "-s") s.samples = std::max(1, std::atoi(v));
+		else if (arg == "-b") s.bounces = std::max(0, std::atoi(v));
+		else if (arg == "-p") s.passes = std::max(1, std::atoi(v));
+		else if (arg == "-t") s.threads = std::max(0, std::atoi(v));
+		else return false;
+	}
+	return true;
+}
+
+int main(int argc, char **argv) {
+	BakeSettings s;
+	if (!ParseArgs(argc, argv, s)) {
+		std::fprintf(stderr, "Usage: %s [-level file] [-o dir] [-check dir] [-s samples] [-b bounces] [-p passes] [-t threads] [-r]\n", argv[0]);
+		return 1;
+	}
+
+	nwalls = Level.walls.size();
+	LevelBVH.Build(Level.walls);
+	LevelLeaves.Build(Level.walls, LevelBVH);
+	std::vector<WallLayout> layout(nwalls);
+	size_t texels = 0;
+	for (unsigned wallno = 0; wallno < nwalls; ++wallno) {
+		layout[wallno].w = Level.walls[wallno].lmap_w;
+		layout[wallno].h = Level.walls[wallno].lmap_h;
+		layout[wallno].first = texels;
+		texels += layout[wallno].w * layout[wallno].h;
+	}
+
+	mkdir(s.dir.c_str(), 0777);
+	mkdir((s.dir + "/lmap").c_str(), 0777);
+	mkdir((s.dir + "/smap").c_str(), 0777);
+
+	std::vector<float> accum(texels * 3, 0.f);
+	unsigned done = s.resume ? LoadCheckpoint(s, accum) : 0;
+
+	WorkStealingPool pool(s.threads);
+	std::printf("Baking %u walls, %zu texels: %u samples x %u passes, %u bounces, %u threads\n",
+				nwalls, texels, s.samples, s.passes, s.bounces, pool.Threads());
+	if (done) std::printf("Resuming after pass %u\n", done);
+
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned pass = done; pass < s.passes; ++pass) {
+		auto t = std::chrono::steady_clock::now();
+		pool.ParallelFor(0, texels, 1024, [&](size_t first, size_t last, unsigned) {
+			// Find the wall of the first texel; chunks may span walls.
+			unsigned wallno = 0;
+			while (wallno + 1 < nwalls && layout[wallno + 1].first <= first) ++wallno;
+			for (size_t i = first; i < last; ++i) {
+				while (layout[wallno].first + layout[wallno].w * layout[wallno].h <= i) ++wallno;
+				const WallLayout &l = layout[wallno];
+				const WallData &m = Level.walls[wallno];
+				XYZ<double> p0 = m.p[0], v10 = WallEdge<0,1>(m), v30 = WallEdge<0,3>(m);
+				XYZ<double> n = m.normal;
+				unsigned x = (i - l.first) % l.w, y = (i - l.first) / l.w;
+
+				XYZ<double> sum = {{0, 0, 0}};
+				for (unsigned k = 0; k < s.samples; ++k) {
+					Rng rng(i, uint64_t(pass) * s.samples + k);
+					// The first sample of a bake is at the texel centre,
+					// the rest are jittered across the texel.
+					double jx = pass + k ? rng.Next() : 0.5, jy = pass + k ? rng.Next() : 0.5;
+					XYZ<double> p = p0 + v30 * ((x + jx) / l.w) + v10 * ((y + jy) / l.h)
+								  + n * SurfaceOffset;
+					sum += Irradiance(p, n, s.bounces, rng);
+				}
+				for (unsigned c = 0; c < 3; ++c) accum[i * 3 + c] += sum.d[c];
+			}
+		});
+		double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+		std::printf("Pass %u/%u: %.2f s, %.0f texels/s, %.0f samples/s\n", pass + 1, s.passes,
+					secs, texels / secs, texels * s.samples / secs);
+
+		SaveCheckpoint(s, pass + 1, accum);
+		if (!WriteLightmaps(s, layout, accum, (pass + 1) * s.samples)) return 1;
+	}
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	if (s.passes > done)
+		std::printf("Done in %.2f s, %.0f texels/s\n", secs, texels * (s.passes - done) / secs);
+	if (!s.check.empty() && !CheckLightmaps(s, layout)) return 1;
+	return 0;
+}
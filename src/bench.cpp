@@ -0,0 +1,163 @@
+// Ray query benchmark.
+// Compares IntersectRay over a BVH, over a BVH whose leaves are tested with
+// the SIMD kernel, and over a WallSoA with each SIMD kernel this CPU
+// supports, with the linear scan over every wall, on levels
+// made of more and more copies of map.hpp laid side by side. Checks that
+// the BVH returns the same hit for every ray as the linear scan, that the
+// kernels agree with each other exactly, and with the linear scan to
+// within float precision.
+//
+// Usage: bench [rays] [max copies]
+#include <chrono>  // For std::chrono::steady_clock
+#include <cmath>   // For std::abs
+#include <cstdio>  // For std::printf
+#include <cstdlib> // For std::atoi
+#include <cstring> // For std::memcmp
+#include <vector>  // For std::vector, in which we store the walls
+
+#include "map.hpp"
+#include "math.hpp"
+#include "bvh.hpp"
+#include "raysimd.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+static double Seconds(Clock::time_point since) {
+	return std::chrono::duration<double>(Clock::now() - since).count();
+}
+
+struct Ray { XYZ<float> org, dir; };
+
+// Deterministic random numbers in [0,1).
+static float Random(unsigned &seed) {
+	seed = seed * 1664525u + 1013904223u;
+	return (seed >> 8) * (1.f / 16777216.f);
+}
+
+static bool SameHit(const HitRec &a, const HitRec &b) {
+	return a.wallno == b.wallno && (!a.set() ||
+		(a.distance == b.distance && a.alpha == b.alpha && a.beta == b.beta
+		 && !std::memcmp(&a.hit, &b.hit, sizeof(a.hit))));
+}
+
+// The SIMD kernels compute in float throughout, where IntersectRay divides
+// in double, so their results may differ in the last bits. Where two walls
+// meet, that can also decide which of them is hit first.
+const float Epsilon = 1e-4f;
+
+static bool CloseHit(const HitRec &a, const HitRec &b) {
+	if (a.set() != b.set()) return false;
+	if (!a.set()) return true;
+	float tolerance = Epsilon * std::max(1.f, a.distance);
+	if (std::abs(a.distance - b.distance) > tolerance) return false;
+	return a.wallno != b.wallno
+	    || (std::abs(a.alpha - b.alpha) <= Epsilon && std::abs(a.beta - b.beta) <= Epsilon);
+}
+
+int main(int argc, char **argv) {
+	const unsigned nrays = argc > 1 ? std::atoi(argv[1]) : 200000;
+	const unsigned max_copies = argc > 2 ? std::atoi(argv[2]) : 64;
+	const unsigned nwalls = sizeof(map) / sizeof(*map);
+
+	// Extent of the original level, so that copies do not overlap.
+	XYZ<float> lo = map[0].p[0], hi = map[0].p[0];
+	for (const auto &m : map)
+		for (const auto &p : m.p)
+			for (unsigned c = 0; c < 3; ++c) {
+				lo.d[c] = std::min(lo.d[c], p.d[c]);
+				hi.d[c] = std::max(hi.d[c], p.d[c]);
+			}
+	const float stride = hi.d[0] - lo.d[0] + 1;
+
+	std::vector<RayKernel> kernels;
+	for (unsigned k = 0; k < NumRayKernels; ++k)
+		if (RayKernelSupported(RayKernel(k))) kernels.push_back(RayKernel(k));
+	std::printf("Best kernel on this CPU: %s\n", RayKernelName(BestRayKernel()));
+
+	std::printf("%8s %8s %14s %14s %8s %14s %8s", "walls", "nodes", "linear rays/s", "bvh rays/s", "speedup",
+				"bvh+simd", "speedup");
+	for (RayKernel k : kernels) std::printf(" %9s rays/s %8s", RayKernelName(k), "speedup");
+	std::printf(" %10s\n", "build ms");
+	for (unsigned copies = 1; copies <= max_copies; copies *= 2) {
+		// Lay the copies out on a square grid in the x,y plane.
+		unsigned side = 1;
+		while (side * side < copies) ++side;
+		std::vector<maptype> level;
+		for (unsigned n = 0; n < copies; ++n) {
+			XYZ<float> offset = {{(n % side) * stride, (n / side) * stride, 0}};
+			for (const auto &m : map) {
+				maptype w = m;
+				for (auto &p : w.p) p += offset;
+				level.push_back(w);
+			}
+		}
+
+		// Rays start anywhere within some copy, in any direction.
+		std::vector<Ray> rays(nrays);
+		unsigned seed = 1;
+		for (auto &r : rays) {
+			unsigned n = unsigned(Random(seed) * copies);
+			for (unsigned c = 0; c < 3; ++c)
+				r.org.d[c] = lo.d[c] + Random(seed) * (hi.d[c] - lo.d[c]);
+			r.org.d[0] += (n % side) * stride;
+			r.org.d[1] += (n / side) * stride;
+			do {
+				for (unsigned c = 0; c < 3; ++c) r.dir.d[c] = Random(seed) * 2 - 1;
+			} while (r.dir.Squared() < 1e-4f);
+		}
+
+		Clock::time_point t0 = Clock::now();
+		BVH bvh;
+		bvh.Build(level);
+		double build = Seconds(t0);
+
+		std::vector<HitRec> expected(nrays);
+		t0 = Clock::now();
+		for (unsigned n = 0; n < nrays; ++n) expected[n] = IntersectRay(rays[n].org, rays[n].dir, level);
+		double linear = Seconds(t0);
+
+		std::vector<HitRec> found(nrays);
+		t0 = Clock::now();
+		for (unsigned n = 0; n < nrays; ++n) found[n] = IntersectRay(rays[n].org, rays[n].dir, level, bvh);
+		double fast = Seconds(t0);
+		unsigned mismatches[3] = { 0, 0, 0 };
+
+		std::printf("%8u %8u %14.0f %14.0f %7.1fx", copies * nwalls, unsigned(bvh.nodes.size()),
+					nrays / linear, nrays / fast, linear / fast);
+		for (unsigned n = 0; n < nrays; ++n)
+			if (!SameHit(expected[n], found[n])) ++mismatches[0];
+
+		WallSoA leaves;
+		leaves.Build(level, bvh);
+		t0 = Clock::now();
+		for (unsigned n = 0; n < nrays; ++n) found[n] = IntersectRay(rays[n].org, rays[n].dir, bvh, leaves);
+		double leafsimd = Seconds(t0);
+		std::printf(" %14.0f %7.1fx", nrays / leafsimd, linear / leafsimd);
+		for (unsigned n = 0; n < nrays; ++n)
+			if (!CloseHit(expected[n], found[n])) ++mismatches[2];
+
+		WallSoA soa;
+		soa.Build(level);
+		std::vector<HitRec> first(nrays);
+		for (RayKernel k : kernels) {
+			t0 = Clock::now();
+			for (unsigned n = 0; n < nrays; ++n) found[n] = IntersectRay(rays[n].org, rays[n].dir, soa, k);
+			double simd = Seconds(t0);
+			std::printf(" %16.0f %7.1fx", nrays / simd, linear / simd);
+			for (unsigned n = 0; n < nrays; ++n) {
+				if (k == kernels[0]) first[n] = found[n];
+				else if (!SameHit(first[n], found[n])) ++mismatches[1];
+				if (!CloseHit(expected[n], found[n])) ++mismatches[2];
+			}
+		}
+		std::printf(" %10.2f\n", build * 1e3);
+
+		if (mismatches[0] || mismatches[1] || mismatches[2]) {
+			std::printf("%u of %u rays hit something else with the BVH\n", mismatches[0], nrays);
+			std::printf("%u kernel results differ from the %s kernel\n", mismatches[1], RayKernelName(kernels[0]));
+			std::printf("%u kernel results are not within %g of the linear scan\n", mismatches[2], Epsilon);
+			return 1;
+		}
+	}
+	return 0;
+}
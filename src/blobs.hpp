@@ -0,0 +1,201 @@
+// The blobs thrown around by the player.
+// Blobs are stored structure-of-arrays style in one pool: each property
+// lives in its own contiguous array, indexed by a dense blob index, so the
+// per-tick update streams through memory and splits evenly across threads.
+// Awake blobs are kept at the front of the arrays; a blob that comes to
+// rest on the ground (BlobActor's "moving" going false) is swapped behind
+// them and costs nothing per tick until it is woken.
+//
+// Since dense indices change as blobs are swapped around, blobs are named
+// from outside by handles, which stay valid until the blob is removed and
+// are never reused for another blob.
+#pragma once
+
+#include <cstdint> // For uint32_t
+#include <utility> // For std::swap
+#include <vector>  // For std::vector, in which we store the blobs
+
+#include "actor.hpp"
+#include "jobs.hpp"
+#include "levelfile.hpp"
+
+struct BlobHandle {
+    uint32_t slot, generation;
+};
+
+class BlobPool {
+    public:
+    // Properties of the blobs, by dense index.
+    std::vector<XYZ<double> > camera, vel, fatness, center, fluctuation;
+    std::vector<XYZ<double> > shape; // Fatness at spawn time, used for collisions
+    std::vector<XYZ<double> > previous; // Camera at the previous tick
+    std::vector<const EllipsoidWalls<GLfloat>*> walls; // The map, scaled for shape
+    std::vector<uint32_t> seed;      // For Fluctuate
+    std::vector<unsigned char> moving, ground;
+
+    BlobPool() : awake(0), level(LevelFile::Current().Generation()) {}
+
+    size_t Size() const { return camera.size(); }
+    size_t Awake() const { return awake; } // The first Awake() blobs are awake
+
+    BlobHandle Spawn(const XYZ<double>& pos, const XYZ<double>& velocity, const XYZ<double>& size,
+                     const XYZ<double>& centre = XYZ<double>{{0, 0, 0}}) {
+        uint32_t s;
+        if (!free_slots.empty()) {
+            s = free_slots.back();
+            free_slots.pop_back();
+        } else {
+            s = slot_index.size();
+            slot_index.push_back(0);
+            slot_generation.push_back(0);
+        }
+        size_t n = Size();
+        slot_index[s] = n;
+        slot_of.push_back(s);
+        camera.push_back(pos);
+        vel.push_back(velocity);
+        fatness.push_back(size);
+        center.push_back(centre);
+        fluctuation.push_back(XYZ<double>{{0, 0, 0}});
+        shape.push_back(size);
+        previous.push_back(pos);
+        walls.push_back(&EllipsoidWalls<GLfloat>::For(LevelFile::Current().walls, size));
+        seed.push_back((s * 2654435761u + slot_generation[s]) | 1); // Never 0
+        moving.push_back(true);
+        ground.push_back(false);
+        Swap(n, awake++);
+        return BlobHandle{ s, slot_generation[s] };
+    }
+
+    bool Alive(BlobHandle h) const {
+        return h.slot < slot_generation.size() && slot_generation[h.slot] == h.generation;
+    }
+
+    // Dense index of a live blob.
+    size_t Index(BlobHandle h) const { return slot_index[h.slot]; }
+
+    void Remove(BlobHandle h) {
+        if (!Alive(h)) return;
+        size_t n = Index(h);
+        if (n < awake) {
+            Swap(n, --awake);
+            n = awake;
+        }
+        Swap(n, Size() - 1);
+        ++slot_generation[h.slot];
+        free_slots.push_back(h.slot);
+        slot_of.pop_back();
+        camera.pop_back(); vel.pop_back(); fatness.pop_back(); center.pop_back();
+        fluctuation.pop_back(); shape.pop_back(); previous.pop_back(); walls.pop_back(); seed.pop_back();
+        moving.pop_back(); ground.pop_back();
+    }
+
+    // Sets a resting blob moving again, e.g. after pushing it.
+    void Wake(BlobHandle h) {
+        if (!Alive(h)) return;
+        size_t n = Index(h);
+        if (n >= awake) Swap(n, awake++);
+        moving[Index(h)] = true;
+    }
+
+    // Advances every awake blob by one tick, spread over the pool's threads,
+    // then moves the ones that came to rest behind the awake ones.
+    // If another level has been opened since, the blobs collide with that.
+    void Update(WorkStealingPool& pool) {
+        PROFILE_SCOPE("BlobPool::Update");
+        if (level != LevelFile::Current().Generation()) {
+            level = LevelFile::Current().Generation();
+            for (size_t n = 0; n < Size(); ++n)
+                walls[n] = &EllipsoidWalls<GLfloat>::For(LevelFile::Current().walls, shape[n]);
+        }
+        pool.ParallelFor(0, awake, 64, [this](size_t first, size_t last, unsigned) {
+            for (size_t n = first; n < last; ++n) Step(n);
+        });
+        for (size_t n = 0; n < awake; )
+            if (moving[n]) ++n;
+            else {
+                previous[n] = camera[n]; // Render it where it stopped
+                Swap(n, --awake);
+            }
+    }
+
+    // Where to render blob n, alpha of the way from the previous tick to
+    // the last one.
+    XYZ<double> Interpolated(size_t n, double alpha) const {
+        return previous[n] + (camera[n] - previous[n]) * alpha;
+    }
+
+    private:
+    std::vector<uint32_t> slot_index, slot_generation, free_slots; // By slot
+    std::vector<uint32_t> slot_of; // By dense index
+    size_t awake;
+    unsigned level; // LevelFile::Generation() that walls are of
+
+    void Swap(size_t a, size_t b) {
+        if (a == b) return;
+        std::swap(camera[a], camera[b]);
+        std::swap(vel[a], vel[b]);
+        std::swap(fatness[a], fatness[b]);
+        std::swap(center[a], center[b]);
+        std::swap(fluctuation[a], fluctuation[b]);
+        std::swap(shape[a], shape[b]);
+        std::swap(previous[a], previous[b]);
+        std::swap(walls[a], walls[b]);
+        std::swap(seed[a], seed[b]);
+        std::swap(moving[a], moving[b]);
+        std::swap(ground[a], ground[b]);
+        std::swap(slot_of[a], slot_of[b]);
+        slot_index[slot_of[a]] = a;
+        slot_index[slot_of[b]] = b;
+    }
+
+    // BlobActor::Update for an actor that has let go of the controls,
+    // followed by BlobActor::Fluctuate. Touches only blob n, so that blobs
+    // can be stepped in parallel.
+    void Step(size_t n) {
+        previous[n] = camera[n];
+
+        // Slow down horizontally, as an actor does after pushing.
+        const double deceleration = 0.1;
+        vel[n].d[0] *= 1 - deceleration;
+        vel[n].d[2] *= 1 - deceleration;
+
+        // Collide horizontally, then vertically; see BlobActor::Update.
+        ground[n] = false;
+        double yvel = std::max(vel[n].d[1] + gravity, terminalvelocity);
+        vel[n].d[1] = 0.0;
+        XYZ<double> pos = camera[n] - center[n];
+        CollideAndSlide(pos, vel[n], shape[n], *walls[n]);
+        if (CollideAndSlide(pos, XYZ<double>{{0, yvel, 0}}, shape[n], *walls[n])) {
+            if (yvel < 0) ground[n] = true;
+            yvel = 0.0;
+        }
+        vel[n].d[1] = yvel;
+        camera[n] = pos + center[n];
+        if (vel[n].Squared() < 1e-9) {
+            vel[n] *= 0.;
+            if (ground[n]) moving[n] = false;
+        }
+
+        // Wobble without changing size. The collision shape stays as it
+        // was, so that every blob of one size shares its scaled walls.
+        XYZ<double>& f = fatness[n];
+        double fatsize = f.Len();
+        f += fluctuation[n];
+        for (unsigned c = 0; c < 3; ++c) {
+            fluctuation[n].d[c] += (Random(seed[n]) - 0.5) * 2.0 * 0.3;
+            if (fluctuation[n].d[c] < -0.5) fluctuation[n].d[c] = -0.3;
+            if (fluctuation[n].d[c] > 0.5) fluctuation[n].d[c] = 0.3;
+            if (f.d[c] < 0.4) f.d[c] = 0.4;
+            if (f.d[c] > 1.0) f.d[c] = 1.0;
+        }
+        f *= fatsize / f.Len();
+    }
+
+    // Per-blob random numbers in [0,1), instead of rand(), which is
+    // neither thread-safe nor repeatable when blobs run in parallel.
+    static double Random(uint32_t& s) {
+        s ^= s << 13; s ^= s >> 17; s ^= s << 5; // xorshift32
+        return s * (1.0 / 4294967296.0);
+    }
+};
@@ -0,0 +1,218 @@
+// Bounding volume hierarchy over the walls of a map, for ray queries.
+// Built with the surface area heuristic, and stored flattened in depth-first
+// order: an inner node's first child follows it directly, and it records
+// where the second one is, so traversal walks an array and a small stack.
+#pragma once
+
+#include <algorithm> // For std::sort, std::min, std::max
+#include <cstdint>   // For uint16_t, uint32_t
+#include <limits>    // For std::numeric_limits
+#include <vector>    // For std::vector, in which we store the nodes
+
+#include "math.hpp"
+
+struct BVHNode {
+    float    lo[3], hi[3]; // Bounds of everything below this node
+    uint32_t index;        // Leaf: first entry in prims; inner: second child
+    uint16_t count;        // Leaf: number of walls; inner: 0
+    uint16_t axis;         // Inner: axis the children were split along
+};
+static_assert(sizeof(BVHNode) == 32, "two BVH nodes should fit in a cache line");
+
+class BVH {
+    public:
+    std::vector<BVHNode> nodes;
+    std::vector<uint32_t> prims; // Wall numbers, grouped by leaf
+
+    // Builds the hierarchy over every wall of map.
+    template<typename M>
+    void Build(const M& map) {
+        std::vector<Item> items;
+        uint32_t wallno = 0;
+        for (const auto& m : map) {
+            Item it;
+            it.wallno = wallno++;
+            for (unsigned c = 0; c < 3; ++c) {
+                it.lo[c] = it.hi[c] = m.p[0].d[c];
+                for (unsigned e = 1; e < 4; ++e) {
+                    it.lo[c] = std::min(it.lo[c], float(m.p[e].d[c]));
+                    it.hi[c] = std::max(it.hi[c], float(m.p[e].d[c]));
+                }
+                // Walls are flat. Give their boxes some thickness, so that
+                // a ray grazing along one is not lost to rounding.
+                it.lo[c] -= Margin;
+                it.hi[c] += Margin;
+            }
+            items.push_back(it);
+        }
+        nodes.clear();
+        prims.clear();
+        if (!items.empty()) Split(items, 0, items.size(), 0);
+    }
+
+    // Deepest a tree can get, which bounds the traversal stack.
+    static const unsigned MaxDepth = 48;
+
+    private:
+    static constexpr float Margin = 1e-4f;
+    static constexpr float TraversalCost = 1.0f; // Relative to one wall test
+    static const unsigned MaxLeafSize = 4;
+
+    struct Item {
+        float lo[3], hi[3];
+        uint32_t wallno;
+        float Center(unsigned c) const { return lo[c] + hi[c]; }
+    };
+
+    struct Box {
+        float lo[3], hi[3];
+        Box() {
+            for (unsigned c = 0; c < 3; ++c) {
+                lo[c] = std::numeric_limits<float>::max();
+                hi[c] = -std::numeric_limits<float>::max();
+            }
+        }
+        void Grow(const Item& it) {
+            for (unsigned c = 0; c < 3; ++c) {
+                lo[c] = std::min(lo[c], it.lo[c]);
+                hi[c] = std::max(hi[c], it.hi[c]);
+            }
+        }
+        float Area() const {
+            float dx = hi[0] - lo[0], dy = hi[1] - lo[1], dz = hi[2] - lo[2];
+            return 2 * (dx * dy + dy * dz + dz * dx);
+        }
+    };
+
+    // Creates the node for items [first, last), and returns its index.
+    uint32_t Split(std::vector<Item>& items, size_t first, size_t last, unsigned depth) {
+        uint32_t self = nodes.size();
+        nodes.push_back(BVHNode());
+        Box box;
+        for (size_t n = first; n < last; ++n) box.Grow(items[n]);
+        for (unsigned c = 0; c < 3; ++c) {
+            nodes[self].lo[c] = box.lo[c];
+            nodes[self].hi[c] = box.hi[c];
+        }
+
+        // Find the cheapest split of the items sorted along each axis, with
+        // cost = traversal + sum over both sides of (area fraction * items).
+        const size_t count = last - first;
+        float best_cost = std::numeric_limits<float>::max();
+        unsigned best_axis = 0;
+        size_t best_split = 0;
+        std::vector<float> right_area(count);
+        for (unsigned axis = 0; count > 1 && axis < 3; ++axis) {
+            SortAlong(items, first, last, axis);
+            Box right;
+            for (size_t n = count; n-- > 1; ) {
+                right.Grow(items[first + n]);
+                right_area[n] = right.Area();
+            }
+            Box left;
+            for (size_t n = 1; n < count; ++n) {
+                left.Grow(items[first + n - 1]);
+                float cost = TraversalCost + (left.Area() * n + right_area[n] * (count - n)) / box.Area();
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_split = n;
+                }
+            }
+        }
+
+        if ((count <= MaxLeafSize && best_cost >= count) || depth + 1 == MaxDepth) {
+            // Cheaper to test the walls than to split them any further.
+            nodes[self].index = prims.size();
+            nodes[self].count = count;
+            nodes[self].axis = 0;
+            for (size_t n = first; n < last; ++n) prims.push_back(items[n].wallno);
+            return self;
+        }
+        if (best_axis != 2) SortAlong(items, first, last, best_axis);
+        Split(items, first, first + best_split, depth + 1);
+        uint32_t second = Split(items, first + best_split, last, depth + 1);
+        nodes[self].index = second;
+        nodes[self].count = 0;
+        nodes[self].axis = best_axis;
+        return self;
+    }
+
+    static void SortAlong(std::vector<Item>& items, size_t first, size_t last, unsigned axis) {
+        std::sort(items.begin() + first, items.begin() + last,
+                  [axis](const Item& a, const Item& b) {
+                      return a.Center(axis) != b.Center(axis)
+                           ? a.Center(axis) < b.Center(axis) : a.wallno < b.wallno;
+                  });
+    }
+};
+
+// Walks the boxes of bvh that the ray passes through, nearest first, and
+// calls test(index, result, best) on each leaf node among them, which keeps
+// in result and best whichever of its walls is hit nearer than best.
+// Stops descending into boxes that begin beyond the nearest hit so far.
+template<typename T, typename K, typename LeafTest>
+HitRec TraceBVH(const XYZ<T>& org, const XYZ<K>& dir, const BVH& bvh, LeafTest test) {
+    HitRec result;
+    if (bvh.nodes.empty()) return result;
+    T best = T();
+
+    T inv[3];
+    for (unsigned c = 0; c < 3; ++c) inv[c] = T(1) / dir.d[c];
+
+    uint32_t stack[BVH::MaxDepth + 1];
+    unsigned depth = 0;
+    stack[depth++] = 0;
+    while (depth) {
+        uint32_t index = stack[--depth];
+        const BVHNode& node = bvh.nodes[index];
+
+        // Slab test. A zero direction component gives infinities, which
+        // work out, unless the origin is exactly on the slab: then NaN,
+        // which fails neither comparison, so the box is simply kept.
+        T tmin = 0, tmax = result.set() ? best : std::numeric_limits<T>::max();
+        for (unsigned c = 0; c < 3; ++c) {
+            T t0 = (node.lo[c] - org.d[c]) * inv[c];
+            T t1 = (node.hi[c] - org.d[c]) * inv[c];
+            if (t0 > t1) std::swap(t0, t1);
+            if (t0 > tmin) tmin = t0;
+            if (t1 < tmax) tmax = t1;
+        }
+        if (tmin > tmax) continue;
+
+        if (node.count == 0) {
+            // Visit the child nearer to the origin first.
+            uint32_t near = index + 1, far = node.index;
+            if (dir.d[node.axis] < 0) std::swap(near, far);
+            stack[depth++] = far;
+            stack[depth++] = near;
+            continue;
+        }
+        test(index, result, best);
+    }
+    if(result.set()) result.hit = org + dir * result.distance;
+    return result;
+}
+
+// Same as IntersectRay(org, dir, map), but only tests the walls whose
+// bounding boxes the ray passes through (see TraceBVH).
+template<typename T, typename K, typename M>
+HitRec IntersectRay(const XYZ<T>& org, const XYZ<K>& dir, const M& map, const BVH& bvh) {
+    return TraceBVH(org, dir, bvh, [&](uint32_t index, HitRec& result, T& best) {
+        const BVHNode& node = bvh.nodes[index];
+        for (unsigned n = 0; n < node.count; ++n) {
+            uint32_t wallno = bvh.prims[node.index + n];
+            T t;
+            float alpha, beta;
+            if (!IntersectQuad(org, dir, map[wallno], t, alpha, beta)) continue;
+            // Equal distances go to the lower wall number, as in the linear scan.
+            if (!result.set() || t < best || (t == best && wallno < result.wallno)) {
+                result.wallno   = wallno;
+                result.distance = t;
+                result.alpha    = alpha;
+                result.beta     = beta;
+                best = t;
+            }
+        }
+    });
+}
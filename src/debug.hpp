@@ -22,19 +22,152 @@ static const char* GetGLErrorStr(GLenum err) {
     }
 }
 
-inline bool CheckGLError(std::string where = "Unknown") {
-    while (true) {
-        const GLenum err = glGetError();
-        if (GL_NO_ERROR == err)
-            break;
+// Set by GLDebugMessage, when the GL reports an error through KHR_debug.
+static bool GLDebugOutput = false, GLDebugError = false;
 
-        std::cout << where << ": " "GL Error: " << GetGLErrorStr(err) << std::endl;
-        // exit(1);
-        return true;
+static void APIENTRY GLDebugMessage(GLenum, GLenum type, GLuint, GLenum severity,
+                                    GLsizei, const GLchar* message, const void*) {
+    if (type == GL_DEBUG_TYPE_ERROR) GLDebugError = true;
+    else if (severity != GL_DEBUG_SEVERITY_HIGH) return;
+    std::cout << "GL: " << message << std::endl;
+}
+
+// Has the GL report errors as they happen, where KHR_debug is available,
+// so that CheckGLError needs not ask it with glGetError, which can stall.
+inline void InstallGLDebugOutput() {
+    if (!GLEW_KHR_debug) return;
+    glEnable(GL_DEBUG_OUTPUT);
+    glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS); // Report from within the failing call
+    glDebugMessageCallback(GLDebugMessage, NULL);
+    glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_NOTIFICATION, 0, NULL, GL_FALSE);
+    GLDebugOutput = true;
+}
+
+// Whether the GL has reported an error since the last check. Meant to be
+// called once per frame or so, rather than after every few calls.
+inline bool CheckGLError(const char* where = "Unknown") {
+    if (GLDebugOutput) {
+        bool error = GLDebugError;
+        GLDebugError = false;
+        if (error) std::cout << where << ": GL Error reported above" << std::endl;
+        return error;
     }
-    return false;
+    const GLenum err = glGetError();
+    if (err == GL_NO_ERROR) return false;
+    std::cout << where << ": " "GL Error: " << GetGLErrorStr(err) << std::endl;
+    return true;
 }
 
 inline void debug(std::string msg) {
 	std::cout << msg << std::endl;
-}
\ No newline at end of file
+}
+
+// What was submitted to OpenGL, counted by the wrappers in glcalls.hpp.
+struct GLCounts {
+    unsigned draw_calls;       // Draw calls, immediate-mode glBegin and display lists
+    unsigned vertices;         // Vertices drawn by them
+    unsigned texture_binds;    // glBindTexture calls
+    unsigned state_changes;    // Other calls that set state
+    unsigned redundant_states; // Binds and state changes to what was set already
+    size_t upload_bytes;       // Texture and buffer data sent from the CPU
+
+    GLCounts() { Reset(); }
+    void Reset() {
+        draw_calls = vertices = texture_binds = state_changes = redundant_states = 0;
+        upload_bytes = 0;
+    }
+    GLCounts operator-(const GLCounts& b) const {
+        GLCounts d;
+        d.draw_calls = draw_calls - b.draw_calls;
+        d.vertices = vertices - b.vertices;
+        d.texture_binds = texture_binds - b.texture_binds;
+        d.state_changes = state_changes - b.state_changes;
+        d.redundant_states = redundant_states - b.redundant_states;
+        d.upload_bytes = upload_bytes - b.upload_bytes;
+        return d;
+    }
+    void Print(std::ostream& out) const {
+        out << draw_calls << " draw calls, " << vertices << " vertices, "
+            << texture_binds << " texture binds, " << state_changes << " state changes ("
+            << redundant_states << " redundant), " << upload_bytes << " bytes uploaded";
+    }
+};
+
+// What was left out of a view before reaching OpenGL.
+struct CullCounts {
+    unsigned pvs_walls;     // Walls not in the potentially visible set
+    unsigned frustum_walls; // Walls in it, but outside the view
+    unsigned spheres;       // Outside the view
+    unsigned portals;       // Facing away or outside the view
+
+    CullCounts() { Reset(); }
+    void Reset() { pvs_walls = frustum_walls = spheres = portals = 0; }
+    CullCounts operator-(const CullCounts& b) const {
+        CullCounts d;
+        d.pvs_walls = pvs_walls - b.pvs_walls;
+        d.frustum_walls = frustum_walls - b.frustum_walls;
+        d.spheres = spheres - b.spheres;
+        d.portals = portals - b.portals;
+        return d;
+    }
+    void Print(std::ostream& out) const {
+        out << "culled " << pvs_walls << " walls by PVS, " << frustum_walls << " walls, "
+            << spheres << " spheres and " << portals << " portals by frustum";
+    }
+};
+
+// Counters of what a frame submitted to OpenGL, reported every few seconds.
+struct FrameStats {
+    unsigned frame;
+    unsigned ticks;          // Simulation ticks run
+    unsigned spheres;        // Lights, players and blobs drawn
+    unsigned saved_calls;    // Immediate-mode calls replaced by level map draw calls
+    unsigned saved_vertices; // Vertices no longer sent from the CPU
+    GLCounts gl;             // For the whole frame
+    CullCounts cull;         // For the whole frame
+    std::vector<GLCounts> views; // For each world render (portal views + player view)
+    std::vector<CullCounts> view_culls; // Likewise
+    GLCounts last_gl;        // Of the frame before, kept by EndFrame
+    CullCounts last_cull;    // Likewise
+
+    FrameStats() : frame(0) { Reset(); }
+    void Reset() {
+        ticks = spheres = saved_calls = saved_vertices = 0;
+        gl.Reset();
+        cull.Reset();
+        views.clear();
+        view_culls.clear();
+    }
+    // Actor::Render brackets each view with these.
+    void BeginView() { view_start = gl; view_cull_start = cull; }
+    void EndView() {
+        views.push_back(gl - view_start);
+        view_culls.push_back(cull - view_cull_start);
+    }
+    void EndFrame(unsigned interval = 300) {
+        if (++frame % interval == 0) {
+            std::cout << "Frame " << frame << ": " << ticks << " ticks, " << views.size() << " views, ";
+            gl.Print(std::cout);
+            std::cout << ", " << spheres << " spheres, saved " << saved_calls
+                      << " GL calls and " << saved_vertices
+                      << " vertex submissions, ";
+            cull.Print(std::cout);
+            std::cout << std::endl;
+            for (size_t v = 0; v < views.size(); ++v) {
+                std::cout << "  view " << v << ": ";
+                views[v].Print(std::cout);
+                std::cout << ", ";
+                view_culls[v].Print(std::cout);
+                std::cout << std::endl;
+            }
+        }
+        last_gl = gl;
+        last_cull = cull;
+        Reset();
+    }
+
+    private:
+    GLCounts view_start;
+    CullCounts view_cull_start;
+};
+static FrameStats frameStats;
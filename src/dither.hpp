@@ -0,0 +1,225 @@
+// Palette dithering.
+// PaletteDither reduces a 32-bit image to a regular 7*9*4 palette of 252
+// colors with an ordered 8x8 Bayer dither, which with temporal dithering
+// also shifts from frame to frame. Pixels are 0xAARRGGBB words (GL_BGRA,
+// GL_UNSIGNED_BYTE in memory), and come out as the palette's colors, with
+// 6-bit channels like a VGA DAC's and alpha zero.
+//
+// The scalar kernel looks each channel up in ColorConvert and the sum of
+// the three in Pal, as the original per-pixel loop did. The vector kernels
+// work on bytes instead: the dither value of a pixel only depends on x & 7
+// in a row, so eight pixels (32 bytes) of a row compare each channel with
+// the same thresholds where its palette level steps up, and add up the
+// steps of its output for those it is above. Every kernel gives the same
+// image; a whole image is converted in bands of rows across a pool's
+// threads.
+#pragma once
+
+#include <algorithm> // For std::min
+#include <cmath>     // For std::pow
+#include <cstddef>   // For size_t
+#include <cstdint>   // For uint8_t, uint32_t
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DITHER_X86 1
+#include <immintrin.h>
+#endif
+
+#include "jobs.hpp"
+
+enum DitherKernel { DitherKernelScalar, DitherKernelSSE, DitherKernelAVX2, NumDitherKernels };
+
+inline const char* DitherKernelName(DitherKernel k) {
+    static const char* const names[NumDitherKernels] = { "scalar", "SSE", "AVX2" };
+    return names[k];
+}
+
+inline bool DitherKernelSupported(DitherKernel k) {
+#ifdef DITHER_X86
+    __builtin_cpu_init();
+    if (k == DitherKernelSSE) return __builtin_cpu_supports("sse2");
+    if (k == DitherKernelAVX2) return __builtin_cpu_supports("avx2");
+#endif
+    return k == DitherKernelScalar;
+}
+
+// The widest kernel this CPU can run.
+inline DitherKernel BestDitherKernel() {
+    static const DitherKernel best =
+        DitherKernelSupported(DitherKernelAVX2) ? DitherKernelAVX2 :
+        DitherKernelSupported(DitherKernelSSE)  ? DitherKernelSSE  : DitherKernelScalar;
+    return best;
+}
+
+class PaletteDither {
+    public:
+    static const unsigned DitheringBits = 6;
+    static const unsigned R = 7, G = 9, B = 4; // 7*9*4 regular palette (252 colors)
+    static constexpr double PaletteGamma = 1.5;  // Apply this gamma to palette
+    static constexpr double DitherGamma = 2.0 / PaletteGamma; // Apply this gamma to dithering
+    static const bool TemporalDithering = true;
+    static const unsigned Band = 16; // Rows per job of Image
+
+    unsigned char ColorConvert[3][256][256], Dither8x8[8][8];
+    uint32_t Pal[R * G * B];
+
+    PaletteDither() {
+        // Create bayer 8x8 dithering matrix.
+        for (unsigned y = 0; y < 8; ++y)
+            for (unsigned x = 0; x < 8; ++x)
+                Dither8x8[y][x] = ((x)&4) / 4u + ((x)&2) * 2u + ((x)&1) * 16u +
+                                  ((x ^ y) & 4) / 2u + ((x ^ y) & 2) * 4u +
+                                  ((x ^ y) & 1) * 32u;
+
+        // Create gamma-corrected look-up tables for dithering.
+        double dtab[256], ptab[256];
+        for (unsigned n = 0; n < 256; ++n) {
+            dtab[n] = (255.0 / 256.0) - std::pow(n / 256.0, 1 / DitherGamma);
+            ptab[n] = std::pow(n / 255.0, 1.0 / PaletteGamma);
+        }
+        for (unsigned n = 0; n < 256; ++n) {
+            for (unsigned d = 0; d < 256; ++d) {
+                ColorConvert[0][n][d] = std::min(B - 1, (unsigned)(ptab[n] * (B - 1) + dtab[d]));
+                ColorConvert[1][n][d] = B * std::min(G - 1, (unsigned)(ptab[n] * (G - 1) + dtab[d]));
+                ColorConvert[2][n][d] = G * B * std::min(R - 1, (unsigned)(ptab[n] * (R - 1) + dtab[d]));
+            }
+        }
+        unsigned char output[3][9]; // Byte of each level of each channel
+        for (unsigned level = 0; level < 9; ++level) {
+            output[0][level] = 4 * (int)(std::pow(std::min(level, B - 1) * 1. / (B - 1), PaletteGamma) * 63);
+            output[1][level] = 4 * (int)(std::pow(std::min(level, G - 1) * 1. / (G - 1), PaletteGamma) * 63);
+            output[2][level] = 4 * (int)(std::pow(std::min(level, R - 1) * 1. / (R - 1), PaletteGamma) * 63);
+        }
+        for (unsigned color = 0; color < R * G * B; ++color) {
+            Pal[color] = 0x10000 * output[2][(color / (B * G)) % R]
+                       + 0x00100 * output[1][(color / B) % G]
+                       + 0x00001 * output[0][color % B];
+        }
+
+        // A channel's level only grows with its value, so for each dither
+        // value there is a last value below each level. Levels that no value
+        // reaches, and alpha, get 255, which nothing is above.
+        static const unsigned scale[3] = { 1, B, G * B };
+        for (unsigned d = 0; d < 256; ++d) {
+            for (unsigned c = 0; c < 4; ++c) {
+                for (unsigned k = 0; k < Steps; ++k) {
+                    unsigned below = 255;
+                    if (c < 3)
+                        for (unsigned n = 0; n < 256; ++n)
+                            if (ColorConvert[c][n][d] / scale[c] > k) { below = n - 1; break; }
+                    // Biased for signed compares.
+                    thresholds[d][k][c] = uint8_t(below ^ 0x80);
+                }
+            }
+        }
+        for (unsigned k = 0; k < Steps; ++k)
+            for (unsigned c = 0; c < 4; ++c)
+                steps[k][c] = c < 3 ? output[c][k + 1] - output[c][k] : 0;
+    }
+
+    // Dithers rows [first, last) of an image width pixels wide from in to
+    // out, which may be the same. frame drives temporal dithering.
+    void Rows(const uint32_t* in, uint32_t* out, unsigned width, unsigned first, unsigned last,
+              unsigned frame, DitherKernel kernel = BestDitherKernel()) const {
+        for (unsigned y = first; y < last; ++y) {
+            const uint32_t* src = in + size_t(y) * width;
+            uint32_t* dst = out + size_t(y) * width;
+            uint8_t d[8];
+            for (unsigned x = 0; x < 8; ++x) d[x] = Dither(x, y, frame);
+            unsigned x = 0;
+            switch (kernel) {
+#ifdef DITHER_X86
+                case DitherKernelAVX2: x = RowAVX2(src, dst, width, d); break;
+                case DitherKernelSSE:  x = RowSSE(src, dst, width, d); break;
+#endif
+                default: break;
+            }
+            for (; x < width; ++x) {
+                // Convert the RGB color into a palette index with dithering
+                unsigned rgb = src[x];
+                dst[x] = Pal[ColorConvert[0][(rgb >> 0) & 0xFF][d[x & 7]]
+                           + ColorConvert[1][(rgb >> 8) & 0xFF][d[x & 7]]
+                           + ColorConvert[2][(rgb >>16) & 0xFF][d[x & 7]]];
+            }
+        }
+    }
+
+    // Dithers a whole image, in bands of rows across the pool's threads.
+    void Image(const uint32_t* in, uint32_t* out, unsigned width, unsigned height, unsigned frame,
+               WorkStealingPool& pool, DitherKernel kernel = BestDitherKernel()) const {
+        pool.ParallelFor(0, height, Band, [=](size_t first, size_t last, unsigned) {
+            Rows(in, out, width, first, last, frame, kernel);
+        });
+    }
+
+    private:
+    static const unsigned Steps = 8; // Levels of the channel with most, G, less one
+
+    // Last value below level k + 1 of channel c (B, G, R, A), for each
+    // dither value, xor 0x80; and what the output byte goes up by there.
+    uint8_t thresholds[256][Steps][4];
+    uint8_t steps[Steps][4];
+
+    uint8_t Dither(unsigned x, unsigned y, unsigned f) const {
+        unsigned d = Dither8x8[y&7][x&7]; // 0..63
+        d &= (0x3F - (0x3F >> DitheringBits));
+        if (!TemporalDithering)
+            d *= 4; // No temporal dithering
+        else // Do temporal dithering
+            d += ((f^y^(x&1)*2u ^ (x&2)/2u) & 3) << 6;
+        return d;
+    }
+
+    // Thresholds and steps of eight pixels with dither values d, as bytes.
+    void Pattern(const uint8_t d[8], uint8_t below[Steps][32], uint8_t up[Steps][32]) const {
+        for (unsigned k = 0; k < Steps; ++k)
+            for (unsigned b = 0; b < 32; ++b) {
+                below[k][b] = thresholds[d[b / 4]][k][b & 3];
+                up[k][b] = steps[k][b & 3];
+            }
+    }
+
+#ifdef DITHER_X86
+    // These return how many pixels they did, a multiple of eight.
+    __attribute__((target("sse2")))
+    unsigned RowSSE(const uint32_t* src, uint32_t* dst, unsigned width, const uint8_t d[8]) const {
+        alignas(16) uint8_t below[Steps][32], up[Steps][32];
+        Pattern(d, below, up);
+        const __m128i bias = _mm_set1_epi8(char(0x80));
+        unsigned x = 0;
+        for (; x + 8 <= width; x += 8) {
+            for (unsigned half = 0; half < 2; ++half) {
+                __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(src + x + half * 4)), bias);
+                __m128i o = _mm_setzero_si128();
+                for (unsigned k = 0; k < Steps; ++k) {
+                    __m128i above = _mm_cmpgt_epi8(v, _mm_load_si128((const __m128i*)(below[k] + half * 16)));
+                    o = _mm_add_epi8(o, _mm_and_si128(above, _mm_load_si128((const __m128i*)(up[k] + half * 16))));
+                }
+                _mm_storeu_si128((__m128i*)(dst + x + half * 4), o);
+            }
+        }
+        return x;
+    }
+
+    __attribute__((target("avx2")))
+    unsigned RowAVX2(const uint32_t* src, uint32_t* dst, unsigned width, const uint8_t d[8]) const {
+        alignas(32) uint8_t below[Steps][32], up[Steps][32];
+        Pattern(d, below, up);
+        __m256i b[Steps], u[Steps];
+        for (unsigned k = 0; k < Steps; ++k) {
+            b[k] = _mm256_load_si256((const __m256i*)below[k]);
+            u[k] = _mm256_load_si256((const __m256i*)up[k]);
+        }
+        const __m256i bias = _mm256_set1_epi8(char(0x80));
+        unsigned x = 0;
+        for (; x + 8 <= width; x += 8) {
+            __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(src + x)), bias);
+            __m256i o = _mm256_setzero_si256();
+            for (unsigned k = 0; k < Steps; ++k)
+                o = _mm256_add_epi8(o, _mm256_and_si256(_mm256_cmpgt_epi8(v, b[k]), u[k]));
+            _mm256_storeu_si256((__m256i*)(dst + x), o);
+        }
+        return x;
+    }
+#endif
+};
@@ -0,0 +1,76 @@
+// Palette dithering benchmark.
+// Dithers a synthetic 1080p and 4K frame with every kernel the CPU has, on
+// one thread and across a pool, and reports megapixels per second. Each
+// kernel's image is checked against the scalar kernel's.
+//
+// Usage: ditherbench [-f frames] [-t threads]
+#include <chrono>  // For std::chrono::steady_clock
+#include <cstdint> // For uint32_t
+#include <cstdio>  // For std::printf
+#include <cstdlib> // For std::atoi
+#include <string>  // For std::string
+#include <vector>  // For std::vector, in which we store the images
+
+#include "dither.hpp"
+#include "jobs.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+static PaletteDither Palette;
+
+// Gradients with some noise, so that every threshold is crossed.
+static void Fill(std::vector<uint32_t> &image, unsigned w, unsigned h) {
+	uint32_t seed = 1;
+	for (unsigned y = 0; y < h; ++y)
+		for (unsigned x = 0; x < w; ++x) {
+			seed = seed * 1664525u + 1013904223u;
+			unsigned noise = seed >> 28;
+			unsigned r = (x * 255 / w + noise) & 0xFF, g = (y * 255 / h + noise) & 0xFF;
+			unsigned b = ((x + y) * 255 / (w + h) + noise) & 0xFF;
+			image[size_t(y) * w + x] = 0xFF000000u | r << 16 | g << 8 | b;
+		}
+}
+
+int main(int argc, char **argv) {
+	unsigned frames = 20, threads = 0;
+	for (int a = 1; a < argc; ++a) {
+		std::string arg = argv[a];
+		if (a + 1 < argc && arg == "-f") frames = std::max(1, std::atoi(argv[++a]));
+		else if (a + 1 < argc && arg == "-t") threads = std::max(0, std::atoi(argv[++a]));
+		else {
+			std::fprintf(stderr, "Usage: %s [-f frames] [-t threads]\n", argv[0]);
+			return 1;
+		}
+	}
+	WorkStealingPool pool(threads);
+	std::printf("%u frames per run, %u threads\n", frames, pool.Threads());
+
+	static const unsigned sizes[2][2] = { { 1920, 1080 }, { 3840, 2160 } };
+	int failed = 0;
+	for (const auto &size : sizes) {
+		const unsigned w = size[0], h = size[1];
+		std::vector<uint32_t> in(size_t(w) * h), reference(in.size()), out(in.size());
+		Fill(in, w, h);
+		// Each run's last frame is frames - 1.
+		Palette.Rows(in.data(), reference.data(), w, 0, h, frames - 1, DitherKernelScalar);
+		for (unsigned k = 0; k < NumDitherKernels; ++k) {
+			DitherKernel kernel = DitherKernel(k);
+			if (!DitherKernelSupported(kernel)) continue;
+			for (unsigned pooled = 0; pooled < 2; ++pooled) {
+				Clock::time_point t0 = Clock::now();
+				for (unsigned f = 0; f < frames; ++f) {
+					if (pooled) Palette.Image(in.data(), out.data(), w, h, f, pool, kernel);
+					else Palette.Rows(in.data(), out.data(), w, 0, h, f, kernel);
+				}
+				double seconds = std::chrono::duration<double>(Clock::now() - t0).count();
+				bool same = out == reference;
+				if (!same) ++failed;
+				std::printf("%4ux%-4u %-6s %-8s %9.1f Mpixel/s %8.3f ms/frame%s\n", w, h,
+							DitherKernelName(kernel), pooled ? "pool" : "1 thread",
+							double(w) * h * frames / seconds * 1e-6, seconds * 1e3 / frames,
+							same ? "" : "  DIFFERS FROM SCALAR");
+			}
+		}
+	}
+	return failed ? 2 : 0;
+}
@@ -0,0 +1,221 @@
+// View frustum.
+// The volume an Actor sees when rendered with Actor::Render, as six planes
+// whose normals point inwards, for telling what is out of sight before
+// spending any GL work on it, and roughly how much of the view something
+// covers.
+//
+// Many boxes are tested at once from a BoxList, which keeps each coordinate
+// in an array of its own. For each plane, the corner of every box nearest
+// the inside is the same combination of lo and hi coordinates, so the test
+// becomes one multiply-add loop over the arrays per plane, without
+// branches, which the compiler turns into vector instructions.
+#pragma once
+
+#include <algorithm> // For std::min, std::max
+#include <cmath>     // For std::tan, std::abs
+#include <cstdint>   // For int32_t, uint64_t
+#include <limits>    // For std::numeric_limits
+#include <vector>    // For std::vector, in which we keep the boxes
+
+#include "math.hpp"
+
+// Axis-aligned boxes, one array per coordinate. The arrays are padded to
+// whole blocks, so that Frustum::Cull can always test a block at a time.
+class BoxList {
+    public:
+    static const unsigned Block = 64; // Boxes, one word of bits
+    std::vector<float> lo[3], hi[3];
+
+    BoxList() : count(0) {}
+    void Add(const XYZ<double>& min, const XYZ<double>& max) {
+        for (unsigned c = 0; c < 3; ++c) {
+            if (count % Block == 0) {
+                lo[c].resize(count + Block, 0.f);
+                hi[c].resize(count + Block, 0.f);
+            }
+            lo[c][count] = min.d[c];
+            hi[c][count] = max.d[c];
+        }
+        ++count;
+    }
+    // Adds the bounding box of each wall (see WallData), in order, so
+    // that box n is around wall n.
+    template<typename M>
+    void AddWalls(const M& walls) {
+        for (const auto& m : walls) Add(m.lo, m.hi);
+    }
+    size_t Size() const { return count; }
+
+    private:
+    size_t count;
+};
+
+class Frustum {
+    public:
+    enum Plane { Near, Far, Left, Right, Bottom, Top, NumPlanes };
+    XYZ<double> normal[NumPlanes]; // Not normalized
+    double offset[NumPlanes];      // Inside is where normal.Dot(p) >= offset
+
+    // As gluPerspective(fov, aspect, near, far) and gluLookAt from eye
+    // towards dir, with up.
+    Frustum(const XYZ<double>& eye, const XYZ<double>& dir, const XYZ<double>& up,
+            double fov, double aspect, double near, double far)
+        : Frustum(eye, dir, up, -Tangent(fov) * aspect, Tangent(fov) * aspect, -Tangent(fov), Tangent(fov),
+                  near, far) {}
+
+    // As glFrustum(left * near, right * near, bottom * near, top * near,
+    // near, far) and gluLookAt from eye towards dir, with up: each side is
+    // given by how far it is off dir at a distance of 1.
+    Frustum(const XYZ<double>& eye, const XYZ<double>& dir, const XYZ<double>& up,
+            double left, double right, double bottom, double top, double near, double far)
+        : eye(eye), f(dir.Normalized()), r(f.Cross(up).Normalized()), u(r.Cross(f)),
+          xl(left), xr(right), yb(bottom), yt(top), znear(near), zfar(far) {
+        normal[Near]   = f;
+        normal[Far]    = f * -1.0;
+        normal[Left]   = r - f * left;
+        normal[Right]  = f * right - r;
+        normal[Bottom] = u - f * bottom;
+        normal[Top]    = f * top - u;
+        for (unsigned p = 0; p < NumPlanes; ++p) offset[p] = normal[p].Dot(eye);
+        offset[Near] += near;
+        offset[Far]  -= far;
+    }
+
+    // The view from eye through a rectangular window, whose corners are
+    // given, looking square on at it along dir and with its sides along up
+    // and across. The window fills the view, and the near plane lies in
+    // it, so that nothing between the eye and the window is seen; the far
+    // plane lies depth beyond it. The eye must be in front of the window.
+    static Frustum Through(const XYZ<double>& eye, const XYZ<double>& dir, const XYZ<double>& up,
+                           const XYZ<double> window[4], double depth) {
+        const XYZ<double> f = dir.Normalized(), r = f.Cross(up).Normalized(), u = r.Cross(f);
+        const double near = std::max((window[0] - eye).Dot(f), 1e-6);
+        double x[2] = { std::numeric_limits<double>::max(), -std::numeric_limits<double>::max() };
+        double y[2] = { x[0], x[1] };
+        for (unsigned n = 0; n < 4; ++n) {
+            const XYZ<double> v = window[n] - eye;
+            x[0] = std::min(x[0], v.Dot(r) / near);
+            x[1] = std::max(x[1], v.Dot(r) / near);
+            y[0] = std::min(y[0], v.Dot(u) / near);
+            y[1] = std::max(y[1], v.Dot(u) / near);
+        }
+        return Frustum(eye, f, u, x[0], x[1], y[0], y[1], near, near + depth);
+    }
+
+    // Where the view is seen from.
+    const XYZ<double>& Eye() const { return eye; }
+
+    // Whether the points all lie outside one plane, so that nothing that
+    // they bound can be seen. Points that straddle the corner of two planes
+    // are not caught, but such shapes are rare enough.
+    bool Outside(const XYZ<double> points[], unsigned count) const {
+        for (unsigned p = 0; p < NumPlanes; ++p) {
+            unsigned n = 0;
+            while (n < count && normal[p].Dot(points[n]) < offset[p]) ++n;
+            if (n == count) return true;
+        }
+        return false;
+    }
+
+    // Whether a sphere lies wholly outside one plane.
+    bool Outside(const XYZ<double>& center, double radius) const {
+        for (unsigned p = 0; p < NumPlanes; ++p)
+            if (normal[p].Dot(center) - offset[p] < -radius * normal[p].Len()) return true;
+        return false;
+    }
+
+    // Clears the bits of visible (one per box, 64 to a word) of the boxes
+    // that lie wholly outside one plane, and returns how many were cleared.
+    unsigned Cull(const BoxList& boxes, uint64_t visible[]) const {
+        const size_t count = boxes.Size();
+        unsigned culled = 0;
+        for (size_t first = 0; first < count; first += BoxList::Block) {
+            int32_t out[BoxList::Block] = {0};
+            for (unsigned p = 0; p < NumPlanes; ++p) {
+                const float nx = normal[p].d[0], ny = normal[p].d[1], nz = normal[p].d[2];
+                const float d = offset[p] - 1e-4 * normal[p].Len(); // Rather keep than lose to rounding
+                const float* x = (nx >= 0 ? boxes.hi[0] : boxes.lo[0]).data() + first;
+                const float* y = (ny >= 0 ? boxes.hi[1] : boxes.lo[1]).data() + first;
+                const float* z = (nz >= 0 ? boxes.hi[2] : boxes.lo[2]).data() + first;
+                for (unsigned n = 0; n < BoxList::Block; ++n) out[n] |= nx * x[n] + ny * y[n] + nz * z[n] < d;
+            }
+            const size_t block = std::min<size_t>(BoxList::Block, count - first);
+            uint64_t outside = 0;
+            for (unsigned n = 0; n < block; ++n) outside |= uint64_t(out[n]) << n;
+            culled += __builtin_popcountll(visible[first / 64] & outside);
+            visible[first / 64] &= ~outside;
+        }
+        return culled;
+    }
+
+    // The part of the view, from 0 to 1, that a convex polygon covers.
+    // Corners out of the view are pulled to its edges, which is not quite
+    // clipping, but close enough to tell big from small. A polygon that
+    // reaches behind the eye is taken to cover everything.
+    double Coverage(const XYZ<double> points[], unsigned count) const {
+        double x[8], y[8], area = 0;
+        count = std::min(count, 8u);
+        for (unsigned n = 0; n < count; ++n) {
+            const XYZ<double> v = points[n] - eye;
+            const double z = v.Dot(f);
+            if (z <= 0) return 1;
+            x[n] = std::max(-1.0, std::min(1.0, (2 * v.Dot(r) / z - (xr + xl)) / (xr - xl)));
+            y[n] = std::max(-1.0, std::min(1.0, (2 * v.Dot(u) / z - (yt + yb)) / (yt - yb)));
+        }
+        for (unsigned n = 0, m = count - 1; n < count; m = n++) area += x[m] * y[n] - x[n] * y[m];
+        return std::abs(area) / 8; // The view is 2 by 2
+    }
+
+    // The projection and the view, as those glFrustum (or gluPerspective)
+    // and gluLookAt calls would leave them, in column-major order for
+    // glLoadMatrixd.
+    void Projection(double m[16]) const {
+        for (unsigned n = 0; n < 16; ++n) m[n] = 0;
+        m[0]  = 2 / (xr - xl);
+        m[5]  = 2 / (yt - yb);
+        m[8]  = (xr + xl) / (xr - xl);
+        m[9]  = (yt + yb) / (yt - yb);
+        m[10] = (zfar + znear) / (znear - zfar);
+        m[11] = -1;
+        m[14] = 2 * zfar * znear / (znear - zfar);
+    }
+    void LookAt(double m[16]) const {
+        const double view[3][4] = {
+            { r.d[0], r.d[1], r.d[2], -r.Dot(eye) },
+            { u.d[0], u.d[1], u.d[2], -u.Dot(eye) },
+            { -f.d[0], -f.d[1], -f.d[2], f.Dot(eye) } };
+        for (unsigned c = 0; c < 4; ++c) {
+            for (unsigned row = 0; row < 3; ++row) m[c * 4 + row] = view[row][c];
+            m[c * 4 + 3] = c == 3;
+        }
+    }
+
+    // The projection times the view, row by row.
+    void Clip(double m[4][4]) const {
+        const double view[3][4] = {
+            { r.d[0], r.d[1], r.d[2], -r.Dot(eye) },
+            { u.d[0], u.d[1], u.d[2], -u.Dot(eye) },
+            { -f.d[0], -f.d[1], -f.d[2], f.Dot(eye) } };
+        for (unsigned c = 0; c < 4; ++c) {
+            m[0][c] = (2 * view[0][c] + (xr + xl) * view[2][c]) / (xr - xl);
+            m[1][c] = (2 * view[1][c] + (yt + yb) * view[2][c]) / (yt - yb);
+            m[2][c] = (zfar + znear) / (znear - zfar) * view[2][c]
+                    + (c == 3 ? 2 * zfar * znear / (znear - zfar) : 0);
+            m[3][c] = -view[2][c];
+        }
+    }
+    // The same in column-major order, for glUniformMatrix4fv.
+    void Clip(float m[16]) const {
+        double rows[4][4];
+        Clip(rows);
+        for (unsigned c = 0; c < 4; ++c)
+            for (unsigned row = 0; row < 4; ++row) m[c * 4 + row] = rows[row][c];
+    }
+
+    private:
+    XYZ<double> eye, f, r, u; // Forward, right and up
+    double xl, xr, yb, yt;    // Where the sides are off f at a distance of 1
+    double znear, zfar;
+
+    static double Tangent(double fov) { return std::tan(fov * M_PI / 360.0); }
+};
@@ -0,0 +1,173 @@
+// Accounting of GL calls.
+// The renderer issues the GL calls that draw, bind, set state or upload
+// data through the wrappers in namespace GL below, which count them into
+// frameStats.gl before passing them on. State setters are compared with a
+// shadow copy of what was last set, so that calls setting something to what
+// it already was are counted as redundant; they are still made, since the
+// shadow does not see state changed by other means (glPopAttrib, or calls
+// not made through here), and only resets itself at glPopAttrib.
+//
+// The wrappers only call the GL entry points they wrap, so they work the
+// same against a stub GL library, as in glcheck.cpp. Defining
+// NO_GL_ACCOUNTING turns them into plain calls.
+#pragma once
+
+#define GL_SILENCE_DEPRECATION
+#include "GL/glew.h"
+
+#include <cstring> // For std::memset
+
+#include "debug.hpp"
+
+#ifndef NO_GL_ACCOUNTING
+#define GL_ACCOUNT(x) x
+#else
+#define GL_ACCOUNT(x)
+#endif
+
+namespace GL {
+    // What we last set. Unknown is a value the GL never has.
+    struct Shadow {
+        static const unsigned Units = 8;
+        static const GLuint Unknown = ~0u;
+        GLuint active_unit;
+        GLuint textures[Units];  // Bound to GL_TEXTURE_2D on each unit
+        GLuint env_modes[Units]; // GL_TEXTURE_ENV_MODE of each unit
+        GLuint texture_2d[Units];  // Whether enabled on each unit
+        GLuint array_buffer, element_buffer, pack_buffer, program, framebuffer, shade_model;
+        GLfloat color[3];
+
+        Shadow() { Forget(); }
+        void Forget() {
+            active_unit = 0;
+            std::memset(textures, 0xFF, sizeof(textures));
+            std::memset(env_modes, 0xFF, sizeof(env_modes));
+            std::memset(texture_2d, 0xFF, sizeof(texture_2d));
+            array_buffer = element_buffer = pack_buffer = program = framebuffer = shade_model = Unknown;
+            color[0] = color[1] = color[2] = -1;
+        }
+
+        // Counts setting value to what it was, and remembers the new one.
+        static void Set(GLuint& shadow, GLuint value) {
+            if (shadow == value) ++frameStats.gl.redundant_states;
+            shadow = value;
+        }
+        GLuint Unit() const { return active_unit < Units ? active_unit : Units - 1; }
+    };
+    static Shadow shadow;
+
+    // Bytes per texel of an uploaded image.
+    inline size_t TexelBytes(GLenum format, GLenum type) {
+        size_t components = format == GL_RGBA ? 4 : format == GL_RGB ? 3
+                          : format == GL_LUMINANCE_ALPHA ? 2 : 1;
+        size_t bytes = type == GL_FLOAT ? 4 : type == GL_UNSIGNED_SHORT ? 2 : 1;
+        return components * bytes;
+    }
+
+    inline void ActiveTexture(GLenum unit) {
+        GL_ACCOUNT(++frameStats.gl.state_changes; Shadow::Set(shadow.active_unit, unit - GL_TEXTURE0_ARB));
+        glActiveTextureARB(unit);
+    }
+    inline void BindTexture(GLenum target, GLuint texture) {
+        GL_ACCOUNT(++frameStats.gl.texture_binds; Shadow::Set(shadow.textures[shadow.Unit()], texture));
+        glBindTexture(target, texture);
+    }
+    inline void TexEnvi(GLenum target, GLenum pname, GLint value) {
+        GL_ACCOUNT(++frameStats.gl.state_changes;
+                   if (pname == GL_TEXTURE_ENV_MODE) Shadow::Set(shadow.env_modes[shadow.Unit()], value));
+        glTexEnvi(target, pname, value);
+    }
+    inline void Enable(GLenum cap) {
+        GL_ACCOUNT(++frameStats.gl.state_changes;
+                   if (cap == GL_TEXTURE_2D) Shadow::Set(shadow.texture_2d[shadow.Unit()], 1));
+        glEnable(cap);
+    }
+    inline void Disable(GLenum cap) {
+        GL_ACCOUNT(++frameStats.gl.state_changes;
+                   if (cap == GL_TEXTURE_2D) Shadow::Set(shadow.texture_2d[shadow.Unit()], 0));
+        glDisable(cap);
+    }
+    inline void Color3f(GLfloat r, GLfloat g, GLfloat b) {
+        GL_ACCOUNT(++frameStats.gl.state_changes;
+                   if (shadow.color[0] == r && shadow.color[1] == g && shadow.color[2] == b)
+                       ++frameStats.gl.redundant_states;
+                   shadow.color[0] = r; shadow.color[1] = g; shadow.color[2] = b);
+        glColor3f(r, g, b);
+    }
+    inline void Color3fv(const GLfloat* c) { Color3f(c[0], c[1], c[2]); }
+    inline void ShadeModel(GLenum mode) {
+        GL_ACCOUNT(++frameStats.gl.state_changes; Shadow::Set(shadow.shade_model, mode));
+        glShadeModel(mode);
+    }
+    inline void BindBuffer(GLenum target, GLuint buffer) {
+        GL_ACCOUNT(++frameStats.gl.state_changes;
+                   Shadow::Set(target == GL_ARRAY_BUFFER ? shadow.array_buffer
+                               : target == GL_PIXEL_PACK_BUFFER ? shadow.pack_buffer : shadow.element_buffer,
+                               buffer));
+        glBindBuffer(target, buffer);
+    }
+    inline void UseProgram(GLuint program) {
+        GL_ACCOUNT(++frameStats.gl.state_changes; Shadow::Set(shadow.program, program));
+        glUseProgram(program);
+    }
+    inline void UniformMatrix4fv(GLint location, const GLfloat* m) {
+        GL_ACCOUNT(++frameStats.gl.state_changes);
+        glUniformMatrix4fv(location, 1, GL_FALSE, m);
+    }
+    inline void Uniform1f(GLint location, GLfloat v) {
+        GL_ACCOUNT(++frameStats.gl.state_changes);
+        glUniform1f(location, v);
+    }
+    inline void BindFramebuffer(GLenum target, GLuint framebuffer) {
+        GL_ACCOUNT(++frameStats.gl.state_changes; Shadow::Set(shadow.framebuffer, framebuffer));
+        glBindFramebuffer(target, framebuffer);
+    }
+    inline void PushAttrib(GLbitfield mask) { glPushAttrib(mask); }
+    inline void PopAttrib() {
+        GL_ACCOUNT(shadow.Forget());
+        glPopAttrib();
+    }
+
+    inline void DrawArrays(GLenum mode, GLint first, GLsizei count) {
+        GL_ACCOUNT(++frameStats.gl.draw_calls; frameStats.gl.vertices += count);
+        glDrawArrays(mode, first, count);
+    }
+    inline void DrawElementsInstanced(GLenum mode, GLsizei count, GLenum type, const GLvoid* indices,
+                                      GLsizei instances) {
+        GL_ACCOUNT(++frameStats.gl.draw_calls; frameStats.gl.vertices += count * instances);
+        glDrawElementsInstancedARB(mode, count, type, indices, instances);
+    }
+    // vertices is how many the list draws, which the GL does not tell.
+    inline void CallList(GLuint list, unsigned vertices) {
+        (void)vertices;
+        GL_ACCOUNT(++frameStats.gl.draw_calls; frameStats.gl.vertices += vertices);
+        glCallList(list);
+    }
+    inline void Begin(GLenum mode) {
+        GL_ACCOUNT(++frameStats.gl.draw_calls);
+        glBegin(mode);
+    }
+    inline void Vertex3fv(const GLfloat* v) {
+        GL_ACCOUNT(++frameStats.gl.vertices);
+        glVertex3fv(v);
+    }
+
+    inline void TexImage2D(GLenum target, GLint level, GLint internal, GLsizei w, GLsizei h,
+                           GLint border, GLenum format, GLenum type, const GLvoid* data) {
+        GL_ACCOUNT(if (data) frameStats.gl.upload_bytes += size_t(w) * h * TexelBytes(format, type));
+        glTexImage2D(target, level, internal, w, h, border, format, type, data);
+    }
+    inline void TexSubImage2D(GLenum target, GLint level, GLint x, GLint y, GLsizei w, GLsizei h,
+                              GLenum format, GLenum type, const GLvoid* data) {
+        GL_ACCOUNT(frameStats.gl.upload_bytes += size_t(w) * h * TexelBytes(format, type));
+        glTexSubImage2D(target, level, x, y, w, h, format, type, data);
+    }
+    inline void BufferData(GLenum target, GLsizeiptr size, const GLvoid* data, GLenum usage) {
+        GL_ACCOUNT(if (data) frameStats.gl.upload_bytes += size);
+        glBufferData(target, size, data, usage);
+    }
+    inline void BufferSubData(GLenum target, GLintptr offset, GLsizeiptr size, const GLvoid* data) {
+        GL_ACCOUNT(frameStats.gl.upload_bytes += size);
+        glBufferSubData(target, offset, size, data);
+    }
+} // namespace GL
@@ -0,0 +1,130 @@
+// Check of the GL call accounting (see glcalls.hpp), without a GPU.
+// The GL entry points the wrappers pass calls on to are stubs here, which
+// only count that they were called, so the program needs no GL library or
+// context. A fixed sequence of wrapped calls is made, and the counts in
+// frameStats.gl are compared with what that sequence should give. Built
+// with NO_GL_ACCOUNTING, every count must stay 0, while the calls must
+// still reach the GL.
+//
+// Usage: glcheck
+#include <cstdio>  // For std::printf
+#include <cstdlib> // For EXIT_FAILURE
+
+#include "glcalls.hpp"
+
+static unsigned calls; // Made to the stubs
+
+// The GL 1.1 entry points, which the GL library exports itself.
+extern "C" {
+void APIENTRY glBindTexture(GLenum, GLuint) { ++calls; }
+void APIENTRY glTexEnvi(GLenum, GLenum, GLint) { ++calls; }
+void APIENTRY glEnable(GLenum) { ++calls; }
+void APIENTRY glDisable(GLenum) { ++calls; }
+void APIENTRY glColor3f(GLfloat, GLfloat, GLfloat) { ++calls; }
+void APIENTRY glShadeModel(GLenum) { ++calls; }
+void APIENTRY glPushAttrib(GLbitfield) { ++calls; }
+void APIENTRY glPopAttrib() { ++calls; }
+void APIENTRY glDrawArrays(GLenum, GLint, GLsizei) { ++calls; }
+void APIENTRY glCallList(GLuint) { ++calls; }
+void APIENTRY glBegin(GLenum) { ++calls; }
+void APIENTRY glVertex3fv(const GLfloat*) { ++calls; }
+void APIENTRY glEnd() { ++calls; }
+void APIENTRY glTexImage2D(GLenum, GLint, GLint, GLsizei, GLsizei, GLint, GLenum, GLenum, const GLvoid*) { ++calls; }
+void APIENTRY glTexSubImage2D(GLenum, GLint, GLint, GLint, GLsizei, GLsizei, GLenum, GLenum, const GLvoid*) { ++calls; }
+}
+
+// And those that GLEW looks up, through its function pointers.
+static void APIENTRY StubActiveTexture(GLenum) { ++calls; }
+static void APIENTRY StubBindBuffer(GLenum, GLuint) { ++calls; }
+static void APIENTRY StubUseProgram(GLuint) { ++calls; }
+static void APIENTRY StubUniformMatrix4fv(GLint, GLsizei, GLboolean, const GLfloat*) { ++calls; }
+static void APIENTRY StubUniform1f(GLint, GLfloat) { ++calls; }
+static void APIENTRY StubBindFramebuffer(GLenum, GLuint) { ++calls; }
+static void APIENTRY StubDrawElementsInstanced(GLenum, GLsizei, GLenum, const GLvoid*, GLsizei) { ++calls; }
+static void APIENTRY StubBufferData(GLenum, GLsizeiptr, const GLvoid*, GLenum) { ++calls; }
+static void APIENTRY StubBufferSubData(GLenum, GLintptr, GLsizeiptr, const GLvoid*) { ++calls; }
+PFNGLACTIVETEXTUREARBPROC __glewActiveTextureARB = StubActiveTexture;
+PFNGLBINDBUFFERPROC __glewBindBuffer = StubBindBuffer;
+PFNGLUSEPROGRAMPROC __glewUseProgram = StubUseProgram;
+PFNGLUNIFORMMATRIX4FVPROC __glewUniformMatrix4fv = StubUniformMatrix4fv;
+PFNGLUNIFORM1FPROC __glewUniform1f = StubUniform1f;
+PFNGLBINDFRAMEBUFFERPROC __glewBindFramebuffer = StubBindFramebuffer;
+PFNGLDRAWELEMENTSINSTANCEDARBPROC __glewDrawElementsInstancedARB = StubDrawElementsInstanced;
+PFNGLBUFFERDATAPROC __glewBufferData = StubBufferData;
+PFNGLBUFFERSUBDATAPROC __glewBufferSubData = StubBufferSubData;
+
+static bool Check(const char *what, size_t got, size_t want) {
+	std::printf("%-16s %8zu  %s\n", what, got, got == want ? "ok" : "FAILED");
+	if (got != want) std::printf("%-16s %8zu  expected\n", "", want);
+	return got == want;
+}
+
+int main() {
+#ifndef NO_GL_ACCOUNTING
+	const size_t counted = 1;
+	std::printf("GL call accounting\n");
+#else
+	const size_t counted = 0;
+	std::printf("GL call accounting, compiled out\n");
+#endif
+	static const GLfloat corner[3] = {0, 0, 0}, matrix[16] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1};
+	static unsigned char texels[64 * 32 * 4], bytes[1000];
+	static float floats[16 * 16 * 3];
+
+	// State: each setter is a state change, or a bind for textures, and
+	// redundant when it sets what the shadow last saw. Unit 0 is active
+	// to begin with, as in the GL.
+	GL::ActiveTexture(GL_TEXTURE0_ARB);       // Redundant
+	GL::ActiveTexture(GL_TEXTURE1_ARB);
+	GL::BindTexture(GL_TEXTURE_2D, 5);
+	GL::BindTexture(GL_TEXTURE_2D, 5);        // Redundant
+	GL::TexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+	GL::ActiveTexture(GL_TEXTURE0_ARB);
+	GL::BindTexture(GL_TEXTURE_2D, 5);        // Another unit's
+	GL::TexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE); // Likewise
+	GL::Enable(GL_TEXTURE_2D);
+	GL::Enable(GL_TEXTURE_2D);                // Redundant
+	GL::Disable(GL_DEPTH_TEST);               // Not shadowed
+	GL::Disable(GL_DEPTH_TEST);
+	GL::Color3f(1, 0, 0);
+	GL::Color3f(1, 0, 0);                     // Redundant
+	GL::ShadeModel(GL_SMOOTH);
+	GL::BindBuffer(GL_ARRAY_BUFFER, 3);
+	GL::BindBuffer(GL_ELEMENT_ARRAY_BUFFER, 3); // Another target's
+	GL::BindBuffer(GL_ARRAY_BUFFER, 3);       // Redundant
+	GL::UseProgram(7);
+	GL::UseProgram(7);                        // Redundant
+	GL::UniformMatrix4fv(0, matrix);
+	GL::Uniform1f(1, 1);
+	GL::BindFramebuffer(GL_FRAMEBUFFER, 0);
+	GL::PushAttrib(GL_ENABLE_BIT);            // Neither
+	GL::PopAttrib();                          // Forgets the shadow
+	GL::UseProgram(7);
+	GL::BindTexture(GL_TEXTURE_2D, 5);
+
+	// Draws: glBegin counts as one, its vertices one by one.
+	GL::DrawArrays(GL_QUADS, 0, 8);
+	GL::DrawElementsInstanced(GL_TRIANGLES, 36, GL_UNSIGNED_SHORT, 0, 10);
+	GL::CallList(1, 24);
+	GL::Begin(GL_QUADS);
+	for (unsigned n = 0; n < 4; ++n) GL::Vertex3fv(corner);
+	glEnd();
+
+	// Uploads: only what is sent from the CPU.
+	GL::TexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 64, 32, 0, GL_RGBA, GL_UNSIGNED_BYTE, texels);
+	GL::TexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 64, 32, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	GL::TexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 16, 16, GL_RGB, GL_FLOAT, floats);
+	GL::BufferData(GL_ARRAY_BUFFER, sizeof(bytes), bytes, GL_STATIC_DRAW);
+	GL::BufferData(GL_ARRAY_BUFFER, 500, NULL, GL_STREAM_DRAW);
+	GL::BufferSubData(GL_ARRAY_BUFFER, 0, 64, bytes);
+
+	const GLCounts &gl = frameStats.gl;
+	bool ok = Check("GL calls", calls, 42);
+	ok = Check("draw calls", gl.draw_calls, 4 * counted) && ok;
+	ok = Check("vertices", gl.vertices, (8 + 36 * 10 + 24 + 4) * counted) && ok;
+	ok = Check("texture binds", gl.texture_binds, 4 * counted) && ok;
+	ok = Check("state changes", gl.state_changes, 21 * counted) && ok;
+	ok = Check("redundant", gl.redundant_states, 6 * counted) && ok;
+	ok = Check("upload bytes", gl.upload_bytes, (64 * 32 * 4 + 16 * 16 * 3 * 4 + 1000 + 64) * counted) && ok;
+	return ok ? 0 : EXIT_FAILURE;
+}
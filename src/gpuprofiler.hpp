@@ -0,0 +1,109 @@
+// GL timing for the frame profiler.
+// PROFILE_GPU_SCOPE("name") times the rest of the enclosing block like
+// PROFILE_SCOPE, and where ARB_timer_query is available, also when the GL
+// began and finished the commands issued within it: a timestamp query is
+// put in the command stream at each end of the block. Results are read a
+// few frames later, once the GL has them, by PROFILE_END_FRAME, and show up
+// in the trace and the summary on a track of their own, "GPU".
+//
+// Like profiler.hpp, this only exists in builds with PROFILE defined.
+#pragma once
+
+#include "profiler.hpp"
+
+#ifdef PROFILE
+
+#define GL_SILENCE_DEPRECATION
+#include "GL/glew.h"
+
+#include <deque>  // For std::deque, in which we keep the queries in flight
+#include <vector> // For std::vector
+
+class GpuProfiler {
+    public:
+    static const unsigned MaxQueries = 256; // Pairs of timestamps in flight
+
+    static GpuProfiler& Get() {
+        static GpuProfiler g;
+        return g;
+    }
+
+    // Returns the pair of queries timing the block, or -1 if there is none.
+    int Begin(const char* name) {
+        if (!initialized) Init();
+        if (free_pairs.empty()) return -1;
+        int pair = free_pairs.back();
+        free_pairs.pop_back();
+        glQueryCounter(queries[pair * 2], GL_TIMESTAMP);
+        names[pair] = name;
+        depths[pair] = depth++;
+        return pair;
+    }
+
+    void End(int pair) {
+        if (pair < 0) return;
+        --depth;
+        glQueryCounter(queries[pair * 2 + 1], GL_TIMESTAMP);
+        pending.push_back(pair);
+    }
+
+    // Passes on the results the GL has ready, oldest first.
+    void Collect() {
+        while (!pending.empty()) {
+            int pair = pending.front();
+            GLint ready = 0;
+            glGetQueryObjectiv(queries[pair * 2 + 1], GL_QUERY_RESULT_AVAILABLE, &ready);
+            if (!ready) break;
+            GLuint64 start, end;
+            glGetQueryObjectui64v(queries[pair * 2], GL_QUERY_RESULT, &start);
+            glGetQueryObjectui64v(queries[pair * 2 + 1], GL_QUERY_RESULT, &end);
+            log->Push(ProfileEvent{ names[pair], int64_t(start) + offset, int64_t(end) + offset, depths[pair] });
+            pending.pop_front();
+            free_pairs.push_back(pair);
+        }
+    }
+
+    private:
+    bool initialized;
+    GLuint queries[MaxQueries * 2];
+    const char* names[MaxQueries];
+    unsigned depths[MaxQueries];
+    std::vector<int> free_pairs;
+    std::deque<int> pending;
+    unsigned depth;
+    int64_t offset; // From GL timestamps to Profiler::Now()
+    ProfileLog* log;
+
+    GpuProfiler() : initialized(false), depth(0), offset(0), log(&Profiler::Get().Track("GPU")) {}
+
+    void Init() {
+        initialized = true;
+        if (!GLEW_ARB_timer_query) return;
+        glGenQueries(MaxQueries * 2, queries);
+        for (int n = MaxQueries; n-- > 0; ) free_pairs.push_back(n);
+        // Line up the GL's clock with ours, roughly.
+        GLint64 now = 0;
+        glGetInteger64v(GL_TIMESTAMP, &now);
+        offset = Profiler::Now() - now;
+    }
+};
+
+class GpuProfileScope {
+    public:
+    explicit GpuProfileScope(const char* name) : cpu(name), pair(GpuProfiler::Get().Begin(name)) {}
+    ~GpuProfileScope() { GpuProfiler::Get().End(pair); }
+
+    private:
+    ProfileScope cpu;
+    int pair;
+};
+
+#define PROFILE_GPU_SCOPE(name) GpuProfileScope PROFILE_CONCAT(profile_gpu_scope_, __LINE__)(name)
+#define PROFILE_END_FRAME() (GpuProfiler::Get().Collect(), Profiler::Get().EndFrame())
+
+#else
+
+#define PROFILE_GPU_SCOPE(name) ((void)0)
+#define PROFILE_END_FRAME() ((void)0)
+
+#endif
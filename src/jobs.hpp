@@ -0,0 +1,182 @@
+// Worker threads for jobs that should not run on the GL thread.
+#pragma once
+
+#include <algorithm>          // For std::max, std::min
+#include <condition_variable> // For std::condition_variable
+#include <cstddef>            // For size_t
+#include <deque>              // For std::deque, in which we queue jobs
+#include <functional>         // For std::function
+#include <memory>             // For std::unique_ptr
+#include <mutex>              // For std::mutex
+#include <thread>             // For std::thread
+#include <utility>            // For std::pair
+#include <vector>             // For std::vector, in which we store the workers
+
+class JobPool {
+    public:
+    // Starts nthreads workers, or one per core (but at least one) if zero.
+    explicit JobPool(unsigned nthreads = 0) : busy(0), quit(false) {
+        if (nthreads == 0) nthreads = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned n = 0; n < nthreads; ++n)
+            workers.push_back(std::thread([this] { Work(); }));
+    }
+
+    // Finishes every queued job before returning.
+    ~JobPool() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            quit = true;
+        }
+        wake.notify_all();
+        for (auto& t : workers) t.join();
+    }
+
+    void Submit(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            queue.push_back(std::move(job));
+        }
+        wake.notify_one();
+    }
+
+    // Blocks until the queue is empty and no job is running.
+    void Wait() {
+        std::unique_lock<std::mutex> guard(lock);
+        idle.wait(guard, [this] { return queue.empty() && busy == 0; });
+    }
+
+    unsigned Threads() const { return workers.size(); }
+
+    private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()> > queue;
+    std::mutex lock;
+    std::condition_variable wake, idle;
+    unsigned busy;
+    bool quit;
+
+    void Work() {
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [this] { return quit || !queue.empty(); });
+            if (queue.empty()) return; // quit, and nothing left to do
+            std::function<void()> job = std::move(queue.front());
+            queue.pop_front();
+            ++busy;
+            guard.unlock();
+            job();
+            guard.lock();
+            --busy;
+            if (queue.empty() && busy == 0) idle.notify_all();
+        }
+    }
+};
+
+// Data-parallel loops over persistent threads.
+// ParallelFor cuts a range into chunks and deals them out evenly to one
+// deque per thread (the calling thread included). Each thread takes work
+// from the back of its own deque, and when that runs dry, steals from the
+// front of the others', so chunks of uneven cost still balance out.
+class WorkStealingPool {
+    public:
+    // Uses nthreads threads in total, or one per core if zero.
+    explicit WorkStealingPool(unsigned nthreads = 0)
+        : current(NULL), generation(0), running(0), quit(false) {
+        if (nthreads == 0) nthreads = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned n = 0; n < nthreads; ++n) queues.emplace_back(new Queue);
+        for (unsigned n = 1; n < nthreads; ++n)
+            threads.push_back(std::thread([this, n] { Work(n); }));
+    }
+
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            quit = true;
+        }
+        wake.notify_all();
+        for (auto& t : threads) t.join();
+    }
+
+    unsigned Threads() const { return queues.size(); }
+
+    // Calls body(first, last, thread) for consecutive chunks of at most
+    // grain indices covering [begin, end), and returns when all are done.
+    // thread is in [0, Threads()), for indexing per-thread scratch data.
+    void ParallelFor(size_t begin, size_t end, size_t grain,
+                     const std::function<void(size_t, size_t, unsigned)>& body) {
+        if (begin >= end) return;
+        grain = std::max<size_t>(grain, 1);
+        unsigned q = 0;
+        for (size_t first = begin; first < end; first += grain) {
+            queues[q]->chunks.push_back(std::make_pair(first, std::min(end, first + grain)));
+            q = (q + 1) % queues.size();
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            current = &body;
+            running = threads.size();
+            ++generation;
+        }
+        wake.notify_all();
+        RunChunks(0);
+        std::unique_lock<std::mutex> guard(lock);
+        done.wait(guard, [this] { return running == 0; });
+        current = NULL;
+    }
+
+    private:
+    struct Queue {
+        std::mutex lock;
+        std::deque<std::pair<size_t, size_t> > chunks;
+    };
+    std::vector<std::unique_ptr<Queue> > queues;
+    std::vector<std::thread> threads;
+    const std::function<void(size_t, size_t, unsigned)>* current;
+    std::mutex lock;
+    std::condition_variable wake, done;
+    unsigned generation, running;
+    bool quit;
+
+    bool Pop(unsigned self, std::pair<size_t, size_t>& chunk) {
+        {
+            Queue& own = *queues[self];
+            std::lock_guard<std::mutex> guard(own.lock);
+            if (!own.chunks.empty()) {
+                chunk = own.chunks.back();
+                own.chunks.pop_back();
+                return true;
+            }
+        }
+        for (unsigned n = 1; n < queues.size(); ++n) {
+            Queue& victim = *queues[(self + n) % queues.size()];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (!victim.chunks.empty()) {
+                chunk = victim.chunks.front();
+                victim.chunks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Chunks are never added while a loop runs, so once no deque has
+    // anything left, this thread's part of the loop is over.
+    void RunChunks(unsigned self) {
+        std::pair<size_t, size_t> chunk;
+        while (Pop(self, chunk)) (*current)(chunk.first, chunk.second, self);
+    }
+
+    void Work(unsigned self) {
+        unsigned seen = 0;
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [&] { return quit || generation != seen; });
+            if (quit) return;
+            seen = generation;
+            guard.unlock();
+            RunChunks(self);
+            guard.lock();
+            if (--running == 0) done.notify_all();
+        }
+    }
+};
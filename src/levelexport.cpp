@@ -0,0 +1,62 @@
+// Writes the level compiled in from map.hpp to a level file (see
+// levelfile.hpp): its walls with the data walldata.hpp derives from them,
+// its lights and spawn points, and the directory its lightmaps are in.
+//
+// Usage: levelexport [output] [lightdir]
+#include <cstdio>  // For std::fopen, std::fwrite
+#include <cstdlib> // For EXIT_FAILURE
+#include <cstring> // For std::strlen
+
+#include "levelfile.hpp"
+
+static uint64_t AlignUp(uint64_t v) {
+	return (v + LevelAlignment - 1) / LevelAlignment * LevelAlignment;
+}
+
+int main(int argc, char **argv) {
+	const char *out = argc > 1 ? argv[1] : "level.lvl";
+	const char *lightdir = argc > 2 ? argv[2] : "light";
+
+	const LevelFile &level = LevelFile::Current(); // Nothing opened: the compiled-in level
+	LevelHeader h = {{'L', 'E', 'V', 'L'}, LevelVersion, LevelByteOrder, sizeof(WallData),
+					 unsigned(level.walls.size()), unsigned(level.lights.size()), unsigned(level.spawns.size()),
+					 unsigned(std::strlen(lightdir)), 0, 0, 0, 0};
+	uint64_t offset = sizeof(h);
+	h.walls_offset = offset = AlignUp(offset);
+	offset += h.nwalls * sizeof(WallData);
+	h.lights_offset = offset = AlignUp(offset);
+	offset += h.nlights * sizeof(lighttype);
+	h.spawns_offset = offset = AlignUp(offset);
+	offset += h.nspawns * sizeof(spawntype);
+	h.lightmaps_offset = offset = AlignUp(offset);
+	offset += h.lightmaps_length + 1;
+
+	FILE *fp = std::fopen(out, "wb");
+	if (!fp) {
+		std::perror(out);
+		return EXIT_FAILURE;
+	}
+	std::fwrite(&h, sizeof(h), 1, fp);
+	auto WriteSection = [fp](uint64_t at, const void *data, size_t bytes) {
+		static const char zeros[LevelAlignment] = {0};
+		std::fwrite(zeros, 1, at - std::ftell(fp), fp);
+		std::fwrite(data, 1, bytes, fp);
+	};
+	WriteSection(h.walls_offset, level.walls.begin(), h.nwalls * sizeof(WallData));
+	WriteSection(h.lights_offset, level.lights.begin(), h.nlights * sizeof(lighttype));
+	WriteSection(h.spawns_offset, level.spawns.begin(), h.nspawns * sizeof(spawntype));
+	WriteSection(h.lightmaps_offset, lightdir, h.lightmaps_length + 1);
+	bool ok = std::ftell(fp) == long(offset);
+	ok = (std::fclose(fp) == 0) && ok;
+	if (!ok) {
+		std::fprintf(stderr, "%s: write failed\n", out);
+		return EXIT_FAILURE;
+	}
+
+	// Check that the demo will take it.
+	LevelFile written;
+	if (!written.Open(out)) return EXIT_FAILURE;
+	std::printf("%s: %u walls, %u lights, %u spawn points, lightmaps in %s, %llu bytes\n", out,
+				h.nwalls, h.nlights, h.nspawns, written.lightmaps, (unsigned long long)offset);
+	return 0;
+}
@@ -0,0 +1,175 @@
+// Level file.
+// The walls, lights and starting places of a level, and where its
+// lightmaps are, in one file that is memory-mapped and used where it lies:
+// the walls are stored as the WallData that IntersectRay, CollideAndSlide
+// and the renderer read, derived data included, so that opening a level
+// only checks the header against the file's size, and each wall against
+// what DeriveWall (see walldata.hpp) would make of it. Without a file, the
+// level compiled in from map.hpp is used. levelexport writes that one out.
+//
+// Layout (little-endian, as written on x86 and ARM; a file of the other
+// byte order is refused rather than converted):
+//   LevelHeader
+//   WallData[nwalls]
+//   lighttype[nlights]
+//   spawntype[nspawns]
+//   lightmap directory, nul-terminated
+// each starting at a multiple of LevelAlignment.
+#pragma once
+
+#include <cstddef>     // For size_t
+#include <cstdint>     // For uint32_t, uint64_t
+#include <cstdio>      // For std::fprintf
+#include <cstring>     // For std::memcmp
+#include <type_traits> // For std::is_trivially_copyable
+
+#include <fcntl.h>    // For open
+#include <sys/mman.h> // For mmap, munmap
+#include <sys/stat.h> // For fstat
+#include <unistd.h>   // For close
+
+#include "walldata.hpp"
+
+struct LevelHeader {
+    char     magic[4];   // "LEVL"
+    uint32_t version;
+    uint32_t byte_order; // LevelByteOrder, as the writer saw it
+    uint32_t wall_size;  // sizeof(WallData) of the writer
+    uint32_t nwalls, nlights, nspawns;
+    uint32_t lightmaps_length; // Of the directory name, without the nul
+    uint64_t walls_offset, lights_offset, spawns_offset, lightmaps_offset;
+};
+
+const uint32_t LevelVersion = 1;
+const uint32_t LevelByteOrder = 0x01020304;
+const uint32_t LevelAlignment = 64; // One cache line
+
+static_assert(sizeof(LevelHeader) == 64, "the level header has no padding");
+static_assert(sizeof(WallData) == 160 && sizeof(lighttype) == 24 && sizeof(spawntype) == 24,
+              "level file records are stored as they are laid out in memory");
+static_assert(std::is_trivially_copyable<WallData>::value && std::is_trivially_copyable<lighttype>::value
+              && std::is_trivially_copyable<spawntype>::value, "level file records are read in place");
+
+// Records where they lie, which IntersectRay, BVH::Build, CollideAndSlide
+// and LevelMesh::Bake take as they take the tables of map.hpp.
+template<typename T>
+struct LevelSpan {
+    const T* first;
+    size_t count;
+    const T& operator[](size_t n) const { return first[n]; }
+    const T* begin() const { return first; }
+    const T* end() const { return first + count; }
+    size_t size() const { return count; }
+};
+
+class LevelFile {
+    public:
+    LevelSpan<WallData> walls;
+    LevelSpan<lighttype> lights;
+    LevelSpan<spawntype> spawns;
+    const char* lightmaps; // Directory of lightmaps.pak and the .raw files
+
+    LevelFile() : base(NULL), size(0), generation(0) { Close(); }
+    ~LevelFile() { Close(); }
+
+    // The level being played, which the simulation collides with.
+    static LevelFile& Current() {
+        static LevelFile level;
+        return level;
+    }
+
+    // Maps the file and validates the header and walls. Returns false,
+    // leaving the compiled-in level in use, if anything is off.
+    bool Open(const char* path) {
+        Close();
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            size = st.st_size;
+            void* p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) base = (const unsigned char*)p;
+        }
+        close(fd);
+        if (!base) return false;
+        if (!Validate()) {
+            std::fprintf(stderr, "%s: not a valid level file\n", path);
+            Close();
+            return false;
+        }
+        const LevelHeader& h = Header();
+        walls = LevelSpan<WallData>{ (const WallData*)(base + h.walls_offset), h.nwalls };
+        lights = LevelSpan<lighttype>{ (const lighttype*)(base + h.lights_offset), h.nlights };
+        spawns = LevelSpan<spawntype>{ (const spawntype*)(base + h.spawns_offset), h.nspawns };
+        lightmaps = (const char*)(base + h.lightmaps_offset);
+        ++generation;
+        return true;
+    }
+
+    // Unmaps the file, going back to the compiled-in level. What
+    // CollideAndSlide built from the file's walls goes with it.
+    void Close() {
+        if (base) {
+            EllipsoidWalls<GLfloat>::Forget(walls.begin());
+            munmap((void*)base, size);
+            ++generation;
+        }
+        base = NULL;
+        size = 0;
+        walls = LevelSpan<WallData>{ mapData.begin(), mapData.size() };
+        lights = LevelSpan<lighttype>{ ::lights, sizeof(::lights) / sizeof(*::lights) };
+        spawns = LevelSpan<spawntype>{ ::spawns, sizeof(::spawns) / sizeof(*::spawns) };
+        lightmaps = "light";
+    }
+
+    bool IsOpen() const { return base != NULL; }
+
+    // Changes whenever the walls do, so that what was derived from them can
+    // tell whether it still applies.
+    unsigned Generation() const { return generation; }
+
+    const LevelHeader& Header() const { return *(const LevelHeader*)base; }
+
+    // The spawn point of kind after skipping skip others of it, or NULL if
+    // there are not that many.
+    const spawntype* Spawn(uint32_t kind, unsigned skip = 0) const {
+        for (const spawntype& s : spawns)
+            if (s.kind == kind && skip-- == 0) return &s;
+        return NULL;
+    }
+
+    private:
+    const unsigned char* base;
+    size_t size;
+    unsigned generation;
+
+    // Whether count records of bytes each fit at offset, suitably aligned.
+    bool Fits(uint64_t offset, uint64_t count, uint64_t bytes) const {
+        return offset % LevelAlignment == 0 && offset <= size && count <= (size - offset) / bytes;
+    }
+
+    bool Validate() const {
+        if (size < sizeof(LevelHeader)) return false;
+        const LevelHeader& h = Header();
+        if (std::memcmp(h.magic, "LEVL", 4) != 0 || h.version != LevelVersion) return false;
+        if (h.byte_order != LevelByteOrder || h.wall_size != sizeof(WallData)) return false;
+        return h.nwalls > 0
+            && Fits(h.walls_offset, h.nwalls, sizeof(WallData))
+            && Fits(h.lights_offset, h.nlights, sizeof(lighttype))
+            && Fits(h.spawns_offset, h.nspawns, sizeof(spawntype))
+            && Fits(h.lightmaps_offset, uint64_t(h.lightmaps_length) + 1, 1)
+            && base[h.lightmaps_offset + h.lightmaps_length] == '\0'
+            && ValidWalls(LevelSpan<WallData>{ (const WallData*)(base + h.walls_offset), h.nwalls });
+    }
+
+    // Whether the walls keep to what walldata.hpp asserts of the map, and
+    // what is derived from them is what DeriveWall gives. One pass over
+    // the walls, without allocating.
+    static bool ValidWalls(const LevelSpan<WallData>& w) {
+        return FirstWallWithoutUnitAxisNormal(w) == w.size()
+            && FirstNonPlanarWall(w) == w.size()
+            && FirstWallNotAxisAlignedRectangle(w) == w.size()
+            && FirstWallOfBadSize(w) == w.size()
+            && FirstWallNotAsDerived(w) == w.size();
+    }
+};
@@ -0,0 +1,169 @@
+// Static vertex buffer holding the whole level map.
+// The walls never move, so instead of re-sending every vertex with
+// glBegin/glEnd in every view, they are baked once into an interleaved
+// buffer object that stays resident on the GPU. The same vertices feed
+// the fixed-function texture units through the client arrays, and
+// WallShader through generic attributes.
+#pragma once
+
+#define GL_SILENCE_DEPRECATION
+#include "GL/glew.h"
+
+#include <cstddef> // For offsetof
+#include <vector>  // For std::vector, in which we stage the vertices
+
+#include "walldata.hpp"
+#include "debug.hpp"
+#include "glcalls.hpp"
+#include "atlas.hpp"
+
+// One corner of a wall: position, normal, the four texture coordinate
+// sets (wall texture, lightmap, addmap, decal), and whether the wall's
+// addmap is shown, 1 or 0, which only WallShader reads, with the decal
+// coordinates as one attribute. The second flag is spare, keeping a
+// vertex at 64 bytes.
+struct LevelVertex {
+    GLfloat pos[3];
+    GLfloat normal[3];
+    GLfloat tex[4][2];
+    GLfloat flags[2];
+};
+
+class LevelMesh {
+    public:
+    // Generic attribute locations, clear of those some drivers alias with
+    // the fixed-function arrays (gl_Vertex, gl_Normal and gl_Color at 0, 2
+    // and 3, gl_MultiTexCoord from 8). The lightmap coordinates serve for
+    // the addmap too, and the decal's are followed by the flags, as one vec4.
+    enum Attrib { PosAttrib = 4, TexAttrib, LightmapAttrib, DecalAttrib };
+    GLuint vbo, vao;
+    unsigned nverts;
+
+    LevelMesh() : vbo(0), vao(0), nverts(0), attribs(false) {}
+
+    bool Baked() const { return vbo != 0; }
+
+    // Converts the level map into quads, four vertices per wall. The walls
+    // are stored in atlas page order, so that each page is one contiguous
+    // range, and their lightmap and addmap coordinates point into the page.
+    // With attribs, the generic attributes are set up as well as the client
+    // arrays. Every wall starts without its addmap shown. The vertices
+    // are kept, so that SetFlags can send a wall's four back in one piece.
+    template <typename M>
+    void Bake(const M& walls, const LightmapAtlas& atlas, bool attribs = false) {
+        this->attribs = attribs;
+        verts.clear();
+        slots.assign(walls.size(), 0);
+        for (unsigned wallno : atlas.order) {
+            slots[wallno] = verts.size() / 4;
+            const WallData& m = walls[wallno];
+            int width = m.width;   // Number of times the texture
+            int height = m.height; // is repeated across the surface.
+
+            for (unsigned e = 0; e < 4; ++e) {
+                LevelVertex v;
+                GLfloat s = !((e + 2) & 2), t = !((e + 3) & 2);
+                for (unsigned c = 0; c < 3; ++c) {
+                    v.pos[c]    = m.p[e].d[c];
+                    v.normal[c] = m.normal.d[c];
+                }
+                v.tex[0][0] = width * s;
+                v.tex[0][1] = height * t;
+                atlas.Map(wallno, s, t, v.tex[1][0], v.tex[1][1]);
+                atlas.Map(wallno, s, t, v.tex[2][0], v.tex[2][1]);
+                v.tex[3][0] = s;
+                v.tex[3][1] = t;
+                v.flags[0] = v.flags[1] = 0;
+                verts.push_back(v);
+            }
+        }
+        nverts = verts.size();
+
+        glGenBuffers(1, &vbo);
+        GL::BindBuffer(GL_ARRAY_BUFFER, vbo);
+        GL::BufferData(GL_ARRAY_BUFFER, verts.size() * sizeof(LevelVertex),
+                     &verts[0], GL_STATIC_DRAW);
+
+        // When vertex array objects are available, the array setup
+        // below is recorded once and each view only binds the VAO.
+        if (GLEW_ARB_vertex_array_object) {
+            glGenVertexArrays(1, &vao);
+            glBindVertexArray(vao);
+            SetPointers();
+            glBindVertexArray(0);
+        }
+        GL::BindBuffer(GL_ARRAY_BUFFER, 0);
+        CheckGLError("LevelMesh::Bake");
+    }
+
+    // Sets whether wall wallno shows its addmap.
+    void SetFlags(unsigned wallno, bool addmap) {
+        LevelVertex* v = &verts[slots[wallno] * 4];
+        for (unsigned e = 0; e < 4; ++e) v[e].flags[0] = addmap;
+        GL::BindBuffer(GL_ARRAY_BUFFER, vbo);
+        GL::BufferSubData(GL_ARRAY_BUFFER, slots[wallno] * 4 * sizeof(LevelVertex), 4 * sizeof(LevelVertex), v);
+        GL::BindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    void Bind() const {
+        if (vao) {
+            glBindVertexArray(vao);
+        } else {
+            GL::BindBuffer(GL_ARRAY_BUFFER, vbo);
+            SetPointers();
+        }
+    }
+
+    void Unbind() const {
+        if (vao) {
+            glBindVertexArray(0);
+            return;
+        }
+        for (unsigned u = 0; u < 4; ++u) {
+            glClientActiveTextureARB(GL_TEXTURE0_ARB + u);
+            glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+        }
+        glClientActiveTextureARB(GL_TEXTURE0_ARB);
+        glDisableClientState(GL_NORMAL_ARRAY);
+        glDisableClientState(GL_VERTEX_ARRAY);
+        if (attribs)
+            for (GLuint a = PosAttrib; a <= DecalAttrib; ++a) glDisableVertexAttribArray(a);
+        GL::BindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    // Draws walls [first, first+count) in atlas page order.
+    void Draw(unsigned first, unsigned count = 1) const {
+        GL::DrawArrays(GL_QUADS, first * 4, count * 4);
+    }
+
+    private:
+    bool attribs;                  // Whether SetPointers sets the generic attributes
+    std::vector<unsigned> slots;    // Where each wall is in the buffer, in walls
+    std::vector<LevelVertex> verts; // As in the buffer
+
+    void SetPointers() const {
+        const GLsizei stride = sizeof(LevelVertex);
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glVertexPointer(3, GL_FLOAT, stride, (const GLvoid*)offsetof(LevelVertex, pos));
+        glEnableClientState(GL_NORMAL_ARRAY);
+        glNormalPointer(GL_FLOAT, stride, (const GLvoid*)offsetof(LevelVertex, normal));
+        for (unsigned u = 0; u < 4; ++u) {
+            glClientActiveTextureARB(GL_TEXTURE0_ARB + u);
+            glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+            glTexCoordPointer(2, GL_FLOAT, stride,
+                              (const GLvoid*)(offsetof(LevelVertex, tex) + u * 2 * sizeof(GLfloat)));
+        }
+        glClientActiveTextureARB(GL_TEXTURE0_ARB);
+        if (!attribs) return;
+        glEnableVertexAttribArray(PosAttrib);
+        glVertexAttribPointer(PosAttrib, 3, GL_FLOAT, GL_FALSE, stride, (const GLvoid*)offsetof(LevelVertex, pos));
+        glEnableVertexAttribArray(TexAttrib);
+        glVertexAttribPointer(TexAttrib, 2, GL_FLOAT, GL_FALSE, stride, (const GLvoid*)offsetof(LevelVertex, tex));
+        glEnableVertexAttribArray(LightmapAttrib);
+        glVertexAttribPointer(LightmapAttrib, 2, GL_FLOAT, GL_FALSE, stride,
+                              (const GLvoid*)(offsetof(LevelVertex, tex) + 2 * sizeof(GLfloat)));
+        glEnableVertexAttribArray(DecalAttrib);
+        glVertexAttribPointer(DecalAttrib, 4, GL_FLOAT, GL_FALSE, stride,
+                              (const GLvoid*)(offsetof(LevelVertex, tex) + 6 * sizeof(GLfloat)));
+    }
+};
@@ -0,0 +1,130 @@
+// Lightmap pack file.
+// All walls' lightmaps and addmaps in one file, which is memory-mapped at
+// startup so that texture uploads can read straight from the mapping.
+//
+// Layout (little-endian, as written on x86 and ARM; a file of the other
+// byte order is refused rather than converted):
+//   LightPackHeader
+//   LightPackEntry[nwalls]
+//   payloads, each starting at a multiple of LightPackHeader::alignment
+// Every payload is a (width+2*padding) x (height+2*padding) image of RGB
+// floats, already surrounded by replicated edge texels for the atlas.
+#pragma once
+
+#include <cstdint> // For uint32_t, uint64_t
+#include <cstdio>  // For std::fprintf
+#include <cstring> // For std::memcmp
+
+#include <fcntl.h>    // For open
+#include <sys/mman.h> // For mmap, munmap
+#include <sys/stat.h> // For fstat
+#include <unistd.h>   // For close
+
+struct LightPackHeader {
+    char     magic[4];  // "LMPK"
+    uint32_t version;
+    uint32_t byte_order; // LightPackByteOrder, as the writer saw it
+    uint32_t nwalls;
+    uint32_t padding;   // Texels of replicated edge around each payload
+    uint32_t alignment; // Payload alignment in bytes
+    uint32_t reserved[2];
+};
+
+struct LightPackEntry {
+    uint32_t width, height; // Lightmap size in texels, without padding
+    uint32_t flags;
+    uint32_t reserved;
+    uint64_t lmap_offset;   // Byte offset of the multiply-map
+    uint64_t smap_offset;   // Byte offset of the add-map, if any
+};
+
+const uint32_t LightPackVersion = 2;
+const uint32_t LightPackByteOrder = 0x01020304;
+const uint32_t LightPackHasAddmap = 1;
+const uint32_t LightPackPadding = 2;    // Matches the atlas padding
+const uint32_t LightPackAlignment = 64; // One cache line
+
+class LightPack {
+    public:
+    LightPack() : base(NULL), size(0) {}
+    ~LightPack() { Close(); }
+
+    // Maps the file and validates the header and index against it.
+    // Returns false (and leaves the pack closed) if anything is off.
+    bool Open(const char* path) {
+        Close();
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            size = st.st_size;
+            void* p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) base = (const unsigned char*)p;
+        }
+        close(fd);
+        if (!base) return false;
+        if (!Validate()) {
+            std::fprintf(stderr, "%s: not a valid lightmap pack\n", path);
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    void Close() {
+        if (base) munmap((void*)base, size);
+        base = NULL;
+        size = 0;
+    }
+
+    bool IsOpen() const { return base != NULL; }
+
+    const LightPackHeader& Header() const { return *(const LightPackHeader*)base; }
+    const LightPackEntry& Entry(unsigned wallno) const {
+        return ((const LightPackEntry*)(base + sizeof(LightPackHeader)))[wallno];
+    }
+    unsigned Walls() const { return Header().nwalls; }
+    unsigned Padding() const { return Header().padding; }
+
+    // Padded RGB float images, pointing into the mapping.
+    const float* Lightmap(unsigned wallno) const {
+        return (const float*)(base + Entry(wallno).lmap_offset);
+    }
+    const float* Addmap(unsigned wallno) const {
+        const LightPackEntry& e = Entry(wallno);
+        return (e.flags & LightPackHasAddmap) ? (const float*)(base + e.smap_offset) : NULL;
+    }
+
+    // Bytes in one padded payload.
+    static uint64_t PayloadSize(uint64_t w, uint64_t h, uint64_t padding) {
+        return (w + padding * 2) * (h + padding * 2) * 3 * sizeof(float);
+    }
+
+    private:
+    const unsigned char* base;
+    size_t size;
+
+    // Whether a padded payload for e fits at offset, suitably aligned.
+    // Compared a row at a time, so that no size can wrap around.
+    bool Fits(uint64_t offset, const LightPackEntry& e) const {
+        const LightPackHeader& h = Header();
+        uint64_t row = (uint64_t(e.width) + uint64_t(h.padding) * 2) * 3 * sizeof(float);
+        return offset % h.alignment == 0 && offset <= size
+            && uint64_t(e.height) + uint64_t(h.padding) * 2 <= (size - offset) / row;
+    }
+
+    bool Validate() const {
+        if (size < sizeof(LightPackHeader)) return false;
+        const LightPackHeader& h = Header();
+        if (std::memcmp(h.magic, "LMPK", 4) != 0 || h.version != LightPackVersion) return false;
+        if (h.byte_order != LightPackByteOrder) return false;
+        if (h.alignment < sizeof(float) || h.alignment % sizeof(float)) return false;
+        if (h.nwalls > (size - sizeof(LightPackHeader)) / sizeof(LightPackEntry)) return false;
+        for (unsigned n = 0; n < h.nwalls; ++n) {
+            const LightPackEntry& e = Entry(n);
+            if (e.width == 0 || e.height == 0 || !Fits(e.lmap_offset, e)) return false;
+            if ((e.flags & LightPackHasAddmap) && !Fits(e.smap_offset, e)) return false;
+        }
+        return true;
+    }
+};
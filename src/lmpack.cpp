@@ -0,0 +1,116 @@
+// Builds the lightmap pack file (see lightpack.hpp) from the
+// light/lmap/lmapN.raw and light/smap/smapN.raw files of every wall of
+// map.hpp, or of a level file given with -level (see levelfile.hpp), whose
+// lightmap directory is then the default one.
+//
+// Usage: lmpack [-level file] [lightdir] [output]
+#include <cstdio>  // For std::fopen, std::fread, std::fwrite
+#include <cstdlib> // For EXIT_FAILURE
+#include <cstring> // For std::strcmp
+#include <string>  // For std::string
+#include <vector>  // For std::vector, in which we stage the lightmaps
+
+#include "levelfile.hpp"
+#include "atlas.hpp"
+#include "lightpack.hpp"
+
+// Reads a whole .raw file of exactly count floats.
+// Returns false if the file does not exist; exits if it has the wrong size.
+static bool ReadRaw(const char *path, size_t count, std::vector<float> &out) {
+	FILE *fp = std::fopen(path, "rb");
+	if (!fp) return false;
+	out.resize(count);
+	size_t got = std::fread(&out[0], sizeof(float), count, fp);
+	bool extra = std::fgetc(fp) != EOF;
+	std::fclose(fp);
+	if (got != count || extra) {
+		std::fprintf(stderr, "%s: expected %zu floats\n", path, count);
+		std::exit(EXIT_FAILURE);
+	}
+	return true;
+}
+
+static uint64_t AlignUp(uint64_t v) {
+	return (v + LightPackAlignment - 1) / LightPackAlignment * LightPackAlignment;
+}
+
+int main(int argc, char **argv) {
+	const LevelFile &level = LevelFile::Current();
+	if (argc > 1 && !std::strcmp(argv[1], "-level")) {
+		if (argc < 3 || !LevelFile::Current().Open(argv[2])) {
+			std::fprintf(stderr, "Usage: %s [-level file] [lightdir] [output]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+		argc -= 2;
+		argv += 2;
+	}
+	const char *dir = argc > 1 ? argv[1] : level.lightmaps;
+	const std::string pak = std::string(dir) + "/lightmaps.pak";
+	const char *out = argc > 2 ? argv[2] : pak.c_str();
+	const unsigned nwalls = level.walls.size();
+
+	LightPackHeader header = {{'L', 'M', 'P', 'K'}, LightPackVersion, LightPackByteOrder,
+							  nwalls, LightPackPadding, LightPackAlignment, {0, 0}};
+	std::vector<LightPackEntry> index(nwalls);
+	std::vector<std::vector<float> > lmaps(nwalls), smaps(nwalls);
+
+	// The pads are produced by the same code the atlas would use.
+	LightmapAtlas atlas;
+	atlas.padding = LightPackPadding;
+
+	uint64_t offset = sizeof(header) + nwalls * sizeof(LightPackEntry);
+	std::vector<float> raw;
+	for (unsigned wallno = 0; wallno < nwalls; ++wallno) {
+		LightPackEntry &e = index[wallno];
+		e.width = level.walls[wallno].lmap_w;
+		e.height = level.walls[wallno].lmap_h;
+		e.flags = 0;
+		e.reserved = 0;
+		e.smap_offset = 0;
+		const uint64_t bytes = LightPack::PayloadSize(e.width, e.height, LightPackPadding);
+
+		char Buf[256];
+		std::snprintf(Buf, sizeof(Buf), "%s/lmap/lmap%u.raw", dir, wallno);
+		if (!ReadRaw(Buf, size_t(e.width) * e.height * 3, raw)) {
+			std::fprintf(stderr, "%s: missing\n", Buf);
+			return EXIT_FAILURE;
+		}
+		atlas.Pad(&raw[0], e.width, e.height, lmaps[wallno]);
+		e.lmap_offset = offset = AlignUp(offset);
+		offset += bytes;
+
+		std::snprintf(Buf, sizeof(Buf), "%s/smap/smap%u.raw", dir, wallno);
+		if (ReadRaw(Buf, size_t(e.width) * e.height * 3, raw)) {
+			atlas.Pad(&raw[0], e.width, e.height, smaps[wallno]);
+			e.flags |= LightPackHasAddmap;
+			e.smap_offset = offset = AlignUp(offset);
+			offset += bytes;
+		}
+	}
+
+	FILE *fp = std::fopen(out, "wb");
+	if (!fp) {
+		std::perror(out);
+		return EXIT_FAILURE;
+	}
+	std::fwrite(&header, sizeof(header), 1, fp);
+	std::fwrite(&index[0], sizeof(LightPackEntry), nwalls, fp);
+	auto WritePayload = [fp](uint64_t at, const std::vector<float> &data) {
+		static const char zeros[LightPackAlignment] = {0};
+		std::fwrite(zeros, 1, at - std::ftell(fp), fp);
+		std::fwrite(&data[0], sizeof(float), data.size(), fp);
+	};
+	for (unsigned wallno = 0; wallno < nwalls; ++wallno) {
+		WritePayload(index[wallno].lmap_offset, lmaps[wallno]);
+		if (index[wallno].flags & LightPackHasAddmap)
+			WritePayload(index[wallno].smap_offset, smaps[wallno]);
+	}
+	bool ok = std::ftell(fp) == long(offset);
+	ok = (std::fclose(fp) == 0) && ok;
+	if (!ok) {
+		std::fprintf(stderr, "%s: write failed\n", out);
+		return EXIT_FAILURE;
+	}
+	std::printf("%s: %u walls, %llu bytes\n", out, nwalls, (unsigned long long)offset);
+	return 0;
+}
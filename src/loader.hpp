@@ -0,0 +1,134 @@
+// Background asset loading.
+// Worker threads read and prepare images; the GL thread takes the finished
+// ones off the queue and uploads them a few at a time between frames, so
+// the first frame does not have to wait for every lightmap.
+#pragma once
+
+#include <algorithm> // For std::min, std::max
+#include <atomic>    // For std::atomic
+#include <chrono>    // For std::chrono::steady_clock
+#include <cmath>     // For std::sqrt, std::pow
+#include <cstdlib>   // For std::rand
+#include <iomanip>   // For std::setprecision
+#include <iostream>
+#include <mutex>     // For std::mutex
+#include <string>    // For std::string
+#include <utility>   // For std::move
+#include <vector>    // For std::vector, in which we store the images
+
+#include "jobs.hpp"
+
+// One prepared image, ready to be uploaded.
+struct LoadedImage {
+    enum Kind { WallTexture, Lightmap, Addmap } kind;
+    unsigned wallno;
+    unsigned w, h;        // Size of data, in texels
+    const float* data;    // Either owned.data() or a pointer into a mapped file
+    std::vector<float> owned;
+    std::vector<std::vector<float> > mipmaps; // Levels 1.. of a mipmapped image
+};
+
+class AssetLoader {
+    public:
+    typedef std::chrono::steady_clock Clock;
+
+    AssetLoader() : outstanding(0), start(Clock::now()), taken(0) {}
+
+    void Submit(std::function<void()> job) {
+        ++outstanding;
+        pool.Submit([this, job] {
+            job();
+            --outstanding;
+        });
+    }
+
+    // Called by the jobs when an image is ready for upload.
+    void Publish(LoadedImage&& image) {
+        std::lock_guard<std::mutex> guard(lock);
+        ready.push_back(std::move(image));
+    }
+
+    // Called by the GL thread; returns false if nothing is ready yet.
+    bool Take(LoadedImage& image) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (taken == ready.size()) return false;
+        image = std::move(ready[taken++]);
+        if (taken == ready.size()) { ready.clear(); taken = 0; }
+        return true;
+    }
+
+    // True once every job has run and every image has been taken.
+    bool Done() {
+        if (outstanding) return false;
+        std::lock_guard<std::mutex> guard(lock);
+        return taken == ready.size();
+    }
+
+    // Milliseconds since the loader was created.
+    double Elapsed() const { return Since(start); }
+    static double Since(Clock::time_point t) {
+        return std::chrono::duration<double, std::milli>(Clock::now() - t).count();
+    }
+
+    // Adds time to a named load phase. Safe to call from any thread.
+    void Time(const std::string& phase, double ms) {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto& p : phases)
+            if (p.first == phase) { p.second += ms; return; }
+        phases.push_back(std::make_pair(phase, ms));
+    }
+
+    void Report() {
+        std::lock_guard<std::mutex> guard(lock);
+        std::cout << "Load phases (" << pool.Threads() << " workers):" << std::endl;
+        for (const auto& p : phases)
+            std::cout << "  " << std::setw(20) << std::left << p.first
+                      << std::fixed << std::setprecision(2) << p.second << " ms" << std::endl;
+    }
+
+    private:
+    std::atomic<unsigned> outstanding;
+    Clock::time_point start;
+    std::mutex lock;
+    std::vector<LoadedImage> ready;
+    size_t taken;
+    std::vector<std::pair<std::string, double> > phases;
+    JobPool pool; // Last, so that its jobs finish before the rest goes away
+};
+
+// Builds the chain of half-size box-filtered levels below a w*h image of
+// the given number of channels, down to 1x1, for upload with glTexImage2D.
+inline void BuildMipmaps(const float* src, unsigned w, unsigned h, unsigned channels,
+                         std::vector<std::vector<float> >& levels) {
+    levels.clear();
+    while (w > 1 || h > 1) {
+        unsigned nw = std::max(1u, w / 2), nh = std::max(1u, h / 2);
+        std::vector<float> level(nw * nh * channels);
+        for (unsigned y = 0; y < nh; ++y)
+            for (unsigned x = 0; x < nw; ++x)
+                for (unsigned c = 0; c < channels; ++c) {
+                    unsigned x0 = x * 2, x1 = std::min(x0 + 1, w - 1);
+                    unsigned y0 = y * 2, y1 = std::min(y0 + 1, h - 1);
+                    level[(y * nw + x) * channels + c] = 0.25f * (
+                        src[(y0 * w + x0) * channels + c] + src[(y0 * w + x1) * channels + c] +
+                        src[(y1 * w + x0) * channels + c] + src[(y1 * w + x1) * channels + c]);
+                }
+        levels.push_back(std::move(level));
+        src = &levels.back()[0];
+        w = nw;
+        h = nh;
+    }
+}
+
+// Fills a w*h luminance image with the wall texture: a tile that darkens
+// towards its corners, with a border and a random grain.
+inline void WallTexels(float* texture, unsigned txW, unsigned txH) {
+    for (unsigned y = 0; y < txH; ++y)
+        for (unsigned x = 0; x < txW; ++x)
+            texture[y * txW + x] =
+            0.7 - ((1.0 - std::sqrt(int(x - txW / 2) * int(x - txW / 2) /
+            double(txW / 2.0) / (txW / 2.0) + int(y - txH / 2) * int(y - txH / 2) /
+            double(txH / 2.0) / (txH / 2.0))) * 0.6 -
+            !(x < 8 || y < 8 || (x + 8) >= txW || (y + 8) >= txH)) *
+            (0.1 + 0.3 * std::pow((std::rand() % 100) / 100.0, 2.0));
+}
@@ -5,31 +5,71 @@
 
 // Standard C++ includes:
 #include <algorithm> // For std::min, std::max
+#include <chrono>    // For std::chrono::steady_clock, with which -regress times frames
 #include <cmath>     // For std::pow, std::sin, std::cos
+#include <cstdlib>   // For std::atoi
 #include <iostream>
-#include <list>   // Blobs are stored in a list.
+#include <string>    // For std::string
 #include <vector> // For std::vector, in which we store texture & lightmap
 
 #include "map.hpp"
+#include "walldata.hpp"
+#include "levelfile.hpp"
 #include "math.hpp"
 #include "actor.hpp"
 #include "debug.hpp"
+#include "levelmesh.hpp"
+#include "atlas.hpp"
+#include "lightpack.hpp"
+#include "loader.hpp"
+#include "bvh.hpp"
+#include "blobs.hpp"
+#include "spheres.hpp"
+#include "wallshader.hpp"
+#include "timestep.hpp"
+#include "tick.hpp"
+#include "replay.hpp"
+#include "gpuprofiler.hpp"
+#include "glcalls.hpp"
+#include "dither.hpp"
+#include "frustum.hpp"
+#include "portaltarget.hpp"
+#include "portalbudget.hpp"
+#include "pvs.hpp"
+#include "softworld.hpp"
+#ifdef HEADLESS
+#include <EGL/egl.h>
+#include "regress.hpp"
+#endif
 
 SDL_Window *window = NULL;
 SDL_GLContext ctx;
 
-const unsigned nwalls = sizeof(map) / sizeof(*map);
+static const LevelFile &Level = LevelFile::Current(); // Opened before anything else
+static unsigned nwalls = 0; // In Level, and the size of the per-wall arrays
 static bool TexturesInstalled = false;
 static GLuint WallTextureID;
-static bool UseAddmap[nwalls] = {false};
-static bool UseDecals[nwalls] = {false};
-static unsigned LightmapIDs[nwalls] = {0};
-static unsigned AddmapIDs[nwalls]   = {0};
-static unsigned DecalIDs[nwalls]    = {0};
-static std::vector<float> DecalMaps[nwalls];
+static std::vector<bool> UseAddmap;
+static std::vector<bool> UseDecals;
+static std::vector<unsigned> DecalIDs;
+static std::vector<std::vector<float> > DecalMaps;
+static LevelMesh LevelGeometry;
+static LightmapAtlas Atlas; // Where each wall's lightmap lives
+static std::vector<GLuint> LightmapPages, AddmapPages;
+static AssetLoader *Loader = NULL; // Non-null while loading
+static LightPack Pack; // Stays mapped until every lightmap is uploaded
+static BVH LevelBVH; // For ray queries against Level.walls
+static LevelPVS PVS; // Which walls each part of the level can see
+static BoxList WallBoxes; // Around each wall, for frustum culling
+static SphereRenderer Spheres; // Lights, player and blobs
+static WallShader WallShading; // Unless -fixed-function, or without GLSL
+static SoftWorld Soft; // What -software draws the level with
+static const unsigned AtlasPageSize = 2048, AtlasPadding = LightPackPadding;
 static float mouseSens 		= 0.35f;
 static double fov 			= 90.0;
-static bool useFrameBuffer 	= false;
+static bool useFrameBuffer 	= true; // Unless unavailable; see PortalTarget
+static bool useShaders 		= true; // For the walls, unless -fixed-function
+static const double MinPortalPixels = 64; // Below which portals within portals are not rendered
 static bool useDithering 	= false;
 static bool toggleMouse 	= true;
 
@@ -40,7 +80,7 @@ void InstallTexture(
 	int type1, int type2, 
 	int filter, int wrap
 ) {
-	glBindTexture(GL_TEXTURE_2D, txno);
+	GL::BindTexture(GL_TEXTURE_2D, txno);
 	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 	// Control how the texture repeats or not
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrap);
@@ -50,62 +90,157 @@ void InstallTexture(
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter); // 
 	// Decide upon the manner in which to import the texture
 	if (filter == GL_LINEAR || filter == GL_NEAREST)
-		glTexImage2D(GL_TEXTURE_2D, 0, type1, w, h, 0, type1, type2, data);
+		GL::TexImage2D(GL_TEXTURE_2D, 0, type1, w, h, 0, type1, type2, data);
 	else
 		gluBuild2DMipmaps(GL_TEXTURE_2D, type1, w, h, type1, type2, data);
 }
 
+// Like InstallTexture, but with a chain of mipmaps (see BuildMipmaps)
+// that was prepared beforehand, rather than built by gluBuild2DMipmaps.
+void InstallMipmaps(
+	const float *data,
+	const std::vector<std::vector<float> > &mipmaps,
+	int w, int h,
+	int txno,
+	int type1,
+	int filter, int wrap
+) {
+	InstallTexture(data, w, h, txno, type1, GL_FLOAT, GL_LINEAR, wrap);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+	for (unsigned level = 0; level < mipmaps.size(); ++level) {
+		w = std::max(1, w / 2);
+		h = std::max(1, h / 2);
+		GL::TexImage2D(GL_TEXTURE_2D, level + 1, type1, w, h, 0, type1, GL_FLOAT,
+					&mipmaps[level][0]);
+	}
+}
+
+// Replaces a rectangle of a texture created by InstallTexture.
+void InstallSubTexture(
+	const void *data,
+	int x, int y, int w, int h,
+	int txno,
+	int type1, int type2
+) {
+	GL::BindTexture(GL_TEXTURE_2D, txno);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	GL::TexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, type1, type2, data);
+}
+
 void ActivateTexture(int layer, int txno, int mode = GL_MODULATE) {
-	glActiveTextureARB(layer);
-	glEnable(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, txno);
-	glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, mode);
-	glColor3f(1, 1, 1);
+	GL::ActiveTexture(layer);
+	GL::Enable(GL_TEXTURE_2D);
+	GL::BindTexture(GL_TEXTURE_2D, txno);
+	GL::TexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, mode);
+	GL::Color3f(1, 1, 1);
+}
+// Binds txno to a unit that only shaders read, so needs neither enabling
+// nor a texture environment.
+void BindTextureUnit(int layer, int txno) {
+	GL::ActiveTexture(layer);
+	GL::BindTexture(GL_TEXTURE_2D, txno);
 }
 void DisableTexture(int layer) {
-	glActiveTextureARB(layer);
-	glBindTexture(GL_TEXTURE_2D, 0);
-	glDisable(GL_TEXTURE_2D);
-	glColor3f(1, 1, 1);
+	GL::ActiveTexture(layer);
+	GL::BindTexture(GL_TEXTURE_2D, 0);
+	GL::Disable(GL_TEXTURE_2D);
+	GL::Color3f(1, 1, 1);
+}
+
+// The corners of a portal's quad, made by rotating the portal's "up"
+// vector around its "dir" at 90 degree steps.
+static void PortalCorners(const Actor &portal, XYZ<double> corners[4]) {
+	Matrix<double> a;
+	for (unsigned e = 0; e < 4; ++e) {
+		a.InitAxisRotate(portal.dir, (e * 90 + 45) * -M_PI / 180.0);
+		XYZ<double> v = portal.up;
+		a.Transform(v);
+		corners[e] = v * 0.75 + portal.camera;
+	}
+}
+
+// Whether the front of a portal can be seen in view.
+static bool PortalInView(const Actor &portal, const Frustum &view) {
+	if (portal.dir.Squared() == 0) return false; // Never placed
+	if ((view.Eye() - portal.camera).Dot(portal.dir) <= 0) return false; // Facing away
+	XYZ<double> corners[4];
+	PortalCorners(portal, corners);
+	return !view.Outside(corners, 4);
+}
+
+// Carries what is in front of the seen portal to where it is seen from
+// through the vista portal: going into the front of one is coming out of
+// the front of the other, turned around its up, so that what was on the
+// left is still on the left.
+class PortalPassage {
+	public:
+	PortalPassage(const Actor &seen, const Actor &vista) : from(seen.camera), to(vista.camera) {
+		from_axes[0] = seen.dir;
+		from_axes[1] = seen.up;
+		from_axes[2] = seen.dir.Cross(seen.up);
+		to_axes[0] = vista.dir * -1.0;
+		to_axes[1] = vista.up;
+		to_axes[2] = vista.dir.Cross(vista.up) * -1.0;
+	}
+	XYZ<double> Point(const XYZ<double> &p) const {
+		XYZ<double> q = to;
+		for (unsigned a = 0; a < 3; ++a) q += to_axes[a] * (p - from).Dot(from_axes[a]);
+		return q;
+	}
+
+	private:
+	XYZ<double> from, to, from_axes[3], to_axes[3];
+};
+
+// What eye, carried behind the vista portal by a PortalPassage, sees out
+// of it: square on to the portal, which fills the view, so that the image
+// maps onto the seen portal as it is drawn, and with the near plane on the
+// portal, so that nothing behind it gets in the way (see Frustum::Through).
+static Frustum PortalView(const Actor &vista, const XYZ<double> &eye) {
+	XYZ<double> corners[4];
+	PortalCorners(vista, corners);
+	return Frustum::Through(eye, vista.dir, vista.up, corners, Actor::ViewDistance);
 }
 
 namespace PC {
 	int W = 1024, H = W * 9 / 16;
-	const unsigned DitheringBits = 6;
-	const unsigned R = 7, G = 9, B = 4; // 7*9*4 regular palette (252 colors)
-	const double PaletteGamma = 1.5;    // Apply this gamma to palette
-	const double DitherGamma = 2.0 / PaletteGamma; // Apply this gamma to dithering
-	const bool TemporalDithering = true;
-	unsigned char ColorConvert[3][256][256], Dither8x8[8][8];
-	unsigned Pal[R * G * B];
-
-	unsigned int* ImageBuffer = NULL;//[W * H];
+	PaletteDither Palette;
+	PortalBudget Recursion(3); // See Render
+
+	// The frame read back for dithering. With pixel buffer objects, the GL
+	// copies each frame into one of DitherPBOs while we dither the one it
+	// copied the frame before; otherwise ImageBuffer is read into directly.
+	std::vector<uint32_t> ImageBuffer;
+	GLuint DitherPBOs[2] = {0, 0}, DitherTexture = 0;
+	int DitherW = 0, DitherH = 0; // Size they were made for
+	unsigned DitherFrames = 0;    // Frames read back at that size
 	int selector;
 
+	// With -software, or without OpenGL, frames are drawn by Soft instead:
+	// the player's view straight into ImageBuffer, and each portal's into
+	// one of its two SoftPortals while the other, drawn the frame before,
+	// is shown on it.
+	bool Software = false;
+	SoftTarget SoftScreen, SoftPortals[2][2];
+	unsigned SoftShown[2] = {0, 0};
+
+	// Input gathered since the last tick, for the next one to act upon.
+	TickInput Pending;
+	InputRecorder Recorder;
+	InputReplayer Replayer; // Replaces live input while open
+
 	// End graphics
 	void Close(int code = 0) {
 		if (code != 0) std::cout << "Error!" << std::endl;
-		// if (ImageBuffer != NULL) delete ImageBuffer;
-		// ImageBuffer = NULL;
 
-		SDL_GL_DeleteContext(ctx);
+		if (ctx) SDL_GL_DeleteContext(ctx);
 		if (window != NULL) SDL_DestroyWindow(window);
 		SDL_Quit();
 		exit(code);
 	}
 
-	// Initialize graphics
-	void Init() {
-		if (SDL_Init(SDL_INIT_EVERYTHING) < 0) Close(1);
-		SDL_WindowFlags window_flags = (SDL_WindowFlags)(
-			SDL_WINDOW_SHOWN |
-			SDL_WINDOW_RESIZABLE
-		);
-		window = SDL_CreateWindow("OpenGL 256 FPS Demo", SDL_WINDOWPOS_CENTERED,
-									SDL_WINDOWPOS_CENTERED, PC::W, PC::H, window_flags);
-		if (window == NULL) Close(1);
-
-		//
+	// Creates the OpenGL context, or leaves Software set if there is none.
+	void InitGL() {
 		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 2);
 		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 1);
 		// SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
@@ -114,7 +249,11 @@ namespace PC {
 							SDL_GL_CONTEXT_FORWARD_COMPATIBLE_FLAG);
 		SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
 		ctx = SDL_GL_CreateContext(window);
-		if (ctx == NULL) Close(1);
+		if (ctx == NULL) {
+			std::cout << "No OpenGL context (" << SDL_GetError() << "), drawing in software" << std::endl;
+			Software = true;
+			return;
+		}
 
 		SDL_GL_MakeCurrent(window, ctx);
 		SDL_GL_SetSwapInterval(1);
@@ -122,36 +261,63 @@ namespace PC {
 		GLenum glew_check;
 		glewExperimental = GL_TRUE;
 		glew_check = glewInit();
-		if (glew_check != GLEW_OK) Close(1);
+		if (glew_check != GLEW_OK) {
+			std::cout << "GLEW could not start, drawing in software" << std::endl;
+			SDL_GL_DeleteContext(ctx);
+			ctx = NULL;
+			Software = true;
+			return;
+		}
+		InstallGLDebugOutput();
 
 		if (CheckGLError("PC::Init")) PC::Close(1);
+	}
 
-		// Create bayer 8x8 dithering matrix.
-		for (unsigned y = 0; y < 8; ++y)
-			for (unsigned x = 0; x < 8; ++x)
-			Dither8x8[y][x] = ((x)&4) / 4u + ((x)&2) * 2u + ((x)&1) * 16u +
-								((x ^ y) & 4) / 2u + ((x ^ y) & 2) * 4u +
-								((x ^ y) & 1) * 32u;
-
-		// Create gamma-corrected look-up tables for dithering.
-		double dtab[256], ptab[256];
-		for (unsigned n = 0; n < 256; ++n) {
-			dtab[n] = (255.0 / 256.0) - std::pow(n / 256.0, 1 / DitherGamma);
-			ptab[n] = std::pow(n / 255.0, 1.0 / PaletteGamma);
-		}
-		for (unsigned n = 0; n < 256; ++n) {
-			for (unsigned d = 0; d < 256; ++d) {
-				ColorConvert[0][n][d] = std::min(B - 1, (unsigned)(ptab[n] * (B - 1) + dtab[d]));
-				ColorConvert[1][n][d] = B * std::min(G - 1, (unsigned)(ptab[n] * (G - 1) + dtab[d]));
-				ColorConvert[2][n][d] = G * B * std::min(R - 1, (unsigned)(ptab[n] * (R - 1) + dtab[d]));
-			}
-		}
-		for (unsigned color = 0; color < R * G * B; ++color) {
-			Pal[color] =
-				0x40000 * (int)(std::pow(((color / (B * G)) % R) * 1. / (R - 1), PaletteGamma) * 63) +
-				0x00400 * (int)(std::pow(((color / B) % G) * 1. / (G - 1), PaletteGamma) * 63) +
-				0x00004 * (int)(std::pow(((color) % B) * 1. / (B - 1), PaletteGamma) * 63);
-		}
+#ifdef HEADLESS
+	// Makes an offscreen context of W*H instead, with no window, for
+	// -regress: on EGL's surfaceless platform, which Mesa has even without
+	// a GPU (llvmpipe).
+	bool InitHeadless() {
+		setenv("EGL_PLATFORM", "surfaceless", 0);
+		EGLDisplay display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+		if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL)) return false;
+		const EGLint config_attribs[] = {
+			EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+			EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_DEPTH_SIZE, 24, EGL_NONE
+		};
+		EGLConfig config;
+		EGLint configs = 0;
+		if (!eglChooseConfig(display, config_attribs, &config, 1, &configs) || configs < 1) return false;
+		const EGLint surface_attribs[] = { EGL_WIDTH, W, EGL_HEIGHT, H, EGL_NONE };
+		EGLSurface surface = eglCreatePbufferSurface(display, config, surface_attribs);
+		if (surface == EGL_NO_SURFACE || !eglBindAPI(EGL_OPENGL_API)) return false;
+		EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);
+		if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, surface, surface, context)) return false;
+
+		glewExperimental = GL_TRUE;
+		GLenum glew_check = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+		// GLEW built for GLX also wants a GLX display, which is not needed here.
+		if (glew_check == GLEW_ERROR_NO_GLX_DISPLAY) glew_check = GLEW_OK;
+#endif
+		if (glew_check != GLEW_OK) return false;
+		InstallGLDebugOutput();
+		return !CheckGLError("PC::InitHeadless");
+	}
+#endif
+
+	// Initialize graphics
+	void Init() {
+		if (SDL_Init(SDL_INIT_EVERYTHING) < 0) Close(1);
+		SDL_WindowFlags window_flags = (SDL_WindowFlags)(
+			SDL_WINDOW_SHOWN |
+			SDL_WINDOW_RESIZABLE
+		);
+		window = SDL_CreateWindow("OpenGL 256 FPS Demo", SDL_WINDOWPOS_CENTERED,
+									SDL_WINDOWPOS_CENTERED, PC::W, PC::H, window_flags);
+		if (window == NULL) Close(1);
+
+		if (!Software) InitGL();
 
 		if (toggleMouse) {
 			SDL_WarpMouseInWindow(window, W / 2, H / 2);
@@ -162,7 +328,10 @@ namespace PC {
 		// glDeleteRenderbuffers(1, &targetBuffer);
 	}
 
-	void Update(BlobActor& player, Actor portals[], std::list<BlobActor> blobs) {
+	// Handles events once per frame, and gathers aiming and portal shots
+	// into Pending.
+	void Update(const BlobActor& player) {
+		PROFILE_SCOPE("PC::Update");
 		SDL_Event e;
 		while (SDL_PollEvent(&e)) {
 			switch (e.type) {
@@ -179,6 +348,7 @@ namespace PC {
 					}
 					if (sc == SDL_SCANCODE_1) fov = std::max(fov - 1, 65.0);
 					if (sc == SDL_SCANCODE_2) fov = std::min(fov + 1, 110.0);
+					if (sc == SDL_SCANCODE_P) useDithering = !useDithering;
 				} break;
 				case SDL_WINDOWEVENT: {
 					const auto we = e.window.event;
@@ -193,8 +363,6 @@ namespace PC {
 					} 
 					if (we == SDL_WINDOWEVENT_RESIZED) {
 						SDL_GetWindowSize(window, &PC::W, &PC::H);
-						// if (ImageBuffer != NULL) delete ImageBuffer;
-						// ImageBuffer = new GLuint(W * H);
 					}
 				} break;
 				case SDL_MOUSEMOTION: {
@@ -202,391 +370,868 @@ namespace PC {
 					
 				} break;
 				case SDL_MOUSEBUTTONDOWN: {
-					// Fire a portal
-					Actor &portal = portals[e.button.button == SDL_BUTTON_LEFT ? 1 : 0];
-					HitRec r = IntersectRay(player.camera, player.dir, map);
-					portal.dir = map[r.wallno].normal;
-					portal.camera = r.hit + portal.dir * 1e-4;
-					// Figure out where the "up" vector for the portal should go.
-					portal.up = portal.dir.Cross(player.dir.Cross(player.up)).Normalized();
-					portal.up *= -1.0;
+					// Fire a portal where the player is looking
+					PortalShot shot;
+					shot.portal = e.button.button == SDL_BUTTON_LEFT ? 1 : 0;
+					shot.org = player.camera;
+					shot.dir = player.dir;
+					Pending.shots.push_back(shot);
 				} break;
 			}
 		}
 
-		// Update Player Movement
-		// const bool keys[SDL_NUM_SCANCODES] = { false };
-		const unsigned char* keys = SDL_GetKeyboardState(NULL);
-		// auto sc = e.key.keysym.scancode;
-		if (keys[SDL_SCANCODE_ESCAPE]) PC::Close();
-		if (keys[SDL_SCANCODE_W]) player.MovementSignal(BlobActor::sig_push,   0);
-		if (keys[SDL_SCANCODE_S]) player.MovementSignal(BlobActor::sig_push, 180);
-		if (keys[SDL_SCANCODE_A]) player.MovementSignal(BlobActor::sig_push, -90);
-		if (keys[SDL_SCANCODE_D]) player.MovementSignal(BlobActor::sig_push,  90);
-		if (keys[SDL_SCANCODE_SPACE]) player.MovementSignal(BlobActor::sig_jump);
-		if (keys[SDL_SCANCODE_B]) {
-			BlobActor blob;
-			blob.fatness = {{0.45, 0.45, 0.45}};
-			blob.camera = player.camera + player.dir * 0.2;
-			blob.dir = player.dir;
-			blob.vel = player.dir * 0.2 + player.vel;
-			blobs.push_back(blob);
-		}
+		if (SDL_GetKeyboardState(NULL)[SDL_SCANCODE_ESCAPE]) PC::Close();
+
 		// Update Player Camera Rotation 
 		if (toggleMouse) {
 			int mx, my;
 			SDL_GetRelativeMouseState(&mx, &my);
-			player.MovementSignal(BlobActor::sig_aim, (short)-(mx * mouseSens), (short)-(my * mouseSens));
+			Pending.aim_x += (short)-(mx * mouseSens);
+			Pending.aim_y += (short)-(my * mouseSens);
+		}
+
+		if (!Software && CheckGLError("Update")) PC::Close(1);
+	}
+
+	// Advances the game by one tick of FixedTimestep, with live or
+	// replayed input, recording it if asked to.
+	void Tick(BlobActor& player, Actor portals[], BlobPool& blobs, WorkStealingPool& workers) {
+		PROFILE_SCOPE("PC::Tick");
+		uint32_t recorded = 0;
+		if (Replayer.IsOpen()) {
+			if (!Replayer.Next(Pending, recorded)) {
+				std::cout << "Replayed " << Replayer.Ticks() << " ticks, "
+						  << Replayer.Diverged() << " diverged" << std::endl;
+				PC::Close(Replayer.Diverged() ? 2 : 0);
+			}
+		} else {
+			// Update Player Movement
+			const unsigned char* keys = SDL_GetKeyboardState(NULL);
+			if (keys[SDL_SCANCODE_W]) Pending.keys |= TickInput::Forward;
+			if (keys[SDL_SCANCODE_S]) Pending.keys |= TickInput::Back;
+			if (keys[SDL_SCANCODE_A]) Pending.keys |= TickInput::Left;
+			if (keys[SDL_SCANCODE_D]) Pending.keys |= TickInput::Right;
+			if (keys[SDL_SCANCODE_SPACE]) Pending.keys |= TickInput::Jump;
+			if (keys[SDL_SCANCODE_B]) Pending.keys |= TickInput::Blob;
 		}
 
-		player.Update();
-		if (CheckGLError("Update")) PC::Close(1);
+		RunTick(Pending, player, portals, blobs, workers, LevelBVH);
+		++frameStats.ticks;
+
+		if (Recorder.IsOpen() || Replayer.IsOpen()) {
+			uint32_t hash = StateHash::Of(player, portals, blobs);
+			if (Replayer.IsOpen() && !Replayer.Check(recorded, hash) && Replayer.Diverged() == 1)
+				std::cout << "Replay diverged from the recording at tick "
+						  << Replayer.FirstDivergence() << std::endl;
+			Recorder.Write(Pending, hash);
+		}
+		Pending.Clear();
+	}
+
+	// Reads back the frame just rendered, reduces it to the palette and draws
+	// that over it. With pixel buffer objects, what is drawn is the frame
+	// before, which the GL has had a frame's time to copy, so that we need
+	// not wait for it; the dithered image lags a frame behind.
+	void Dither(WorkStealingPool& workers) {
+		PROFILE_GPU_SCOPE("dithering");
+		const bool async = GLEW_ARB_pixel_buffer_object;
+		const size_t pixels = size_t(W) * H;
+		if (W != DitherW || H != DitherH) {
+			if (!DitherTexture) glGenTextures(1, &DitherTexture);
+			ActivateTexture(GL_TEXTURE0_ARB, DitherTexture, GL_REPLACE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			GL::TexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, W, H, 0, GL_BGRA, GL_UNSIGNED_BYTE, NULL);
+			if (async) {
+				if (!DitherPBOs[0]) glGenBuffers(2, DitherPBOs);
+				for (unsigned n = 0; n < 2; ++n) {
+					GL::BindBuffer(GL_PIXEL_PACK_BUFFER, DitherPBOs[n]);
+					GL::BufferData(GL_PIXEL_PACK_BUFFER, pixels * 4, NULL, GL_STREAM_READ);
+				}
+			}
+			ImageBuffer.resize(pixels);
+			DitherW = W;
+			DitherH = H;
+			DitherFrames = 0;
+		}
+
+		const unsigned frame = DitherFrames++;
+		if (async) {
+			GL::BindBuffer(GL_PIXEL_PACK_BUFFER, DitherPBOs[frame & 1]);
+			glReadPixels(0, 0, W, H, GL_BGRA, GL_UNSIGNED_BYTE, NULL);
+			if (frame == 0) {
+				// Nothing to show until the next frame.
+				GL::BindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+				return;
+			}
+			GL::BindBuffer(GL_PIXEL_PACK_BUFFER, DitherPBOs[~frame & 1]);
+			const void* mapped = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+			if (mapped) {
+				PROFILE_SCOPE("dither kernel");
+				Palette.Image(static_cast<const uint32_t*>(mapped), ImageBuffer.data(), W, H, frame, workers);
+			}
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+			GL::BindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			if (!mapped) return;
+		} else {
+			glReadPixels(0, 0, W, H, GL_BGRA, GL_UNSIGNED_BYTE, ImageBuffer.data());
+			PROFILE_SCOPE("dither kernel");
+			Palette.Image(ImageBuffer.data(), ImageBuffer.data(), W, H, frame, workers);
+		}
+
+		// Draw it over the whole window, untouched by anything else.
+		GL::PushAttrib(GL_ENABLE_BIT | GL_TEXTURE_BIT | GL_CURRENT_BIT);
+		GL::Disable(GL_DEPTH_TEST);
+		GL::Disable(GL_LIGHTING);
+		GL::Disable(GL_BLEND);
+		for (GLenum unit = GL_TEXTURE1_ARB; unit <= GL_TEXTURE3_ARB; ++unit) DisableTexture(unit);
+		ActivateTexture(GL_TEXTURE0_ARB, DitherTexture, GL_REPLACE);
+		GL::TexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, W, H, GL_BGRA, GL_UNSIGNED_BYTE, ImageBuffer.data());
+		glMatrixMode(GL_PROJECTION);
+		glLoadIdentity();
+		glMatrixMode(GL_MODELVIEW);
+		glLoadIdentity();
+		static const GLfloat corners[4][3] = { {-1, -1, 0}, {1, -1, 0}, {1, 1, 0}, {-1, 1, 0} };
+		GL::Begin(GL_QUADS);
+		for (unsigned n = 0; n < 4; ++n) {
+			glTexCoord2f(corners[n][0] > 0, corners[n][1] > 0);
+			GL::Vertex3fv(corners[n]);
+		}
+		glEnd();
+		GL::PopAttrib();
 	}
 
 	template <class Func>
 	void Render(
-		const unsigned PW, const unsigned PH, 
 		Actor portals[], BlobActor& player,
-		GLuint frame_buffers[], Func &RenderWorld,
-		GLuint portal_textures[]
+		PortalChain chains[], Func &RenderWorld,
+		WorkStealingPool& workers
 	) {
-		glViewport(0, 0, PW, PH);
-		for (int recursion = 0; recursion < 1; ++recursion) {
-			// Render both portal's point of view
-			for (int p = 0; p < 2; ++p) {
-				int seen = p, vista = 1 - p;
-				Actor &seen_portal = portals[seen];   // Which portal presents the view
-				Actor &vista_portal = portals[vista]; // Which portal's view is seen
-
-				XYZ<double> eye_to_seen_portal = seen_portal.camera - player.camera;
-				double eye_to_seen_distance = eye_to_seen_portal.Len();
-				eye_to_seen_portal /= eye_to_seen_distance; // Normalize
-
-				// // Figure out the angle between the seen_portal's normal&up and
-				// // eye_to_seen_portal,
-				// double dir_portaldir_cosine =
-				// eye_to_seen_portal.Dot(seen_portal.dir); double dir_portalup_cosine =
-				// eye_to_seen_portal.Dot(seen_portal.up);
-				// // Create a new eye-beam by translating that angle to vista_portal's
-				// // normal&up.
-
-				// // FIXME: FIGURE OUT HOW TO TRANSLATE THE VIEW!
-
-				// TODO: Add such projection that all camera rays are cast parallel to
-				// a viewing plane that is larger as audience comes nearer.
-				double distance = (portals[seen].camera - player.camera).Len();
-				double portalfov = 180.0 / (1 + distance);
-
-				// fprintf(stderr, 
-				// 	"Portal %d at <%.5f,%.5f,%.5f>, dir=<%.5f,%.5f,%.5f>, up=<%.5f,%.5f,%.5f>, cos=%.5f\n",
-				//     p,
-				//     seen_portal.camera.d[0],
-				//     seen_portal.camera.d[1],
-				//     seen_portal.camera.d[2],
-				//     seen_portal.dir.d[0],
-				//     seen_portal.dir.d[1],
-				//     seen_portal.dir.d[2],
-				//     seen_portal.up.d[0],
-				//     seen_portal.up.d[1],
-				//     seen_portal.up.d[2],
-				//     seen_portal.dir.Dot(seen_portal.up)
-				// );
-
-				if (useFrameBuffer) {
-					glBindFramebuffer(GL_FRAMEBUFFER, frame_buffers[seen]);
-				} else {
-					glPushAttrib(GL_COLOR_BUFFER_BIT | GL_PIXEL_MODE_BIT); //  // 
-					glDrawBuffer(GL_BACK);
-					glReadBuffer(GL_BACK);
-				}
-				vista_portal.Render(RenderWorld, portalfov, 1.0 / 1.0);
-
-				if (useFrameBuffer) {
-					ActivateTexture(GL_TEXTURE0_ARB, portal_textures[seen]);
-                	glGenerateMipmapEXT(GL_TEXTURE_2D);
-				} else {
-					ActivateTexture(GL_TEXTURE0_ARB, portal_textures[seen]);
-					glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, PW, PH);
-					glGenerateMipmapEXT(GL_TEXTURE_2D);
-					glPopAttrib();
+		const double aspect = (double)PC::W / (double)PC::H;
+		const Frustum view = player.View(fov, aspect);
+		// Render both portal's point of view
+		for (int p = 0; p < 2; ++p) {
+			int seen = p, vista = 1 - p;
+			Actor &seen_portal = portals[seen];   // Which portal presents the view
+			Actor &vista_portal = portals[vista]; // Which portal's view is seen
+			PortalChain &chain = chains[seen];
+			// Nothing to render if the player cannot see the portal, nor
+			// anything to see through it before the other one is placed.
+			if (!PortalInView(seen_portal, view) || vista_portal.dir.Squared() == 0) continue;
+
+			// Level 0 is seen from the player's eye carried through the
+			// portals, level 1, the view on the seen portal within that one,
+			// from that eye carried through once more, and so on. Go as
+			// deep as the seen portal is in the last level's view, and its
+			// image there stays big enough to see, and as the budget allows.
+			const PortalPassage passage(seen_portal, vista_portal);
+			XYZ<double> corners[4], eyes[PortalChain::MaxDepth];
+			PortalCorners(seen_portal, corners);
+			eyes[0] = passage.Point(player.camera);
+			double pixels = view.Coverage(corners, 4) * PC::W * PC::H;
+			unsigned levels = 1;
+			while (levels < std::min(Recursion.MaxDepth(), chain.Depth())) {
+				const Frustum last = PortalView(vista_portal, eyes[levels - 1]);
+				if (!PortalInView(seen_portal, last) || (pixels *= last.Coverage(corners, 4)) < MinPortalPixels)
+					break;
+				eyes[levels] = passage.Point(eyes[levels - 1]);
+				++levels;
+			}
+			levels = Recursion.Levels(levels);
+
+			// Deepest first, each showing the one beneath on the portal.
+			// The deepest shows what it did the last frame.
+			for (unsigned level = levels; level-- > 0; ) {
+				PROFILE_GPU_SCOPE("portal pass");
+				PortalTarget &target = chain[level];
+				chain.shown = (level + 1 < levels ? chain[level + 1] : target).Texture();
+				Recursion.BeginPass();
+				target.Begin();
+				vista_portal.Render(RenderWorld, PortalView(vista_portal, eyes[level]));
+				{
+					PROFILE_GPU_SCOPE("portal texture");
+					target.End();
 				}
+				Recursion.EndPass();
 			}
 		}
+		for (int p = 0; p < 2; ++p) chains[p].shown = chains[p][0].Texture();
 
-		if (useFrameBuffer) {
-			glBindFramebuffer(GL_FRAMEBUFFER, 0);
-		} 
 		glViewport(0, 0, PC::W, PC::H);
 
 		// glBindFramebuffer(GL_FRAMEBUFFER, fbo);
 		// glBindRenderbuffer(GL_RENDERBUFFER, targetBuffer);
 		// Render player's point of view
-		if (player.Render(RenderWorld, fov, (double)PC::W / (double)PC::H)) {
-			if (CheckGLError("Player::Render")) PC::Close(1);
+		{
+			PROFILE_GPU_SCOPE("player pass");
+			player.Render(RenderWorld, fov, aspect);
 		}
 		// glBindFramebuffer(GL_FRAMEBUFFER, 0);
 		// glBindFramebuffer(GL_FRAMEBUFFER, fbo);
 		// glBindRenderbuffer(GL_RENDERBUFFER, 0);
 
-		if (useDithering) {
-			// static unsigned f = 0; ++f; // Frame number
-			// if (ImageBuffer != NULL) {
-			// 	for (unsigned p = 0, y = 0; y < (unsigned)H; ++y) {
-			// 		for (unsigned x = 0; x < (unsigned)W; ++x, ++p) {
-			// 			// Convert the RGB color into a palette index with dithering
-			// 			unsigned rgb = ImageBuffer[p], d = Dither8x8[y&7][x&7]; // 0..63
-			// 			d &= (0x3F - (0x3F >> DitheringBits));
-			// 			if(!TemporalDithering)
-			// 				d *= 4; // No temporal dithering
-			// 			else // Do temporal dithering
-			// 				d += ((f^y^(x&1)*2u ^ (x&2)/2u) & 3) << 6;
-			// 			// Put the pixel in video memory
-			// 			ImageBuffer[p] = Pal[
-			// 				ColorConvert[0][(rgb >> 0) & 0xFF][d]
-			// 			+ ColorConvert[1][(rgb >> 8) & 0xFF][d]
-			// 			+ ColorConvert[2][(rgb >>16) & 0xFF][d] ];
-			// 		}
-			// 	}
-			// }
-		}
-
-		SDL_GL_SwapWindow(window);
+		if (useDithering) Dither(workers);
+
+		if (window) {
+			PROFILE_SCOPE("SDL_GL_SwapWindow");
+			SDL_GL_SwapWindow(window);
+		} else {
+			glFinish(); // Offscreen; see -regress
+		}
+		frameStats.EndFrame();
+		PROFILE_END_FRAME();
 
 		if (CheckGLError("Render")) PC::Close(1);
 	}
-} // namespace PC
 
+	// Draws view into target with Soft, as Actor::Render does with OpenGL.
+	template <class Func>
+	void SoftView(Actor &actor, SoftTarget &target, Func &RenderWorld, const Frustum &view,
+				  WorkStealingPool& workers) {
+		frameStats.BeginView();
+		Soft.Begin(target, actor.camera, view);
+		RenderWorld(actor, view);
+		Soft.Finish(workers);
+		frameStats.EndView();
+	}
 
+	// Render, for Software. Portals seen through portals show what they
+	// did the frame before, whatever the depth asked for.
+	template <class Func>
+	void SoftRender(Actor portals[], BlobActor& player, Func &RenderWorld, WorkStealingPool& workers) {
+		const double aspect = (double)PC::W / (double)PC::H;
+		const Frustum view = player.View(fov, aspect);
+		for (int p = 0; p < 2; ++p) {
+			if (!PortalInView(portals[p], view) || portals[1 - p].dir.Squared() == 0) continue;
+			PROFILE_SCOPE("portal pass");
+			const XYZ<double> eye = PortalPassage(portals[p], portals[1 - p]).Point(player.camera);
+			SoftView(portals[1 - p], SoftPortals[p][!SoftShown[p]], RenderWorld, PortalView(portals[1 - p], eye), workers);
+			SoftShown[p] ^= 1;
+		}
 
-// This function converts the level map into OpenGL quad primitives.
-// Not particularly optimized (in particular, everything is always rendered).
-static void ExtractLevelMap() {
-	glShadeModel(GL_SMOOTH);
+		if (SoftScreen.width != unsigned(W) || SoftScreen.height != unsigned(H)) SoftScreen.Init(W, H, ImageBuffer);
+		{
+			PROFILE_SCOPE("player pass");
+			SoftView(player, SoftScreen, RenderWorld, view, workers);
+		}
+		if (useDithering) {
+			PROFILE_SCOPE("dither kernel");
+			Palette.Image(ImageBuffer.data(), ImageBuffer.data(), W, H, DitherFrames++, workers);
+		}
 
-	// Walls are all created using this one texture.
-	if (!TexturesInstalled) {
-		// Generate a very simple rectangle of a texture.
-		glGenTextures(1, &WallTextureID);
-		glGenTextures(nwalls, LightmapIDs);
-		glGenTextures(nwalls, AddmapIDs);
-
-		const unsigned txW = 256, txH = 256;
-		GLfloat texture[txH * txW];
-		for (unsigned y = 0; y < txH; ++y)
-			for (unsigned x = 0; x < txW; ++x)
-				texture[y * txW + x] =
-				0.7 - ((1.0 - std::sqrt(int(x - txW / 2) * int(x - txW / 2) /
-				double(txW / 2.0) / (txW / 2.0) + int(y - txH / 2) * int(y - txH / 2) /
-				double(txH / 2.0) / (txH / 2.0))) * 0.6 -
-				!(x < 8 || y < 8 || (x + 8) >= txW || (y + 8) >= txH)) *
-				(0.1 + 0.3 * std::pow((std::rand() % 100) / 100.0, 2.0));
-		;
-		InstallTexture(texture, txW, txH, WallTextureID, GL_LUMINANCE, GL_FLOAT,
-					GL_LINEAR_MIPMAP_LINEAR, GL_REPEAT);
-	}
-	ActivateTexture(GL_TEXTURE0_ARB, WallTextureID);
-
-  	for (unsigned wallno = 0; wallno < nwalls; ++wallno) {
-		const maptype &m = map[wallno];
-		auto v10 = m.p[1] - m.p[0];
-		auto v30 = m.p[3] - m.p[0];
-		int width = v30.Len();  // Number of times the texture
-		int height = v10.Len(); // is repeated across the surface.
-
-		if (!TexturesInstalled) {
-			// Load lightmap.
-			unsigned lmW = width * 32, lmH = height * 32;
-			std::vector<float> map(lmW * lmH * 3);
-
-			char Buf[64];
-			std::snprintf(Buf, 64, "light/lmap/lmap%u.raw", wallno);
-			FILE *fp = std::fopen(Buf, "rb");
-			std::fread(&map[0], map.size(), sizeof(float), fp);
-			std::fclose(fp);
-			InstallTexture(&map[0], lmW, lmH, LightmapIDs[wallno], GL_RGB, GL_FLOAT,
-							GL_LINEAR, GL_CLAMP_TO_EDGE);
-
-			// Because OSMesa clamps all texture values into [0,1] range, meaning
-			// that a lightsource can only darken the texture, never brighten it,
-			// we must have a separate multiply-map and an add-map, where the
-			// former can darken the texture and the latter can only brighten it.
-			// (Unfortunately, due to how mathematics works, the add-map
-			//  is specific to the underlying texture is was designed for.)
-
-			std::snprintf(Buf, 64, "light/smap/smap%u.raw", wallno);
-			fp = std::fopen(Buf, "rb");
-			if (fp) {
-				UseAddmap[wallno] = true;
-				std::fread(&map[0], map.size(), sizeof(float), fp);
-				std::fclose(fp);
-				InstallTexture(&map[0], lmW, lmH, AddmapIDs[wallno], GL_RGB, GL_FLOAT,
-							GL_LINEAR, GL_CLAMP_TO_EDGE);
+		{
+			PROFILE_SCOPE("SDL_UpdateWindowSurface");
+			SDL_Surface* surface = SDL_GetWindowSurface(window);
+			if (surface) {
+				SDL_ConvertPixels(std::min(W, surface->w), std::min(H, surface->h), SDL_PIXELFORMAT_ARGB8888,
+								  ImageBuffer.data(), W * 4, surface->format->format, surface->pixels, surface->pitch);
+				SDL_UpdateWindowSurface(window);
 			}
-		} // TexturesInstalled
+		}
+		frameStats.EndFrame();
+		PROFILE_END_FRAME();
+	}
+} // namespace PC
 
-		if (UseAddmap[wallno])
-			ActivateTexture(GL_TEXTURE2_ARB, AddmapIDs[wallno], GL_ADD);
-		else
-			DisableTexture(GL_TEXTURE2_ARB);
 
-		if (UseDecals[wallno])
-			ActivateTexture(GL_TEXTURE3_ARB, DecalIDs[wallno], GL_DECAL);
-		else
-			DisableTexture(GL_TEXTURE3_ARB);
 
-		ActivateTexture(GL_TEXTURE1_ARB, LightmapIDs[wallno], GL_MODULATE);
+// Reads a whole .raw lightmap of exactly count floats.
+static bool ReadRawLightmap(const char *path, size_t count, std::vector<float> &out) {
+	FILE *fp = std::fopen(path, "rb");
+	if (!fp) return false;
+	out.resize(count);
+	size_t got = std::fread(&out[0], sizeof(float), count, fp);
+	std::fclose(fp);
+	if (got != count) std::cout << path << ": truncated" << std::endl;
+	return got == count;
+}
+
+// Fills a size*size RGB texture with one value, a strip at a time.
+static void FillTexture(int txno, unsigned size, GLubyte value) {
+	const unsigned rows = 16;
+	std::vector<GLubyte> strip(size * rows * 3, value);
+	for (unsigned y = 0; y < size; y += rows)
+		InstallSubTexture(&strip[0], 0, y, size, std::min(rows, size - y), txno,
+						GL_RGB, GL_UNSIGNED_BYTE);
+}
 
-		glNormal3fv(m.normal.d);
+// Generate a very simple rectangle of a texture, with its mipmaps.
+static void GenerateWallTexture() {
+	auto t = AssetLoader::Clock::now();
+	LoadedImage img;
+	img.kind = LoadedImage::WallTexture;
+	img.wallno = 0;
+	const unsigned txW = img.w = 256, txH = img.h = 256;
+	img.owned.resize(txW * txH);
+	GLfloat *texture = &img.owned[0];
+	WallTexels(texture, txW, txH);
+	BuildMipmaps(texture, txW, txH, 1, img.mipmaps);
+	img.data = texture;
+	Loader->Publish(std::move(img));
+	Loader->Time("wall texture", AssetLoader::Since(t));
+}
 
-		glBegin(GL_QUADS);
-		for (unsigned e = 0; e < 4; ++e) {
-			glMultiTexCoord2fARB(GL_TEXTURE0_ARB, width * !((e + 2) & 2),
-								height * !((e + 3) & 2));
-			glMultiTexCoord2fARB(GL_TEXTURE1_ARB, 1 * !((e + 2) & 2),
-								1 * !((e + 3) & 2));
-			if (UseAddmap[wallno])
-				glMultiTexCoord2fARB(GL_TEXTURE2_ARB, 1 * !((e + 2) & 2),
-									1 * !((e + 3) & 2));
-			if (UseDecals[wallno])
-				glMultiTexCoord2fARB(GL_TEXTURE3_ARB, 1 * !((e + 2) & 2),
-									1 * !((e + 3) & 2));
-			glVertex3fv(m.p[e].d);
+// Prepares one wall's lightmap and addmap for upload. They come from the
+// memory-mapped pack file when there is one (see lmpack.cpp), in which
+// case this only faults the pages in, and from the .raw files otherwise.
+// A wall whose lightmap did not fit the atlas keeps the neutral one.
+static void PrepareLightmaps(unsigned wallno, bool packed) {
+	const AtlasRect &r = Atlas.rects[wallno];
+	if (!r.fits) return;
+	auto t = AssetLoader::Clock::now();
+	const unsigned pad = Atlas.padding;
+	LoadedImage lmap, smap;
+	lmap.kind = LoadedImage::Lightmap;
+	smap.kind = LoadedImage::Addmap;
+	lmap.wallno = smap.wallno = wallno;
+	lmap.w = smap.w = r.w + pad * 2;
+	lmap.h = smap.h = r.h + pad * 2;
+	lmap.data = smap.data = NULL;
+
+	// Because OSMesa clamps all texture values into [0,1] range, meaning
+	// that a lightsource can only darken the texture, never brighten it,
+	// we must have a separate multiply-map and an add-map, where the
+	// former can darken the texture and the latter can only brighten it.
+	// (Unfortunately, due to how mathematics works, the add-map
+	//  is specific to the underlying texture is was designed for.)
+	if (packed) {
+		lmap.data = Pack.Lightmap(wallno);
+		smap.data = Pack.Addmap(wallno);
+		volatile float sink = 0;
+		for (const float *p : {lmap.data, smap.data})
+			for (size_t n = 0; p && n < lmap.w * lmap.h * 3; n += 1024) sink = p[n];
+		(void)sink;
+	} else {
+		// Load lightmap. A missing one leaves the wall unlit.
+		std::vector<float> map;
+		char Buf[256];
+		std::snprintf(Buf, sizeof(Buf), "%s/lmap/lmap%u.raw", Level.lightmaps, wallno);
+		if (!ReadRawLightmap(Buf, r.w * r.h * 3, map)) {
+			std::cout << Buf << ": missing, using a neutral lightmap" << std::endl;
+			map.assign(r.w * r.h * 3, 1.f);
 		}
-		glEnd();
+		Atlas.Pad(&map[0], r.w, r.h, lmap.owned);
+		lmap.data = &lmap.owned[0];
+
+		std::snprintf(Buf, sizeof(Buf), "%s/smap/smap%u.raw", Level.lightmaps, wallno);
+		if (ReadRawLightmap(Buf, r.w * r.h * 3, map)) {
+			Atlas.Pad(&map[0], r.w, r.h, smap.owned);
+			smap.data = &smap.owned[0];
+		}
+	}
+	Loader->Publish(std::move(lmap));
+	// Walls without an add-map need nothing; the page is black already.
+	if (smap.data) Loader->Publish(std::move(smap));
+	Loader->Time("lightmaps", AssetLoader::Since(t));
+}
+
+// Sets up the atlas pages and the level geometry, and starts preparing
+// the wall texture and all lightmaps on worker threads. Until they are
+// uploaded, walls are drawn with a flat texture and a neutral lightmap.
+// The walls nearest to eye are loaded first.
+static void StartLoading(const XYZ<double> &eye) {
+	Loader = new AssetLoader;
+	auto t = AssetLoader::Clock::now();
+	Loader->Submit(GenerateWallTexture);
+
+	glGenTextures(1, &WallTextureID);
+	const GLfloat grey = 0.6f;
+	InstallTexture(&grey, 1, 1, WallTextureID, GL_LUMINANCE, GL_FLOAT, GL_LINEAR, GL_REPEAT);
+
+	std::vector<AtlasRect> sizes(nwalls);
+	for (unsigned wallno = 0; wallno < nwalls; ++wallno) {
+		sizes[wallno].w = Level.walls[wallno].lmap_w;
+		sizes[wallno].h = Level.walls[wallno].lmap_h;
+	}
+
+	const std::string pak = std::string(Level.lightmaps) + "/lightmaps.pak";
+	bool packed = Pack.Open(pak.c_str()) && Pack.Walls() == nwalls;
+	for (unsigned wallno = 0; packed && wallno < nwalls; ++wallno)
+		packed = Pack.Entry(wallno).width == sizes[wallno].w
+			  && Pack.Entry(wallno).height == sizes[wallno].h;
+	if (Pack.IsOpen() && !packed) {
+		std::cout << pak << " does not match the level, using .raw files" << std::endl;
+		Pack.Close();
 	}
+
+	GLint maxSize = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+	Atlas.Pack(sizes, std::min<unsigned>(AtlasPageSize, maxSize),
+			   packed ? Pack.Padding() : AtlasPadding);
+
+	LightmapPages.resize(Atlas.npages);
+	AddmapPages.resize(Atlas.npages);
+	glGenTextures(Atlas.npages, &LightmapPages[0]);
+	glGenTextures(Atlas.npages, &AddmapPages[0]);
+	for (unsigned p = 0; p < Atlas.npages; ++p) {
+		InstallTexture(0, Atlas.page_size, Atlas.page_size, LightmapPages[p],
+					GL_RGB, GL_FLOAT, GL_LINEAR, GL_CLAMP_TO_EDGE);
+		InstallTexture(0, Atlas.page_size, Atlas.page_size, AddmapPages[p],
+					GL_RGB, GL_FLOAT, GL_LINEAR, GL_CLAMP_TO_EDGE);
+		FillTexture(LightmapPages[p], Atlas.page_size, 255);
+		FillTexture(AddmapPages[p], Atlas.page_size, 0);
+	}
+
+	// The geometry never changes, so it is sent to OpenGL only once.
+	LevelGeometry.Bake(Level.walls, Atlas, WallShading.Ready());
+	TexturesInstalled = true;
+
+	std::vector<std::pair<double, unsigned> > near;
+	for (unsigned wallno = 0; wallno < nwalls; ++wallno) {
+		const WallData &m = Level.walls[wallno];
+		XYZ<double> center = (m.p[0] + m.p[2]) * 0.5f;
+		near.push_back(std::make_pair((center - eye).Squared(), wallno));
+	}
+	std::sort(near.begin(), near.end());
+	for (const auto &n : near) {
+		unsigned wallno = n.second;
+		Loader->Submit([wallno, packed] { PrepareLightmaps(wallno, packed); });
+	}
+	Loader->Time("setup (GL)", AssetLoader::Since(t));
+}
+
+// Uploads whatever the workers have finished, for at most budget_ms.
+static void ContinueLoading(double budget_ms) {
+	if (!Loader) return;
+	PROFILE_SCOPE("ContinueLoading");
+	auto t = AssetLoader::Clock::now();
+	LoadedImage img;
+	while (AssetLoader::Since(t) < budget_ms && Loader->Take(img)) {
+		if (img.kind == LoadedImage::WallTexture) {
+			InstallMipmaps(img.data, img.mipmaps, img.w, img.h, WallTextureID,
+						GL_LUMINANCE, GL_LINEAR_MIPMAP_LINEAR, GL_REPEAT);
+			continue;
+		}
+		const AtlasRect &r = Atlas.rects[img.wallno];
+		const unsigned pad = Atlas.padding;
+		const bool add = img.kind == LoadedImage::Addmap;
+		InstallSubTexture(img.data, r.x - pad, r.y - pad, img.w, img.h,
+						(add ? AddmapPages : LightmapPages)[r.page], GL_RGB, GL_FLOAT);
+		if (add) {
+			UseAddmap[img.wallno] = true;
+			LevelGeometry.SetFlags(img.wallno, true);
+		}
+	}
+	Loader->Time("uploads (GL)", AssetLoader::Since(t));
+
+	if (Loader->Done()) {
+		Loader->Time("all ready at", Loader->Elapsed());
+		Loader->Report();
+		delete Loader;
+		Loader = NULL;
+		Pack.Close();
+	}
+}
+
+// Returns the bits of the walls that the potentially visible set has for
+// eye, and that are not outside view (64 to a word). The next call reuses
+// the same words.
+static const uint64_t *VisibleWalls(const XYZ<double>& eye, const Frustum& view) {
+	static std::vector<uint64_t> visible;
+	// Without a set for eye, every wall is potentially visible.
+	const unsigned words = (nwalls + 63) / 64;
+	visible.resize(words);
+	const uint64_t *pvs = PVS.Visible(eye);
+	for (unsigned w = 0; w < words; ++w) visible[w] = pvs ? pvs[w] : ~uint64_t(0);
+	if (nwalls % 64) visible[words - 1] &= (uint64_t(1) << nwalls % 64) - 1;
+	unsigned potential = 0;
+	for (unsigned w = 0; w < words; ++w) potential += __builtin_popcountll(visible[w]);
+	frameStats.cull.pvs_walls += nwalls - potential;
+	frameStats.cull.frustum_walls += view.Cull(WallBoxes, visible.data());
+	return visible.data();
+}
+
+// This function draws the level map from the vertex buffer baked on first use.
+// Only the walls that VisibleWalls gives for eye and view are drawn. With
+// WallShading, the textures are only bound; otherwise each unit is enabled
+// and given its texture environment as well.
+static void ExtractLevelMap(const XYZ<double>& eye, const Frustum& view) {
+	if (!TexturesInstalled) return;
+	PROFILE_GPU_SCOPE("ExtractLevelMap");
+	const bool shaded = WallShading.Ready();
+
+	// Walls are all created using this one texture.
+	if (shaded) {
+		WallShading.Begin(view);
+		BindTextureUnit(GL_TEXTURE0_ARB, WallTextureID);
+	} else {
+		GL::ShadeModel(GL_SMOOTH);
+		ActivateTexture(GL_TEXTURE0_ARB, WallTextureID);
+		DisableTexture(GL_TEXTURE3_ARB);
+	}
+	LevelGeometry.Bind();
+
+	const uint64_t *visible = VisibleWalls(eye, view);
+
+	// The visible walls on one atlas page are drawn with one bind and one
+	// draw call per unbroken run, except those with a decal, which still
+	// need a texture of their own.
+	unsigned draws = 0, immediate = 0, drawn = 0;
+	for (unsigned page = 0; page < Atlas.npages; ++page) {
+		unsigned run = Atlas.first[page], end = run + Atlas.count[page];
+		bool any = false;
+		for (unsigned slot = run; slot < end && !any; ++slot)
+			any = LevelPVS::Test(visible, Atlas.order[slot]);
+		if (!any) continue;
+
+		if (shaded) {
+			BindTextureUnit(GL_TEXTURE2_ARB, AddmapPages[page]);
+			BindTextureUnit(GL_TEXTURE1_ARB, LightmapPages[page]);
+		} else {
+			ActivateTexture(GL_TEXTURE2_ARB, AddmapPages[page], GL_ADD);
+			ActivateTexture(GL_TEXTURE1_ARB, LightmapPages[page], GL_MODULATE);
+		}
+		for (unsigned slot = run; slot < end; ++slot) {
+			const unsigned wallno = Atlas.order[slot];
+			const bool shown = LevelPVS::Test(visible, wallno);
+			// In immediate mode each wall took glNormal, glBegin, glEnd and
+			// a glVertex plus one glMultiTexCoord per enabled unit per corner.
+			if (shown) { immediate += 3 + 4 * (3 + UseAddmap[wallno] + UseDecals[wallno]); ++drawn; }
+			if (shown && !UseDecals[wallno]) continue;
+			// Flush the walls before this one, then draw it with its decal.
+			if (slot > run) { LevelGeometry.Draw(run, slot - run); ++draws; }
+			run = slot + 1;
+			if (!shown) continue;
+			if (shaded) {
+				BindTextureUnit(GL_TEXTURE3_ARB, DecalIDs[wallno]);
+				WallShading.ShowDecal(true);
+				LevelGeometry.Draw(slot); ++draws;
+				WallShading.ShowDecal(false);
+				continue;
+			}
+			ActivateTexture(GL_TEXTURE3_ARB, DecalIDs[wallno], GL_DECAL);
+			LevelGeometry.Draw(slot); ++draws;
+			DisableTexture(GL_TEXTURE3_ARB);
+		}
+		if (end > run) { LevelGeometry.Draw(run, end - run); ++draws; }
+	}
+	frameStats.saved_calls    += immediate - draws;
+	frameStats.saved_vertices += drawn * 4;
+
+	LevelGeometry.Unbind();
+	if (shaded) {
+		WallShading.End();
+		GL::ActiveTexture(GL_TEXTURE0_ARB);
+		return;
+	}
+	DisableTexture(GL_TEXTURE3_ARB);
 	DisableTexture(GL_TEXTURE2_ARB);
 	DisableTexture(GL_TEXTURE1_ARB);
 	DisableTexture(GL_TEXTURE0_ARB);
-	TexturesInstalled = true;
 }
 
+#ifdef HEADLESS
+// Renders each of RegressPoses as the main loop would, through PC::Render,
+// and compares it with dir/<pose>.ppm, or writes that instead if update is
+// set. Poses that do not match are written to dir/<pose>.failed.ppm. The
+// frame times are checked against dir/baseline.txt, or stored there with
+// update, and go to dir/report.json. Returns whether every pose passed.
+template <class Func>
+static bool Regress(const std::string &dir, bool update, BlobActor &player, Actor portals[],
+					PortalChain chains[], Func &RenderWorld, WorkStealingPool &workers) {
+	typedef std::chrono::steady_clock Clock;
+	const unsigned Warmup = 4, Timed = 16; // Frames; portals show the frame before
+	while (Loader) ContinueLoading(1000);
+	PC::Recursion.Fix();
+
+	const char *renderer = (const char *)glGetString(GL_RENDERER);
+	const std::string baseline = dir + "/baseline.txt";
+	std::vector<RegressResult> results(sizeof(RegressPoses) / sizeof(*RegressPoses));
+	if (!update) {
+		if (!ReadRegressBaseline(baseline, renderer, results))
+			std::cout << baseline << ": missing, frame times are not checked" << std::endl;
+		else if (!results[0].timed_against)
+			std::cout << baseline << ": from another renderer, frame times are not checked" << std::endl;
+	}
+	bool passed = true;
+	for (size_t n = 0; n < results.size(); ++n) {
+		const RegressPose &pose = RegressPoses[n];
+		RegressResult &r = results[n];
+		InitGame(player, portals);
+		player.camera = pose.camera;
+		player.look_angle = pose.look_angle;
+		player.yaw = pose.yaw;
+		player.Orient();
+		player.BeginTick();
+		for (uint8_t p = 0; p < 2; ++p) {
+			if (pose.portals[p][0] == 0 && pose.portals[p][1] == 0) continue;
+			BlobActor aim = player;
+			aim.look_angle = pose.portals[p][0];
+			aim.yaw = pose.portals[p][1];
+			aim.Orient();
+			FirePortal(PortalShot{ p, player.camera, aim.dir }, player, portals, LevelBVH);
+		}
 
-int main() {
-	const unsigned PW = std::min(PC::W, 128), PH = std::min(PC::H, 128);
+		for (unsigned f = 0; f < Warmup + Timed; ++f) {
+			auto t = Clock::now();
+			PC::Render(portals, player, chains, RenderWorld, workers);
+			if (f >= Warmup) r.ms.push_back(std::chrono::duration<double, std::milli>(Clock::now() - t).count());
+		}
+		r.gl = frameStats.last_gl;
+		r.cull = frameStats.last_cull;
+
+		RegressImage got;
+		got.w = PC::W;
+		got.h = PC::H;
+		got.rgb.resize(size_t(got.w) * got.h * 3);
+		std::vector<uint8_t> rows(got.rgb.size());
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glReadPixels(0, 0, got.w, got.h, GL_RGB, GL_UNSIGNED_BYTE, rows.data());
+		for (unsigned y = 0; y < got.h; ++y) // GL's rows run up
+			std::copy_n(&rows[size_t(got.h - 1 - y) * got.w * 3], got.w * 3, &got.rgb[size_t(y) * got.w * 3]);
+
+		const std::string path = dir + "/" + pose.name + ".ppm";
+		if (update) {
+			if (!got.Write(path)) std::cout << path << ": could not write" << std::endl;
+			r.Compare(got, got);
+		} else {
+			RegressImage want;
+			if (!want.Read(path)) std::cout << path << ": missing or not a 24-bit PPM" << std::endl;
+			r.Compare(got, want);
+			if (!r.Matches()) got.Write(dir + "/" + pose.name + ".failed.ppm");
+		}
+		passed = passed && r.Passed();
+		std::cout << pose.name << ": " << (r.Passed() ? "ok" : r.Matches() ? "TOO SLOW" : "FAILED") << ", "
+				  << r.bad_pixels << " pixels off by more than " << RegressResult::PixelTolerance << " (at most "
+				  << r.max_diff << "), " << r.Percentile(0.5) << " ms/frame";
+		if (r.baseline_ms > 0) std::cout << " (baseline " << r.baseline_ms << ")";
+		std::cout << std::endl;
+	}
+	if (update && !WriteRegressBaseline(baseline, renderer, results))
+		std::cout << baseline << ": could not write" << std::endl;
+	if (!WriteRegressReport(dir + "/report.json", PC::W, PC::H, renderer, results))
+		std::cout << dir << "/report.json: could not write" << std::endl;
+	return passed;
+}
+#endif
+
+// Usage: demo [-level file] [-record file] [-replay file] [-trace file] [-portal-depth levels]
+//             [-software] [-fixed-function] [-regress dir] [-regress-update dir]
+// -level plays the level in file (see levelfile.hpp) instead of level.lvl,
+// or of the level compiled in from map.hpp when there is no level.lvl.
+// -trace writes a Chrome trace of every frame, in builds with PROFILE.
+// -portal-depth sets how many levels of portals seen through portals are
+// rendered in a frame (default 3, fewer when frames run late; see
+// PC::Render and portalbudget.hpp).
+// -software draws with the CPU instead of OpenGL (see softraster.hpp).
+// -fixed-function shades the walls with texture environments instead of
+// GLSL (see wallshader.hpp).
+// -regress dir, in builds with HEADLESS, renders a few fixed poses offscreen
+// and checks them against the images in dir (see regress.hpp); with
+// -regress-update dir, it stores them there instead.
+int main(int argc, char **argv) {
+#ifdef HEADLESS
+	std::string regress;
+	bool regress_update = false;
+#endif
+	for (int a = 1; a < argc; ++a) {
+		std::string arg = argv[a];
+		bool ok = a + 1 < argc;
+		if (arg == "-software") ok = PC::Software = true;
+		else if (arg == "-fixed-function") { ok = true; useShaders = false; }
+		else if (ok && arg == "-level") ok = LevelFile::Current().Open(argv[++a]);
+		else if (ok && arg == "-record") ok = PC::Recorder.Open(argv[++a]);
+		else if (ok && arg == "-replay") ok = PC::Replayer.Open(argv[++a]);
+		else if (ok && arg == "-portal-depth") PC::Recursion.SetMaxDepth(std::atoi(argv[++a]));
+#ifdef PROFILE
+		else if (ok && arg == "-trace") ok = Profiler::Get().OpenTrace(argv[++a]);
+#endif
+#ifdef HEADLESS
+		else if (ok && arg == "-regress") regress = argv[++a];
+		else if (ok && arg == "-regress-update") { regress = argv[++a]; regress_update = true; }
+#endif
+		else ok = false;
+		if (!ok) {
+			// Only the options this build takes.
+			std::cout << "Usage: " << argv[0] << " [-level file] [-record file] [-replay file]"
+#ifdef PROFILE
+					  << " [-trace file]"
+#endif
+					  << " [-portal-depth levels] [-software] [-fixed-function]"
+#ifdef HEADLESS
+					  << " [-regress dir] [-regress-update dir]"
+#endif
+					  << std::endl;
+			return 1;
+		}
+	}
+	// make writes level.lvl again whenever map.hpp changes. One that still
+	// differs from the level compiled in was edited or exported elsewhere,
+	// and is played as it is.
+	if (!Level.IsOpen()) {
+		if (!LevelFile::Current().Open("level.lvl"))
+			std::cout << "level.lvl is missing, playing the level compiled in" << std::endl;
+		else if (PvsMapHash(Level.walls) != PvsMapHash(mapData))
+			std::cout << "level.lvl is not the level compiled in from map.hpp, playing it anyway" << std::endl;
+	}
+	nwalls = Level.walls.size();
+	UseAddmap.assign(nwalls, false);
+	UseDecals.assign(nwalls, false);
+	DecalIDs.assign(nwalls, 0);
+	DecalMaps.resize(nwalls);
+
+#ifdef HEADLESS
+	if (!regress.empty()) {
+		PC::W = 256; // Small enough to keep the reference images small
+		PC::H = PC::W * 9 / 16;
+		if (!PC::InitHeadless()) {
+			std::cout << "Could not make an offscreen OpenGL context" << std::endl;
+			return 1;
+		}
+	} else
+#endif
 	PC::Init();
+	const unsigned PW = std::min(PC::W, 128), PH = std::min(PC::H, 128);
 
-	glEnable(GL_DEPTH_TEST);
-	glEnable(GL_CULL_FACE);
-	glCullFace(GL_BACK);
-	glHint(GL_PERSPECTIVE_CORRECTION_HINT, GL_NICEST);
-	glHint(GL_LINE_SMOOTH_HINT, GL_NICEST);
-	glHint(GL_POLYGON_SMOOTH_HINT, GL_NICEST);
+	if (!PC::Software) {
+		GL::Enable(GL_DEPTH_TEST);
+		GL::Enable(GL_CULL_FACE);
+		glCullFace(GL_BACK);
+		glHint(GL_PERSPECTIVE_CORRECTION_HINT, GL_NICEST);
+		glHint(GL_LINE_SMOOTH_HINT, GL_NICEST);
+		glHint(GL_POLYGON_SMOOTH_HINT, GL_NICEST);
 
-	{
 		GLfloat v[4] = {0, 0, 0, 0};
 		glLightModelfv(GL_LIGHT_MODEL_AMBIENT, v);
 	}
 
 	BlobActor player;
-	player.fatness = {{0.2, 0.6, 0.2}}; // Shape of the ellipsoid
-	player.center = {{0, 0.3, 0}};      // representing the actor
-	player.camera = {{4, 3, 7.25}};     // Location thereof
-	player.look_angle = 170;
-	player.yaw = 10; // Where it is facing
+	Actor portals[2];
+	InitGame(player, portals);
 
-	std::list<BlobActor> blobs;
+	BlobPool blobs;
+	WorkStealingPool workers;
+	FixedTimestep timestep;
 
-	Actor portals[2];
-	portals[0].camera = {{2, 2, 6}};
-	portals[1].camera = {{2, 4, 6}};
-	GLuint portal_textures[2];
-	glGenTextures(2, portal_textures);
-
-	GLuint frame_buffers[2], portal_buffers[2];
-	if (useFrameBuffer) {
-    	glGenFramebuffers(2, frame_buffers);
-    	glGenRenderbuffers(2, portal_buffers);
-	}
-
-	for (int p = 0; p < 2; ++p) {
-		InstallTexture(0, PW, PH, portal_textures[p], GL_RGB, GL_FLOAT, GL_LINEAR,
-					GL_CLAMP_TO_EDGE);
-		
-		if (!useFrameBuffer) continue;
-		glBindFramebuffer(GL_FRAMEBUFFER, frame_buffers[p]);
-        glBindRenderbuffer(GL_RENDERBUFFER, portal_buffers[p]);
-        glRenderbufferStorageEXT(GL_RENDERBUFFER, GL_RGB, PW, PH);
-        glBindRenderbuffer(GL_RENDERBUFFER, 0);
-
-        glFramebufferTexture2DEXT(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-                                  GL_TEXTURE_2D, portal_textures[p], 0);
-        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-                                     GL_RENDERBUFFER, portal_buffers[p]);
-        glCheckFramebufferStatus(GL_FRAMEBUFFER);
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	}
-
-	auto RenderWorld = [&](Actor &exclude_actor) {
+	PortalChain portal_chains[2];
+	for (int p = 0; p < 2 && !PC::Software; ++p)
+		useFrameBuffer = portal_chains[p].Init(PW, PH, useFrameBuffer, PC::Recursion.MaxDepth());
+	for (int p = 0; p < 2 && PC::Software; ++p)
+		for (auto &target : PC::SoftPortals[p]) target.Init(PW, PH);
+
+	auto RenderWorld = [&](Actor &exclude_actor, const Frustum &view) {
 		// Create white spheres representing all lightsources.
 		DisableTexture(GL_TEXTURE0_ARB);
 		DisableTexture(GL_TEXTURE1_ARB);
 		DisableTexture(GL_TEXTURE2_ARB);
-		for (const auto &l : lights) {
-			glTranslated(l.pos.d[0], l.pos.d[1], l.pos.d[2]);
-			GLUquadric *qu = gluNewQuadric();
-			gluSphere(qu, 0.1f, 16, 16);
-			gluDeleteQuadric(qu);
-			glTranslated(-l.pos.d[0], -l.pos.d[1], -l.pos.d[2]);
+		const XYZ<double> none = {{0, 0, 0}};
+		Spheres.Begin(exclude_actor.camera, view);
+		for (const auto &l : Level.lights) {
+			XYZ<double> pos = {{l.pos.d[0], l.pos.d[1], l.pos.d[2]}};
+			Spheres.Add(pos, none, XYZ<double>{{0.1, 0.1, 0.1}}, 1, 1, 1);
 		}
 		if (&exclude_actor != &player) {
 			// For now, this blue sphere represents the player as well.
-			glColor3f(.4, .4, .1);
-			glPushMatrix();
-			glTranslated(player.camera.d[0], player.camera.d[1], player.camera.d[2]);
-			glTranslated(-player.center.d[0], -player.center.d[1],
-						-player.center.d[2]);
-			glScaled(player.fatness.d[0], player.fatness.d[1], player.fatness.d[2]);
-			GLUquadric *qu = gluNewQuadric();
-			gluSphere(qu, 1.0, 16, 16);
-			gluDeleteQuadric(qu);
-			glPopMatrix();
-			glColor3f(1, 1, 1);
-		}
-		for (auto &blob : blobs) {
+			Spheres.Add(player.camera, player.center, player.fatness, .4, .4, .1);
+		}
+		for (size_t n = 0; n < blobs.Size(); ++n) {
 			// Blobs are also blue.
-			glColor3f(1, .2, .1);
-			glPushMatrix();
-			glTranslated(blob.camera.d[0], blob.camera.d[1], blob.camera.d[2]);
-			glTranslated(-blob.center.d[0], -blob.center.d[1], -blob.center.d[2]);
-			glScaled(blob.fatness.d[0], blob.fatness.d[1], blob.fatness.d[2]);
-			GLUquadric *qu = gluNewQuadric();
-			gluSphere(qu, 1.0, 16, 16);
-			gluDeleteQuadric(qu);
-			glPopMatrix();
-			glColor3f(1, 1, 1);
+			Spheres.Add(blobs.Interpolated(n, timestep.Alpha()), blobs.center[n], blobs.fatness[n], 1, .2, .1);
 		}
+		Spheres.Draw();
+		// The portals lie flush with their walls, which WallShading does not
+		// transform exactly as the fixed-function path draws the portals, so
+		// they are pulled a little towards the eye to keep them in front.
+		glPolygonOffset(-1, -4);
+		GL::Enable(GL_POLYGON_OFFSET_FILL);
 		for (int p = 0; p < 2; ++p) {
-			if (&exclude_actor != &portals[p]) {
-				// Render this portal
-				ActivateTexture(GL_TEXTURE0_ARB, portal_textures[p]);
-				XYZ<GLfloat> v = portals[p].dir;
-				glNormal3fv(v.d); // Direction where the portal is facing
-
-				// The four corner points are made by rotating
-				// the portal's "up" vector around its "dir"
-				// at 90 degree steps.
-				Matrix<double> a;
-				glBegin(GL_QUADS);
-				for (unsigned e = 0; e < 4; ++e) {
-					glMultiTexCoord2fARB(GL_TEXTURE0_ARB, 1 * !!((e + 0) & 2),
-										1 * !!((e + 3) & 2));
-					a.InitAxisRotate(portals[p].dir, (e * 90 + 45) * -M_PI / 180.0);
-					v = portals[p].up;
-					a.Transform(v);
-					v *= 0.75;
-					v += portals[p].camera;
-					glVertex3fv(v.d);
-				}
-				glEnd();
+			if (&exclude_actor == &portals[p]) continue;
+			if (portals[p].dir.Squared() > 0 && !PortalInView(portals[p], view)) {
+				++frameStats.cull.portals;
+				continue;
+			}
+			// Render this portal
+			ActivateTexture(GL_TEXTURE0_ARB, portal_chains[p].shown);
+			XYZ<GLfloat> v = portals[p].dir;
+			glNormal3fv(v.d); // Direction where the portal is facing
+
+			XYZ<double> corners[4];
+			PortalCorners(portals[p], corners);
+			GL::Begin(GL_QUADS);
+			for (unsigned e = 0; e < 4; ++e) {
+				glMultiTexCoord2fARB(GL_TEXTURE0_ARB, 1 * !!((e + 0) & 2),
+									1 * !!((e + 3) & 2));
+				v = corners[e];
+				GL::Vertex3fv(v.d);
 			}
+			glEnd();
 		}
+		GL::Disable(GL_POLYGON_OFFSET_FILL);
 
-		ExtractLevelMap();
+		ExtractLevelMap(exclude_actor.camera, view);
 	};
 
+	// The same, drawn with Soft.
+	auto SoftRenderWorld = [&](Actor &exclude_actor, const Frustum &view) {
+		auto Sphere = [&](const XYZ<double> &pos, const XYZ<double> &center, const XYZ<double> &scale,
+						  float r, float g, float b) {
+			if (view.Outside(pos - center, std::max(scale.d[0], std::max(scale.d[1], scale.d[2]))))
+				++frameStats.cull.spheres;
+			else
+				Soft.Sphere(pos, center, scale, r, g, b);
+		};
+		const XYZ<double> none = {{0, 0, 0}};
+		for (const auto &l : Level.lights) {
+			XYZ<double> pos = {{l.pos.d[0], l.pos.d[1], l.pos.d[2]}};
+			Sphere(pos, none, XYZ<double>{{0.1, 0.1, 0.1}}, 1, 1, 1);
+		}
+		if (&exclude_actor != &player) Sphere(player.camera, player.center, player.fatness, .4, .4, .1);
+		for (size_t n = 0; n < blobs.Size(); ++n)
+			Sphere(blobs.Interpolated(n, timestep.Alpha()), blobs.center[n], blobs.fatness[n], 1, .2, .1);
+		for (int p = 0; p < 2; ++p) {
+			if (&exclude_actor == &portals[p]) continue;
+			if (!PortalInView(portals[p], view)) {
+				if (portals[p].dir.Squared() > 0) ++frameStats.cull.portals;
+				continue;
+			}
+			XYZ<double> corners[4];
+			PortalCorners(portals[p], corners);
+			Soft.Portal(corners, PC::SoftPortals[p][PC::SoftShown[p]]);
+		}
+
+		Soft.Walls(VisibleWalls(exclude_actor.camera, view));
+	};
+
+	LevelBVH.Build(Level.walls);
+	WallBoxes.AddWalls(Level.walls);
+	if (!PVS.Open("level.pvs", Level.walls))
+		std::cout << "level.pvs is missing or does not match the map, drawing every wall" << std::endl;
+	if (PC::Software) {
+		if (!Soft.Load(Level.lightmaps))
+			std::cout << Level.lightmaps << "/lightmaps.pak is missing or does not match the level, using .raw files"
+					  << std::endl;
+	} else {
+		Spheres.Init();
+		if (useShaders && WallShading.Init())
+			std::cout << "Shading walls with GLSL " << WallShading.Version() << std::endl;
+		StartLoading(player.camera);
+	}
+#ifdef HEADLESS
+	if (!regress.empty())
+		return Regress(regress, regress_update, player, portals, portal_chains, RenderWorld, workers) ? 0 : 3;
+#endif
+
 	// Main loop
-	while (true) {
-		PC::Update(player, portals, blobs);
-		PC::Render(PW, PH, portals, player, frame_buffers, RenderWorld, portal_textures);
+	Uint64 last = SDL_GetPerformanceCounter();
+	for (bool first = true; ; first = false) {
+		Uint64 now = SDL_GetPerformanceCounter();
+		const double seconds = double(now - last) / SDL_GetPerformanceFrequency();
+		unsigned ticks = timestep.Advance(seconds);
+		PC::Recursion.BeginFrame(seconds);
+		last = now;
+
+		PC::Update(player);
+		while (ticks--) PC::Tick(player, portals, blobs, workers);
+		ContinueLoading(4.0);
+
+		// Render the player between the last two ticks.
+		const Actor::Pose pose = player.Current();
+		player.Place(player.Interpolated(timestep.Alpha()));
+		if (PC::Software)
+			PC::SoftRender(portals, player, SoftRenderWorld, workers);
+		else
+			PC::Render(portals, player, portal_chains, RenderWorld, workers);
+		player.Place(pose);
+		if (first && Loader) Loader->Time("first frame at", Loader->Elapsed());
 	}
 }
\ No newline at end of file
@@ -5,12 +5,14 @@
 
 #pragma once
 
+#include <cstdint> // For uint32_t
+
 #include "math.hpp"
 #include "GL/glew.h"
 
 struct maptype { XYZ<GLfloat> normal, p[4]; };
 
-static const maptype map[] =
+static constexpr maptype map[] =
 {
     {{{ 0, 0, 1}}, {{{ 6, 2,1}},{{ 6, 5,1}},{{ 1, 5,1}},{{ 1, 2,1}}} }, // 0
     {{{ 0, 0, 1}}, {{{ 8, 4,1}},{{ 8, 5,1}},{{ 6, 5,1}},{{ 6, 4,1}}} }, // 1
@@ -127,3 +129,13 @@ static const struct lighttype { XYZ<float> pos, dif; } lights[] =
     { {{  9.5 , 17.5, 7   }}, {{ 200,200,200 }} }, // huge white in the ceiling tunnel
     { {{  9.5 ,  3.9, 1.1 }}, {{.2, .4,  2   }} }  // blue in tunnel
 };
+
+// Where the player starts, turned look_angle degrees around the Y axis and
+// yaw degrees up, and where the portals are until they are first shot.
+enum SpawnKind { spawn_player, spawn_portal };
+static const struct spawntype { XYZ<float> pos; float look_angle, yaw; uint32_t kind; } spawns[] =
+{
+    { {{ 4, 3, 7.25 }}, 170, 10, spawn_player },
+    { {{ 2, 2, 6    }},   0,  0, spawn_portal },
+    { {{ 2, 4, 6    }},   0,  0, spawn_portal }
+};
@@ -4,10 +4,16 @@
 // Standard C++ includes:
 #include <algorithm> // For std::min, std::max
 #include <cmath>     // For std::pow, std::sin, std::cos
+#include <iterator>  // For std::begin, std::end
 #include <iostream>
 #include <list>   // Blobs are stored in a list.
+#include <memory> // For std::unique_ptr
+#include <mutex>  // For std::mutex
+#include <type_traits> // For std::decay
 #include <vector> // For std::vector, in which we store texture & lightmap
 
+#include "profiler.hpp"
+
 template<typename T>
 struct XYZ
 {
@@ -77,12 +83,159 @@ struct Matrix
     }
 };
 
+// The walls of a map as CollideAndSlide sees them: scaled into the space
+// where an ellipsoid of the given radii is a unit sphere, with their edges
+// precomputed, and sorted into a uniform grid by their bounding boxes so
+// that a moving sphere only needs to be tested against the walls near it.
+// F is the map's coordinate type.
+template<typename F>
+class EllipsoidWalls
+{
+public:
+    struct Wall
+    {
+        XYZ<F> normal, p[4];
+        XYZ<F> edge[4];   // p[(e+1)%4] - p[e]
+        F      edgeSq[4]; // edge[e].Squared()
+        F      planeDot;  // normal.Dot(p[0])
+    };
+    std::vector<Wall> walls;
+
+    template<typename M, typename T>
+    EllipsoidWalls(const M& map, const XYZ<T>& eRadius)
+    {
+        XYZ<F> lo, hi;
+        for(const auto& src: map)
+        {
+            Wall w;
+            w.normal = src.normal;
+            for(unsigned a=0; a<4; ++a) { w.p[a] = src.p[a]; w.p[a] /= eRadius; }
+            for(unsigned e=0; e<4; ++e)
+            {
+                w.edge[e]   = w.p[(e+1)%4] - w.p[e];
+                w.edgeSq[e] = w.edge[e].Squared();
+            }
+            w.planeDot = w.normal.Dot(w.p[0]);
+            if(walls.empty()) lo = hi = w.p[0];
+            for(unsigned a=0; a<4; ++a)
+                for(unsigned c=0; c<3; ++c)
+                {
+                    lo.d[c] = std::min(lo.d[c], w.p[a].d[c]);
+                    hi.d[c] = std::max(hi.d[c], w.p[a].d[c]);
+                }
+            walls.push_back(w);
+        }
+
+        // Cells about the size of the sphere, but no more than 64 per axis.
+        origin = lo;
+        cellSize = F(2);
+        for(unsigned c=0; c<3; ++c) cellSize = std::max(cellSize, (hi.d[c] - lo.d[c]) / F(64));
+        for(unsigned c=0; c<3; ++c) dims[c] = unsigned((hi.d[c] - lo.d[c]) / cellSize) + 1;
+        cells.resize(dims[0] * dims[1] * dims[2]);
+        for(unsigned wallno=0; wallno<walls.size(); ++wallno)
+        {
+            const Wall& w = walls[wallno];
+            XYZ<F> wlo = w.p[0], whi = w.p[0];
+            for(unsigned a=1; a<4; ++a)
+                for(unsigned c=0; c<3; ++c)
+                {
+                    wlo.d[c] = std::min(wlo.d[c], w.p[a].d[c]);
+                    whi.d[c] = std::max(whi.d[c], w.p[a].d[c]);
+                }
+            unsigned first[3], last[3];
+            CellRange(wlo, whi, first, last);
+            for(unsigned z=first[2]; z<=last[2]; ++z)
+                for(unsigned y=first[1]; y<=last[1]; ++y)
+                    for(unsigned x=first[0]; x<=last[0]; ++x)
+                        cells[(z * dims[1] + y) * dims[0] + x].push_back(wallno);
+        }
+    }
+
+    // Replaces out with the numbers of the walls whose cells overlap the
+    // box [lo,hi], in increasing order.
+    template<typename T>
+    void Nearby(const XYZ<T>& lo, const XYZ<T>& hi, std::vector<unsigned>& out) const
+    {
+        out.clear();
+        for(unsigned c=0; c<3; ++c)
+            if(hi.d[c] < origin.d[c] || lo.d[c] > origin.d[c] + dims[c] * cellSize) return;
+        unsigned first[3], last[3];
+        CellRange(lo, hi, first, last);
+        for(unsigned z=first[2]; z<=last[2]; ++z)
+            for(unsigned y=first[1]; y<=last[1]; ++y)
+                for(unsigned x=first[0]; x<=last[0]; ++x)
+                {
+                    const auto& cell = cells[(z * dims[1] + y) * dims[0] + x];
+                    out.insert(out.end(), cell.begin(), cell.end());
+                }
+        std::sort(out.begin(), out.end());
+        out.erase(std::unique(out.begin(), out.end()), out.end());
+    }
+
+    // The walls of map for one ellipsoid, built on first use and kept until
+    // Forget(map). This takes a lock and searches every ellipsoid so far, so
+    // whatever collides every tick should keep the result.
+    template<typename M, typename T>
+    static const EllipsoidWalls& For(const M& map, const XYZ<T>& eRadius)
+    {
+        Cache& cache = TheCache();
+        std::lock_guard<std::mutex> guard(cache.lock);
+        const void* key = &*std::begin(map);
+        size_t size = std::end(map) - std::begin(map);
+        for(const auto& e: cache.entries)
+            if(e.map == key && e.size == size && e.eRadius == eRadius) return *e.walls;
+        cache.entries.push_back(Entry{key, size, eRadius, std::unique_ptr<EllipsoidWalls>(new EllipsoidWalls(map, eRadius))});
+        return *cache.entries.back().walls;
+    }
+
+    // Drops what For built from the map starting at first, which is about to
+    // go away; the next map to be put there may be a different one.
+    static void Forget(const void* first)
+    {
+        Cache& cache = TheCache();
+        std::lock_guard<std::mutex> guard(cache.lock);
+        auto& entries = cache.entries;
+        entries.erase(std::remove_if(entries.begin(), entries.end(),
+                                     [first](const Entry& e) { return e.map == first; }),
+                      entries.end());
+    }
+
+private:
+    struct Entry { const void* map; size_t size; XYZ<double> eRadius; std::unique_ptr<EllipsoidWalls> walls; };
+    struct Cache { std::vector<Entry> entries; std::mutex lock; };
+    static Cache& TheCache()
+    {
+        static Cache cache;
+        return cache;
+    }
+
+    XYZ<F>   origin;
+    F        cellSize;
+    unsigned dims[3];
+    std::vector<std::vector<unsigned>> cells; // Wall numbers, in increasing order
+
+    template<typename K>
+    void CellRange(const XYZ<K>& lo, const XYZ<K>& hi, unsigned first[3], unsigned last[3]) const
+    {
+        for(unsigned c=0; c<3; ++c)
+        {
+            K a = (lo.d[c] - origin.d[c]) / cellSize, b = (hi.d[c] - origin.d[c]) / cellSize;
+            first[c] = a < K(0) ? 0 : std::min(unsigned(a), dims[c] - 1);
+            last[c]  = b < K(0) ? 0 : std::min(unsigned(b), dims[c] - 1);
+        }
+    }
+};
+
 // Quadrilateral-spheresweep intersection test, adapted from a paper
 // "Improved Collision detection and Response" by Kasper Fauerby (2003).
 // The original paper handled triangles rather than quadrilaterals.
-template<typename T, typename M>
-bool CollideAndSlide(XYZ<T>& pos, const XYZ<T>& vel, const XYZ<T>& eRadius, const M& map)
+// ewalls must have been built for the same eRadius.
+template<typename T, typename F>
+bool CollideAndSlide(XYZ<T>& pos, const XYZ<T>& vel, const XYZ<T>& eRadius, const EllipsoidWalls<F>& ewalls)
 {
+    PROFILE_SCOPE("CollideAndSlide");
+    static thread_local std::vector<unsigned> nearby;
+
     // Transform all coordinates such that the player can be considered an unit sphere.
     XYZ<T> epos( pos / eRadius ), evel( vel / eRadius );
     // Iterate until we have our final position.
@@ -100,7 +253,7 @@ bool CollideAndSlide(XYZ<T>& pos, const XYZ<T>& vel, const XYZ<T>& eRadius, cons
 
         // This function checks whether an unit-sphere moving from point towards point+dir
         // collides with the given quadrilateral, and determines where the collision happens.
-        auto CheckWall = [&result](const XYZ<T>& point, const XYZ<T>& dir, decltype(*map)& m)
+        auto CheckWall = [&result](const XYZ<T>& point, const XYZ<T>& dir, const typename EllipsoidWalls<F>::Wall& m)
         {
             if (m.normal.Dot(dir) > 0) return; // Reject back-facing triangles
 
@@ -144,7 +297,7 @@ bool CollideAndSlide(XYZ<T>& pos, const XYZ<T>& vel, const XYZ<T>& eRadius, cons
 
             // Get interval of plane intersection:
             T t0, t1;
-            T planeDistance(point.Dot(m.normal) - m.normal.Dot(m.p[0]));
+            T planeDistance(point.Dot(m.normal) - m.planeDot);
             T normalDotVelocity(m.normal.Dot(dir));
             bool embeddedInPlane = normalDotVelocity == T(0); // sphere is travelling parallel to the plane
             if (embeddedInPlane) // if sphere is travelling parallel to the plane
@@ -196,8 +349,8 @@ bool CollideAndSlide(XYZ<T>& pos, const XYZ<T>& vel, const XYZ<T>& eRadius, cons
             }
             for(unsigned e=0; e<4; ++e) // Each edge
             {
-                auto edge(m.p[(e+1)%4] - m.p[e]), BV(m.p[e] - point);
-                T edgeSq = edge.Squared(), edgeDV = edge.Dot(dir), edgeDBV = edge.Dot(BV);
+                const auto& edge(m.edge[e]); auto BV(m.p[e] - point);
+                T edgeSq = m.edgeSq[e], edgeDV = edge.Dot(dir), edgeDBV = edge.Dot(BV);
                 T a( edgeDV * edgeDV - edgeSq * velSq );
                 T b( edgeSq * dir.Dot(BV) - edgeDV * edgeDBV ); b += b;
                 T c( edgeSq - edgeSq * BV.Squared() + edgeDBV * edgeDBV );
@@ -218,12 +371,16 @@ bool CollideAndSlide(XYZ<T>& pos, const XYZ<T>& vel, const XYZ<T>& eRadius, cons
             }
         };
 
-        for(const auto& wall: map) // Check if something blocks the way
+        // Check if something blocks the way. Whatever the unit sphere
+        // touches on the way lies within this box.
+        XYZ<T> lo(epos), hi(epos);
+        for(unsigned c=0; c<3; ++c)
         {
-            auto m(wall);
-            for(unsigned a=0; a<4; ++a) m.p[a] /= eRadius;
-            CheckWall(epos, evel, m);
+            lo.d[c] = std::min(lo.d[c], lo.d[c] + evel.d[c]) - T(1.001);
+            hi.d[c] = std::max(hi.d[c], hi.d[c] + evel.d[c]) + T(1.001);
         }
+        ewalls.Nearby(lo, hi, nearby);
+        for(unsigned wallno: nearby) CheckWall(epos, evel, ewalls.walls[wallno]);
 
         // If no collision, we just move along the velocity
         if(!result.found) { epos += evel; break; }
@@ -249,6 +406,14 @@ bool CollideAndSlide(XYZ<T>& pos, const XYZ<T>& vel, const XYZ<T>& eRadius, cons
     return collided;
 }
 
+// Same, finding the walls of map for eRadius with EllipsoidWalls::For.
+template<typename T, typename M>
+bool CollideAndSlide(XYZ<T>& pos, const XYZ<T>& vel, const XYZ<T>& eRadius, const M& map)
+{
+    typedef typename std::decay<decltype(map[0].p[0].d[0])>::type F;
+    return CollideAndSlide(pos, vel, eRadius, EllipsoidWalls<F>::For(map, eRadius));
+}
+
 
 // Ray-quadrilateral intersection test, adapted from a paper
 // "An Efficient Ray-Quadrilateral Intersection Test"
@@ -264,41 +429,65 @@ struct HitRec {
     HitRec() : wallno(~0u), distance(0), hit() { }
     bool set() const { return wallno != ~0u; }
 };
+// The edge p[B]-p[A] of a wall. Walls that have their edges precomputed
+// (see walldata.hpp) provide an overload returning those instead.
+template<unsigned A, unsigned B, typename Q>
+auto WallEdge(const Q& m) -> decltype(m.p[B] - m.p[A]) { return m.p[B] - m.p[A]; }
+
+// Tests the ray org + dir*t against one quad. On a hit at t >= 0, sets t
+// and the hit's (alpha,beta) coordinates within the quad, and returns true.
+template<typename T, typename K, typename Q>
+bool IntersectQuad(const XYZ<T>& org, const XYZ<K>& dir, const Q& m, T& t, float& alpha_out, float& beta_out) {
+    const T eps = T(1e-9);
+    #define halftest(A,B,C) \
+        auto e##A##B = WallEdge<A,B>(m); \
+        auto e##A##C = WallEdge<A,C>(m); \
+        auto vp      = dir.Cross(e##A##C); \
+        auto det     = e##A##B.Dot(vp); \
+        if(std::abs(det) < eps) return false; \
+        auto vt      = org - m.p[A]; \
+        auto inv_det = 1. / det; \
+        auto alpha   = vt.Dot(vp) * inv_det; \
+        if(alpha < 0.) return false; \
+        auto vq      = vt.Cross(e##A##B); \
+        auto beta    = dir.Dot(vq) * inv_det; \
+        if(beta < 0.) return false
+
+    halftest(0,1,3);
+
+    if ((alpha + beta) > 1.) { halftest(2,3,1); }
+    #undef halftest
+
+    // Compute the ray parameter of the intersection point, and
+    // reject the ray if it does not hit m.
+    t = e03.Dot(vq) * inv_det;
+    if(!(t >= 0.)) return false;
+    alpha_out = alpha;
+    beta_out  = beta;
+    return true;
+}
+
+// Nearest wall hit by the ray, testing every wall. bvh.hpp has a faster
+// version for when the same map is queried many times.
 template<typename T, typename K, typename M>
 HitRec IntersectRay(const XYZ<T>& org, const XYZ<K>& dir, const M& map) {
     HitRec result;
+    T best = T();
 
     unsigned wallno = (unsigned)-1;
     for(const auto& m : map) {
     	++wallno;
 
-        const T eps = T(1e-9);
-        #define halftest(A,B,C) \
-            auto e##A##B = m.p[B] - m.p[A]; \
-            auto e##A##C = m.p[C] - m.p[A]; \
-            auto vp      = dir.Cross(e##A##C); \
-            auto det     = e##A##B.Dot(vp); \
-            if(std::abs(det) < eps) continue; \
-            auto vt      = org - m.p[A]; \
-            auto inv_det = 1. / det; \
-            auto alpha   = vt.Dot(vp) * inv_det; \
-            if(alpha < 0.) continue; \
-            auto vq      = vt.Cross(e##A##B); \
-            auto beta    = dir.Dot(vq) * inv_det; \
-            if(beta < 0.) continue
-
-        halftest(0,1,3);
-
-        if ((alpha + beta) > 1.) { halftest(2,3,1); }
-
-        // Compute the ray parameter of the intersection point, and
-        // reject the ray if it does not hit m. Choose nearest hit.
-        T t = e03.Dot(vq) * inv_det;
-        if(t >= 0. && (!result.set() || t < result.distance)) {
+        // Choose nearest hit. Distances are compared before rounding to
+        // float, so that the choice does not depend on the order of walls.
+        T t;
+        float alpha, beta;
+        if(IntersectQuad(org, dir, m, t, alpha, beta) && (!result.set() || t < best)) {
             result.wallno   = wallno;
             result.distance = t;
             result.alpha    = alpha;
             result.beta     = beta;
+            best = t;
             //result.hit      = m.p[0] + e01*alpha + e03*beta;
         }
     }
@@ -0,0 +1,76 @@
+// How deep portals seen through portals are rendered.
+// Every level of recursion is another pass over the world, so the depth is
+// kept to what frames have time for. The allowed depth comes down a level
+// when frames have lately taken longer than FrameSeconds, and goes back up
+// after a while of them keeping within it; the while grows each time the
+// depth has to come down, so that a depth the frames cannot quite afford
+// is not tried over and over. Within a frame, the passes of a portal are
+// further limited to what is left of the CPU time the portal passes may
+// have, at what a pass has lately cost.
+#pragma once
+
+#include <algorithm> // For std::min, std::max
+#include <chrono>    // For std::chrono::steady_clock
+
+class PortalBudget {
+    public:
+    typedef std::chrono::steady_clock Clock;
+    static constexpr double FrameSeconds = 1.0 / 60; // What a frame may take
+    static constexpr double PortalShare = 0.5;       // Of which the portal passes may spend this
+    static const unsigned MinPatience = 30, MaxPatience = 1920; // Frames before going deeper
+
+    explicit PortalBudget(unsigned max_depth)
+        : max_depth(max_depth), depth(max_depth), fixed(false), patience(MinPatience), calm(0),
+          frame_average(0), pass_average(0) {}
+
+    void SetMaxDepth(unsigned d) { max_depth = depth = std::max(1u, d); }
+    // Keeps every frame at the greatest depth, however long frames take, for
+    // when what is drawn must not depend on the machine (see -regress).
+    void Fix() { depth = max_depth; fixed = true; }
+    unsigned MaxDepth() const { return max_depth; }
+    unsigned Depth() const { return depth; }
+
+    // Starts a frame, given how long the last one took.
+    void BeginFrame(double last_frame_seconds) {
+        frame_start = Clock::now();
+        if (fixed) return;
+        frame_average = frame_average > 0 ? frame_average * 0.9 + last_frame_seconds * 0.1
+                                          : last_frame_seconds;
+        if (frame_average > FrameSeconds * 1.15 && depth > 1) {
+            --depth;
+            patience = std::min(patience * 2, MaxPatience);
+            calm = 0;
+            frame_average = FrameSeconds; // Give the shallower depth a fresh start
+        } else if (frame_average <= FrameSeconds * 1.05 && depth < max_depth && ++calm >= patience) {
+            ++depth;
+            calm = 0;
+        }
+    }
+
+    // How many of wanted levels a portal can have, at least one.
+    unsigned Levels(unsigned wanted) const {
+        unsigned levels = std::min(wanted, depth);
+        if (pass_average > 0 && !fixed) {
+            double left = FrameSeconds * PortalShare - Seconds(frame_start);
+            levels = std::min(levels, unsigned(std::max(0.0, left / pass_average)));
+        }
+        return std::max(1u, levels);
+    }
+
+    void BeginPass() { pass_start = Clock::now(); }
+    void EndPass() {
+        double seconds = Seconds(pass_start);
+        pass_average = pass_average > 0 ? pass_average * 0.9 + seconds * 0.1 : seconds;
+    }
+
+    private:
+    unsigned max_depth, depth;
+    bool fixed;
+    unsigned patience, calm; // Frames to wait before going deeper, and waited
+    double frame_average, pass_average; // Seconds, decaying
+    Clock::time_point frame_start, pass_start;
+
+    static double Seconds(Clock::time_point since) {
+        return std::chrono::duration<double>(Clock::now() - since).count();
+    }
+};
@@ -0,0 +1,139 @@
+// Where the views through the portals are rendered.
+// Each portal is drawn with a texture showing what its counterpart sees.
+// Where framebuffer objects are available and complete, a PortalTarget
+// renders the view straight into that texture, with a depth renderbuffer
+// of its own; otherwise the view is drawn into the corner of the back
+// buffer and copied into the texture from there.
+//
+// With framebuffers, a target has two textures, and renders into the one
+// not being shown: a portal that can be seen in the view it shows is then
+// drawn with the last image, rather than sampling the one being drawn.
+//
+// A PortalChain holds a portal's targets for each level of recursion, each
+// half the size of the one above: level 0 is what the player sees on the
+// portal, level 1 what is seen on the portal within that, and so on.
+#pragma once
+#define GL_SILENCE_DEPRECATION
+
+#include "GL/glew.h"
+
+#include <algorithm> // For std::min, std::max
+#include <cstdio>    // For std::fprintf
+
+#include "glcalls.hpp"
+
+class PortalTarget {
+    public:
+    PortalTarget() : width(0), height(0), front(0), depth(0), framebuffer(false) {
+        fbos[0] = fbos[1] = textures[0] = textures[1] = 0;
+    }
+
+    // Makes the textures, and if use_fbo, the framebuffers. Returns whether
+    // the framebuffers are used, which they are not if incomplete.
+    bool Init(unsigned w, unsigned h, bool use_fbo) {
+        width = w;
+        height = h;
+        use_fbo = use_fbo && (GLEW_ARB_framebuffer_object || GLEW_VERSION_3_0);
+        const unsigned count = use_fbo ? 2 : 1;
+        glGenTextures(count, textures);
+        for (unsigned n = 0; n < count; ++n) {
+            GL::BindTexture(GL_TEXTURE_2D, textures[n]);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            GL::TexImage2D(GL_TEXTURE_2D, 0, GL_RGB, w, h, 0, GL_RGB, GL_FLOAT, NULL);
+        }
+        GL::BindTexture(GL_TEXTURE_2D, 0);
+        if (!use_fbo) return false;
+
+        glGenRenderbuffers(1, &depth);
+        glBindRenderbuffer(GL_RENDERBUFFER, depth);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, w, h);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+        glGenFramebuffers(2, fbos);
+        framebuffer = true;
+        for (unsigned n = 0; n < 2; ++n) {
+            GL::BindFramebuffer(GL_FRAMEBUFFER, fbos[n]);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textures[n], 0);
+            glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+            GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+            if (status != GL_FRAMEBUFFER_COMPLETE) {
+                std::fprintf(stderr, "Portal framebuffer incomplete (0x%04X), copying from the back buffer instead\n",
+                             status);
+                framebuffer = false;
+            }
+        }
+        GL::BindFramebuffer(GL_FRAMEBUFFER, 0);
+        if (!framebuffer) {
+            glDeleteFramebuffers(2, fbos);
+            glDeleteRenderbuffers(1, &depth);
+            glDeleteTextures(1, &textures[1]);
+            fbos[0] = fbos[1] = depth = textures[1] = 0;
+        }
+        return framebuffer;
+    }
+
+    // The texture to draw the portal with.
+    GLuint Texture() const { return textures[front]; }
+    bool UsesFramebuffer() const { return framebuffer; }
+
+    // Directs what is rendered next into the target.
+    void Begin() {
+        if (framebuffer) {
+            GL::BindFramebuffer(GL_FRAMEBUFFER, fbos[front ^ 1]);
+        } else {
+            GL::PushAttrib(GL_COLOR_BUFFER_BIT | GL_PIXEL_MODE_BIT);
+            glDrawBuffer(GL_BACK);
+            glReadBuffer(GL_BACK);
+        }
+        glViewport(0, 0, width, height);
+    }
+
+    // Completes the texture with what was rendered since Begin. The
+    // textures are sampled without mipmaps, so none are made.
+    void End() {
+        if (framebuffer) {
+            GL::BindFramebuffer(GL_FRAMEBUFFER, 0);
+            front ^= 1;
+            return;
+        }
+        GL::ActiveTexture(GL_TEXTURE0_ARB);
+        GL::BindTexture(GL_TEXTURE_2D, textures[front]);
+        glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, width, height);
+        GL::PopAttrib();
+    }
+
+    private:
+    unsigned width, height;
+    unsigned front;   // Of textures, the one shown
+    GLuint fbos[2], textures[2], depth;
+    bool framebuffer; // Whether fbos are used
+};
+
+class PortalChain {
+    public:
+    static const unsigned MaxDepth = 6, MinSize = 8;
+    GLuint shown; // The texture the portal is drawn with at the moment
+
+    PortalChain() : shown(0), depth(0) {}
+
+    // As PortalTarget::Init, for levels 0 to depth - 1 (at most MaxDepth),
+    // level 0 being w by h.
+    bool Init(unsigned w, unsigned h, bool use_fbo, unsigned depth) {
+        this->depth = std::max(1u, std::min(depth, MaxDepth));
+        for (unsigned level = 0; level < this->depth; ++level)
+            use_fbo = levels[level].Init(std::max(MinSize, w >> level), std::max(MinSize, h >> level), use_fbo);
+        shown = levels[0].Texture();
+        return use_fbo;
+    }
+
+    // How many levels Init made targets for.
+    unsigned Depth() const { return depth; }
+    PortalTarget& operator[](unsigned level) { return levels[level]; }
+
+    private:
+    PortalTarget levels[MaxDepth];
+    unsigned depth;
+};
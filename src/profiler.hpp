@@ -0,0 +1,212 @@
+// Frame profiler.
+// PROFILE_SCOPE("name") times the rest of the enclosing block on the CPU.
+// Each thread records its scopes into a ring buffer of its own, without
+// locking; once per frame, Profiler::EndFrame gathers what every thread
+// recorded since, writes it to a Chrome trace (chrome://tracing, Perfetto)
+// if one was opened, and adds up the time of each scope over the frame.
+// Every SummaryInterval frames, the 50th, 95th and 99th percentiles of
+// those per-frame times over the last SummaryInterval frames are printed.
+//
+// The profiler only exists in builds with PROFILE defined ("make profile");
+// otherwise PROFILE_SCOPE expands to nothing and none of this is compiled.
+// See gpuprofiler.hpp for timing GL work.
+#pragma once
+
+#ifdef PROFILE
+
+#include <algorithm> // For std::sort
+#include <atomic>    // For std::atomic
+#include <chrono>    // For std::chrono::steady_clock
+#include <cstdint>   // For int64_t, uint64_t
+#include <cstdio>    // For std::fopen, std::fprintf
+#include <map>       // For std::map, in which we keep the statistics
+#include <memory>    // For std::unique_ptr
+#include <mutex>     // For std::mutex
+#include <utility>   // For std::pair
+#include <vector>    // For std::vector
+
+struct ProfileEvent {
+    const char* name;   // A string literal; scopes are told apart by address
+    int64_t start, end; // Nanoseconds since the profiler started
+    unsigned depth;     // Of nesting within the thread
+};
+
+// The events of one thread, or of one named track such as the GPU's.
+class ProfileLog {
+    public:
+    static const uint64_t Capacity = 1 << 14; // Events; older ones are dropped
+
+    ProfileLog(unsigned id, const char* label) : id(id), label(label), depth(0), head(0), read(0) {}
+
+    void Push(const ProfileEvent& e) {
+        uint64_t h = head.load(std::memory_order_relaxed);
+        events[h % Capacity] = e;
+        head.store(h + 1, std::memory_order_release);
+    }
+
+    const unsigned id;
+    const char* const label; // NULL for threads
+    unsigned depth;          // Scopes open in this thread
+
+    private:
+    friend class Profiler;
+    ProfileEvent events[Capacity];
+    std::atomic<uint64_t> head; // Events ever pushed
+    uint64_t read;              // Events EndFrame has gathered
+};
+
+class Profiler {
+    public:
+    static const unsigned SummaryInterval = 300; // Frames
+
+    static Profiler& Get() {
+        static Profiler p;
+        return p;
+    }
+
+    static int64_t Now() { return Clock() - Get().epoch; }
+
+    // The log of the calling thread.
+    ProfileLog& Local() {
+        thread_local ProfileLog* log = NewLog(NULL);
+        return *log;
+    }
+    // A log for events that are not timed by a thread of ours.
+    ProfileLog& Track(const char* label) { return *NewLog(label); }
+
+    // Starts writing a Chrome trace to path.
+    bool OpenTrace(const char* path) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (trace) std::fclose(trace);
+        trace = std::fopen(path, "w");
+        if (!trace) return false;
+        std::fprintf(trace, "[\n");
+        for (auto& log : logs) Name(*log);
+        return true;
+    }
+
+    void EndFrame() {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto& log : logs) Gather(*log);
+        for (auto& s : stats) {
+            s.second.frames[frame % SummaryInterval] = s.second.total;
+            s.second.calls += s.second.count;
+            s.second.total = 0;
+            s.second.count = 0;
+        }
+        if (++frame % SummaryInterval == 0) Summary();
+    }
+
+    ~Profiler() {
+        EndFrame();
+        if (trace) {
+            // Complete the array, after the trailing comma of the last event.
+            std::fprintf(trace, "{}]\n");
+            std::fclose(trace);
+        }
+    }
+
+    private:
+    struct Stats {
+        int64_t total;   // Nanoseconds in this frame
+        unsigned count;  // Events in this frame
+        uint64_t calls;  // Events in the frames since the last summary
+        int64_t frames[SummaryInterval]; // Totals of recent frames
+        Stats() : total(0), count(0), calls(0), frames() {}
+    };
+    typedef std::pair<const char*, const char*> Key; // Track label, name
+
+    std::mutex lock;
+    std::vector<std::unique_ptr<ProfileLog> > logs;
+    std::map<Key, Stats> stats;
+    FILE* trace;
+    int64_t epoch;
+    unsigned frame;
+    uint64_t dropped;
+
+    Profiler() : trace(NULL), epoch(Clock()), frame(0), dropped(0) {}
+
+    static int64_t Clock() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    ProfileLog* NewLog(const char* label) {
+        std::lock_guard<std::mutex> guard(lock);
+        logs.emplace_back(new ProfileLog(logs.size(), label));
+        if (trace) Name(*logs.back());
+        return logs.back().get();
+    }
+
+    // Names the log's track in the trace.
+    void Name(const ProfileLog& log) {
+        std::fprintf(trace, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"",
+                     log.id);
+        if (log.label) std::fprintf(trace, "%s\"}},\n", log.label);
+        else std::fprintf(trace, "thread %u\"}},\n", log.id);
+    }
+
+    void Gather(ProfileLog& log) {
+        uint64_t head = log.head.load(std::memory_order_acquire);
+        if (head - log.read > ProfileLog::Capacity) {
+            dropped += head - ProfileLog::Capacity - log.read;
+            log.read = head - ProfileLog::Capacity;
+        }
+        for (; log.read < head; ++log.read) {
+            const ProfileEvent& e = log.events[log.read % ProfileLog::Capacity];
+            Stats& s = stats[Key(log.label, e.name)];
+            s.total += e.end - e.start;
+            ++s.count;
+            if (trace)
+                std::fprintf(trace, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                                    "\"ts\":%.3f,\"dur\":%.3f},\n",
+                             e.name, log.id, e.start * 1e-3, (e.end - e.start) * 1e-3);
+        }
+    }
+
+    static double Percentile(std::vector<int64_t>& sorted, double p) {
+        return sorted[std::min(sorted.size() - 1, size_t(p * sorted.size()))] * 1e-6;
+    }
+
+    void Summary() {
+        std::printf("Profile of the last %u frames, in ms per frame:\n", SummaryInterval);
+        std::printf("  %-24s %9s %8s %8s %8s %8s\n", "", "calls", "p50", "p95", "p99", "max");
+        std::vector<int64_t> sorted;
+        for (auto& s : stats) {
+            sorted.assign(s.second.frames, s.second.frames + SummaryInterval);
+            std::sort(sorted.begin(), sorted.end());
+            std::printf("  %-4s %-19s %9.1f %8.3f %8.3f %8.3f %8.3f\n",
+                        s.first.first ? s.first.first : "", s.first.second,
+                        s.second.calls / double(SummaryInterval), Percentile(sorted, 0.5),
+                        Percentile(sorted, 0.95), Percentile(sorted, 0.99), sorted.back() * 1e-6);
+            s.second.calls = 0;
+        }
+        if (dropped) std::printf("  %llu events dropped\n", (unsigned long long)dropped);
+        if (trace) std::fflush(trace);
+    }
+};
+
+class ProfileScope {
+    public:
+    explicit ProfileScope(const char* name)
+        : log(Profiler::Get().Local()), name(name), start(Profiler::Now()) { ++log.depth; }
+    ~ProfileScope() {
+        --log.depth;
+        log.Push(ProfileEvent{ name, start, Profiler::Now(), log.depth });
+    }
+
+    private:
+    ProfileLog& log;
+    const char* name;
+    int64_t start;
+};
+
+#define PROFILE_CONCAT2(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(name)
+
+#else
+
+#define PROFILE_SCOPE(name) ((void)0)
+
+#endif
@@ -0,0 +1,110 @@
+// Potentially visible set of the level.
+// The space around the level is split into a grid of cubic cells, and for
+// each cell, the file made by pvsbuild lists the walls that can be seen
+// from somewhere in it, as a bitset with one bit per wall. Many cells see
+// the same walls, so each different bitset is stored once, and the cells
+// refer to theirs by number. At runtime a view looks up the cell of its
+// camera and only draws the walls whose bits are set.
+//
+// Layout (little-endian):
+//   PvsHeader
+//   uint32_t row[dims[0] * dims[1] * dims[2]], x fastest, then y, then z
+//   uint64_t bits[rows][words]
+#pragma once
+
+#include <cmath>   // For std::floor
+#include <cstdint> // For uint32_t, uint64_t
+#include <cstdio>  // For std::fopen, std::fread
+#include <cstring> // For std::memcmp
+#include <vector>  // For std::vector, in which we keep the sets
+
+#include <iterator> // For std::begin, std::end
+
+#include "map.hpp"
+
+struct PvsHeader {
+    char     magic[4]; // "LPVS"
+    uint32_t version;
+    uint32_t nwalls;
+    uint32_t map_hash;  // PvsMapHash() of the walls it was built for
+    float    origin[3]; // Corner of cell 0,0,0
+    float    cell_size;
+    uint32_t dims[3];   // Cells along x, y and z
+    uint32_t rows;      // Different bitsets
+    uint32_t words;     // uint64_t per bitset
+    uint32_t reserved;
+};
+
+const uint32_t PvsVersion = 1;
+
+// FNV-1a over the normal and corners of every wall, so that a file built
+// for another map is not used. walls may be map, mapData or a level file's.
+template<typename M>
+inline uint32_t PvsMapHash(const M& walls) {
+    uint32_t h = 2166136261u;
+    for (auto w = std::begin(walls); w != std::end(walls); ++w) {
+        static_assert(sizeof(w->normal) + sizeof(w->p) == sizeof(maptype), "a wall is its normal and corners");
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(&w->normal);
+        for (size_t n = 0; n < sizeof(maptype); ++n) h = (h ^ p[n]) * 16777619u;
+    }
+    return h;
+}
+
+class LevelPVS {
+    public:
+    LevelPVS() : loaded(false) {}
+
+    // Reads the file and checks it against walls. Returns false (and
+    // leaves the set empty) if it is missing or does not match.
+    template<typename M>
+    bool Open(const char* path, const M& walls) {
+        const unsigned nwalls = std::end(walls) - std::begin(walls);
+        loaded = false;
+        FILE* f = std::fopen(path, "rb");
+        if (!f) return false;
+        bool ok = std::fread(&header, sizeof(header), 1, f) == 1
+               && !std::memcmp(header.magic, "LPVS", 4) && header.version == PvsVersion
+               && header.nwalls == nwalls && header.map_hash == PvsMapHash(walls)
+               && header.words == (nwalls + 63) / 64 && header.cell_size > 0;
+        if (ok) {
+            rows.resize(size_t(header.dims[0]) * header.dims[1] * header.dims[2]);
+            bits.resize(size_t(header.rows) * header.words);
+            ok = std::fread(rows.data(), sizeof(uint32_t), rows.size(), f) == rows.size()
+              && std::fread(bits.data(), sizeof(uint64_t), bits.size(), f) == bits.size();
+            for (size_t n = 0; ok && n < rows.size(); ++n) ok = rows[n] < header.rows;
+        }
+        std::fclose(f);
+        if (!ok) {
+            rows.clear();
+            bits.clear();
+        }
+        return loaded = ok;
+    }
+
+    bool IsOpen() const { return loaded; }
+
+    // The walls that may be seen from eye, or NULL if the set does not
+    // cover it, in which case every wall should be drawn.
+    template<typename T>
+    const uint64_t* Visible(const XYZ<T>& eye) const {
+        if (!loaded) return NULL;
+        size_t cell = 0, stride = 1;
+        for (unsigned c = 0; c < 3; ++c) {
+            double x = std::floor((eye.d[c] - header.origin[c]) / header.cell_size);
+            if (!(x >= 0 && x < header.dims[c])) return NULL;
+            cell += size_t(x) * stride;
+            stride *= header.dims[c];
+        }
+        return &bits[size_t(rows[cell]) * header.words];
+    }
+
+    static bool Test(const uint64_t* set, unsigned wallno) {
+        return (set[wallno / 64] >> (wallno % 64)) & 1;
+    }
+
+    private:
+    PvsHeader header;
+    std::vector<uint32_t> rows;
+    std::vector<uint64_t> bits;
+    bool loaded;
+};
@@ -0,0 +1,173 @@
+// Builds the potentially visible set of the level (see pvs.hpp).
+// The box around the walls of map.hpp, or of a level file given with
+// -level (see levelfile.hpp), is split into cubic cells. From a
+// grid of points in each cell, rays are cast with IntersectRay at a grid of
+// points on every wall facing that point; the wall is visible from the cell
+// if any of the rays reaches it unblocked. Since only some of the points
+// are tried, a cell's set is then widened with the sets of the cells next
+// to it, so that a wall seen through a narrow gap is not lost at the edge
+// of a cell.
+//
+// Usage: pvsbuild [-level file] [-o file] [-c cellsize] [-s samples] [-t threads]
+#include <algorithm> // For std::min, std::max
+#include <chrono>    // For std::chrono::steady_clock
+#include <cmath>     // For std::ceil, std::floor
+#include <cstdint>   // For uint32_t, uint64_t
+#include <cstdio>    // For std::fopen, std::fwrite
+#include <cstdlib>   // For std::atoi, std::atof
+#include <map>       // For std::map, with which we find repeated sets
+#include <string>    // For std::string
+#include <vector>    // For std::vector, in which we keep the sets
+
+#include "levelfile.hpp"
+#include "math.hpp"
+#include "jobs.hpp"
+#include "bvh.hpp"
+#include "pvs.hpp"
+
+static const LevelFile &Level = LevelFile::Current();
+static unsigned nwalls, words;
+const double WallSpacing = 0.5;    // Between the points aimed at on a wall
+const double SurfaceOffset = 1e-3; // Keeps rays from reaching their own wall
+
+static BVH LevelBVH;
+
+struct PvsSettings {
+	std::string path;
+	double cell_size;
+	unsigned samples; // Points along each side of a cell
+	unsigned threads; // 0 = one per core
+};
+
+// Whether any of the points on the wall can be seen from p.
+static bool WallVisible(const XYZ<double> &p, unsigned wallno) {
+	const WallData &m = Level.walls[wallno];
+	XYZ<double> p0 = m.p[0], n = m.normal;
+	if ((p - p0).Dot(n) <= 0) return false; // Behind it
+	XYZ<double> v10 = XYZ<double>(m.p[1]) - p0, v30 = XYZ<double>(m.p[3]) - p0;
+	unsigned nu = std::max(2u, unsigned(std::ceil(v30.Len() / WallSpacing)) + 1);
+	unsigned nv = std::max(2u, unsigned(std::ceil(v10.Len() / WallSpacing)) + 1);
+	for (unsigned v = 0; v < nv; ++v)
+		for (unsigned u = 0; u < nu; ++u) {
+			// From just inside one edge to just inside the other.
+			double s = 0.001 + 0.998 * u / (nu - 1), t = 0.001 + 0.998 * v / (nv - 1);
+			XYZ<double> target = p0 + v30 * s + v10 * t + n * SurfaceOffset;
+			HitRec r = IntersectRay(p, target - p, Level.walls, LevelBVH);
+			if (!r.set() || r.distance >= 1.0 || r.wallno == wallno) return true;
+		}
+	return false;
+}
+
+static bool ParseArgs(int argc, char **argv, PvsSettings &s) {
+	s.path = "level.pvs";
+	s.cell_size = 1.0;
+	s.samples = 3;
+	s.threads = 0;
+	for (int a = 1; a < argc; ++a) {
+		std::string arg = argv[a];
+		if (a + 1 >= argc) return false;
+		const char *v = argv[++a];
+		if      (arg == "-o") s.path = v;
+		else if (arg == "-level") { if (!LevelFile::Current().Open(v)) return false; }
+		else if (arg == "-c") s.cell_size = std::max(0.05, std::atof(v));
+		else if (arg == "-s") s.samples = std::max(2, std::atoi(v));
+		else if (arg == "-t") s.threads = std::max(0, std::atoi(v));
+		else return false;
+	}
+	return true;
+}
+
+int main(int argc, char **argv) {
+	PvsSettings s;
+	if (!ParseArgs(argc, argv, s)) {
+		std::fprintf(stderr, "Usage: %s [-level file] [-o file] [-c cellsize] [-s samples] [-t threads]\n", argv[0]);
+		return 1;
+	}
+
+	nwalls = Level.walls.size();
+	words = (nwalls + 63) / 64;
+	LevelBVH.Build(Level.walls);
+
+	// The box around every wall, with a cell to spare on each side.
+	double lo[3], hi[3];
+	for (unsigned c = 0; c < 3; ++c) { lo[c] = 1e30; hi[c] = -1e30; }
+	for (const auto &m : Level.walls)
+		for (unsigned c = 0; c < 3; ++c) {
+			lo[c] = std::min(lo[c], double(m.lo.d[c]));
+			hi[c] = std::max(hi[c], double(m.hi.d[c]));
+		}
+	PvsHeader h = {{'L', 'P', 'V', 'S'}, PvsVersion, nwalls, PvsMapHash(Level.walls),
+				   {0, 0, 0}, float(s.cell_size), {0, 0, 0}, 0, words, 0};
+	for (unsigned c = 0; c < 3; ++c) {
+		h.origin[c] = float((std::floor(lo[c] / s.cell_size) - 1) * s.cell_size);
+		h.dims[c] = unsigned(std::ceil((hi[c] - h.origin[c]) / s.cell_size)) + 1;
+	}
+	const size_t cells = size_t(h.dims[0]) * h.dims[1] * h.dims[2];
+
+	WorkStealingPool pool(s.threads);
+	std::printf("%u walls, %u x %u x %u cells of %g, %u^3 points per cell, %u threads\n", nwalls,
+				h.dims[0], h.dims[1], h.dims[2], s.cell_size, s.samples, pool.Threads());
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<uint64_t> seen(cells * words, 0);
+	pool.ParallelFor(0, cells, 4, [&](size_t first, size_t last, unsigned) {
+		for (size_t cell = first; cell < last; ++cell) {
+			size_t index[3] = {cell % h.dims[0], cell / h.dims[0] % h.dims[1], cell / h.dims[0] / h.dims[1]};
+			uint64_t *set = &seen[cell * words];
+			for (unsigned wallno = 0; wallno < nwalls; ++wallno) {
+				bool visible = false;
+				// Points from one face of the cell to the other.
+				for (unsigned k = 0; k < s.samples * s.samples * s.samples && !visible; ++k) {
+					unsigned sub[3] = {k % s.samples, k / s.samples % s.samples, k / s.samples / s.samples};
+					XYZ<double> p;
+					for (unsigned c = 0; c < 3; ++c)
+						p.d[c] = h.origin[c] + (index[c] + double(sub[c]) / (s.samples - 1)) * s.cell_size;
+					visible = WallVisible(p, wallno);
+				}
+				if (visible) set[wallno / 64] |= uint64_t(1) << (wallno % 64);
+			}
+		}
+	});
+
+	// Widen each set with those of the six cells next to it.
+	std::vector<uint64_t> bits(seen);
+	for (size_t cell = 0; cell < cells; ++cell) {
+		size_t index[3] = {cell % h.dims[0], cell / h.dims[0] % h.dims[1], cell / h.dims[0] / h.dims[1]};
+		size_t stride = 1;
+		for (unsigned c = 0; c < 3; ++c) {
+			if (index[c] > 0)
+				for (unsigned w = 0; w < words; ++w) bits[cell * words + w] |= seen[(cell - stride) * words + w];
+			if (index[c] + 1 < h.dims[c])
+				for (unsigned w = 0; w < words; ++w) bits[cell * words + w] |= seen[(cell + stride) * words + w];
+			stride *= h.dims[c];
+		}
+	}
+
+	// Store each different set once.
+	std::map<std::vector<uint64_t>, uint32_t> found;
+	std::vector<uint32_t> rows(cells);
+	std::vector<uint64_t> table;
+	size_t total = 0;
+	for (size_t cell = 0; cell < cells; ++cell) {
+		std::vector<uint64_t> set(bits.begin() + cell * words, bits.begin() + (cell + 1) * words);
+		for (uint64_t w : set) total += __builtin_popcountll(w);
+		auto it = found.insert(std::make_pair(set, uint32_t(found.size()))).first;
+		if (it->second * words == table.size()) table.insert(table.end(), set.begin(), set.end());
+		rows[cell] = it->second;
+	}
+	h.rows = found.size();
+
+	FILE *fp = std::fopen(s.path.c_str(), "wb");
+	if (!fp) { std::perror(s.path.c_str()); return 1; }
+	bool ok = std::fwrite(&h, sizeof(h), 1, fp) == 1
+	       && std::fwrite(rows.data(), sizeof(uint32_t), rows.size(), fp) == rows.size()
+	       && std::fwrite(table.data(), sizeof(uint64_t), table.size(), fp) == table.size();
+	ok = (std::fclose(fp) == 0) && ok;
+	if (!ok) { std::fprintf(stderr, "%s: could not write\n", s.path.c_str()); return 1; }
+
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::printf("Done in %.2f s: %u different sets, %.1f of %u walls visible per cell on average, %zu bytes\n",
+				secs, h.rows, double(total) / cells, nwalls,
+				sizeof(h) + rows.size() * sizeof(uint32_t) + table.size() * sizeof(uint64_t));
+	return 0;
+}
@@ -0,0 +1,402 @@
+// Ray-wall intersection for several walls at once.
+// WallSoA keeps the walls' corners and edges in separate x, y and z arrays
+// (structure of arrays), padded with empty walls to a multiple of eight, so
+// that a kernel can load four (SSE) or eight (AVX2) walls' worth of one
+// coordinate with one instruction and run the half-tests of IntersectRay on
+// all of them together. The kernel is chosen at run time from what the CPU
+// supports; every kernel does the same float operations in the same order,
+// so they all return the same hit.
+//
+// A WallSoA can also hold the walls in the order of a BVH's leaves, each
+// leaf padded to four walls, so that IntersectRay over the BVH tests a
+// whole leaf with one pass of the SSE kernel. The baker casts its rays
+// that way.
+#pragma once
+
+#include <cmath>  // For std::abs
+#include <limits> // For std::numeric_limits
+#include <vector> // For std::vector, in which we store the coordinates
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RAYSIMD_X86 1
+#include <immintrin.h>
+#endif
+
+#include "math.hpp"
+#include "bvh.hpp"
+
+class WallSoA {
+    public:
+    // One array per coordinate of each of these, indexed by slot: the wall
+    // number, unless the walls are in BVH order (see Wall).
+    enum Array {
+        P0x, P0y, P0z, E01x, E01y, E01z, E03x, E03y, E03z, // For halftest(0,1,3)
+        P2x, P2y, P2z, E23x, E23y, E23z, E21x, E21y, E21z, // For halftest(2,3,1)
+        NumArrays
+    };
+    static const unsigned Width = 8;     // Widest kernel, in walls
+    static const unsigned LeafWidth = 4; // Walls per BVH leaf, padded
+
+    // Every wall of map, in order.
+    template<typename M>
+    void Build(const M& map) {
+        Clear();
+        for (const auto& m : map) Push(m, walls);
+        PadTo(Width);
+    }
+
+    // Every wall of map, leaf by leaf in the order of bvh, which must have
+    // been built from the same map.
+    template<typename M>
+    void Build(const M& map, const BVH& bvh) {
+        Clear();
+        leaf_first.assign(bvh.nodes.size(), 0);
+        for (size_t n = 0; n < bvh.nodes.size(); ++n) {
+            const BVHNode& node = bvh.nodes[n];
+            if (node.count == 0) continue;
+            leaf_first[n] = Padded();
+            for (unsigned k = 0; k < node.count; ++k) {
+                uint32_t wallno = bvh.prims[node.index + k];
+                Push(map[wallno], wallno);
+            }
+            PadTo(LeafWidth);
+        }
+        walls = bvh.prims.size();
+    }
+
+    unsigned Walls() const { return walls; }
+    size_t Padded() const { return arrays[0].size(); }
+    const float* operator[](Array a) const { return arrays[a].data(); }
+    unsigned Wall(size_t slot) const { return wallnos[slot]; } // ~0u for padding
+
+    // Slots of the walls of BVH leaf node n, after Build(map, bvh).
+    size_t LeafFirst(size_t n) const { return leaf_first[n]; }
+    size_t LeafLast(size_t n, const BVH& bvh) const {
+        return leaf_first[n] + (bvh.nodes[n].count + LeafWidth - 1) / LeafWidth * LeafWidth;
+    }
+
+    private:
+    std::vector<float> arrays[NumArrays];
+    std::vector<uint32_t> wallnos;    // By slot
+    std::vector<size_t> leaf_first;   // By BVH node
+    unsigned walls;
+
+    void Clear() {
+        walls = 0;
+        for (unsigned a = 0; a < NumArrays; ++a) arrays[a].clear();
+        wallnos.clear();
+        leaf_first.clear();
+    }
+
+    template<typename W>
+    void Push(const W& m, uint32_t wallno) {
+        Push(P0x, m.p[0]);
+        Push(E01x, WallEdge<0,1>(m));
+        Push(E03x, WallEdge<0,3>(m));
+        Push(P2x, m.p[2]);
+        Push(E23x, WallEdge<2,3>(m));
+        Push(E21x, WallEdge<2,1>(m));
+        wallnos.push_back(wallno);
+        ++walls;
+    }
+
+    template<typename V>
+    void Push(Array first, const V& v) {
+        for (unsigned c = 0; c < 3; ++c) arrays[first + c].push_back(v.d[c]);
+    }
+
+    // All-zero walls have a zero determinant, so they never hit.
+    void PadTo(size_t multiple) {
+        size_t padded = (Padded() + multiple - 1) / multiple * multiple;
+        for (unsigned a = 0; a < NumArrays; ++a) arrays[a].resize(padded, 0.f);
+        wallnos.resize(padded, ~0u);
+    }
+};
+
+// Nearest hit found by a kernel; wallno is ~0u if none.
+struct RayKernelHit {
+    unsigned wallno;
+    float t, alpha, beta;
+};
+
+enum RayKernel { RayKernelScalar, RayKernelSSE, RayKernelAVX2, NumRayKernels };
+
+inline const char* RayKernelName(RayKernel k) {
+    static const char* const names[NumRayKernels] = { "scalar", "SSE", "AVX2" };
+    return names[k];
+}
+
+inline bool RayKernelSupported(RayKernel k) {
+#ifdef RAYSIMD_X86
+    __builtin_cpu_init();
+    if (k == RayKernelSSE) return __builtin_cpu_supports("sse2");
+    if (k == RayKernelAVX2) return __builtin_cpu_supports("avx2");
+#endif
+    return k == RayKernelScalar;
+}
+
+// The widest kernel this CPU can run.
+inline RayKernel BestRayKernel() {
+    static const RayKernel best =
+        RayKernelSupported(RayKernelAVX2) ? RayKernelAVX2 :
+        RayKernelSupported(RayKernelSSE)  ? RayKernelSSE  : RayKernelScalar;
+    return best;
+}
+
+// Keeps whichever of two hits is nearer; equal distances go to the lower
+// wall number, as in the scalar IntersectRay.
+inline void NearerHit(RayKernelHit& best, unsigned wallno, float t, float alpha, float beta) {
+    if (best.wallno == ~0u || t < best.t || (t == best.t && wallno < best.wallno))
+        best = RayKernelHit{ wallno, t, alpha, beta };
+}
+
+// The half-tests of IntersectRay, written once for every kernel. Each
+// kernel defines the V* operations for its type V (float, or a vector of
+// floats) and expands this for lanes W at a time. Every lane runs both
+// half-tests, and the rejections of the scalar code become a mask of lanes
+// still in the running. The comparisons are the exact negations of those
+// rejections ("not less than", rather than "at least"), so that NaNs are
+// dropped or kept the same way in every kernel.
+#define RAYSIMD_CROSS(ax,ay,az, bx,by,bz, rx,ry,rz) \
+    V rx = VSUB(VMUL(ay,bz), VMUL(az,by)), \
+      ry = VSUB(VMUL(az,bx), VMUL(ax,bz)), \
+      rz = VSUB(VMUL(ax,by), VMUL(ay,bx))
+#define RAYSIMD_DOT(ax,ay,az, bx,by,bz) VADD(VADD(VMUL(ax,bx), VMUL(ay,by)), VMUL(az,bz))
+#define RAYSIMD_LOAD(a) V a = VLOAD(&w[WallSoA::a][n])
+#define RAYSIMD_KERNEL(W) \
+    const V eps = VSET1(1e-9f), zero = VSET1(0.f), one = VSET1(1.f); \
+    const V dx = VSET1(d[0]), dy = VSET1(d[1]), dz = VSET1(d[2]); \
+    const V ox = VSET1(o[0]), oy = VSET1(o[1]), oz = VSET1(o[2]); \
+    V best_t = VSET1(std::numeric_limits<float>::infinity()), best_a = zero, best_b = zero; \
+    V best_i = VSET1(-1.f), index = VADD(VSET1(static_cast<float>(first)), VLANES); \
+    for (size_t n = first; n < last; n += W, index = VADD(index, VSET1(float(W)))) { \
+        RAYSIMD_LOAD(E01x); RAYSIMD_LOAD(E01y); RAYSIMD_LOAD(E01z); \
+        RAYSIMD_LOAD(E03x); RAYSIMD_LOAD(E03y); RAYSIMD_LOAD(E03z); \
+        RAYSIMD_LOAD(P0x);  RAYSIMD_LOAD(P0y);  RAYSIMD_LOAD(P0z); \
+        RAYSIMD_CROSS(dx,dy,dz, E03x,E03y,E03z, vpx,vpy,vpz); \
+        V det = RAYSIMD_DOT(E01x,E01y,E01z, vpx,vpy,vpz); \
+        V vtx = VSUB(ox, P0x), vty = VSUB(oy, P0y), vtz = VSUB(oz, P0z); \
+        V inv = VDIV(one, det); \
+        V alpha = VMUL(RAYSIMD_DOT(vtx,vty,vtz, vpx,vpy,vpz), inv); \
+        RAYSIMD_CROSS(vtx,vty,vtz, E01x,E01y,E01z, vqx,vqy,vqz); \
+        V beta = VMUL(RAYSIMD_DOT(dx,dy,dz, vqx,vqy,vqz), inv); \
+        V t = VMUL(RAYSIMD_DOT(E03x,E03y,E03z, vqx,vqy,vqz), inv); \
+        V ok = VAND(VAND(VNLT(VABS(det), eps), VNLT(alpha, zero)), \
+                    VAND(VNLT(beta, zero), VGE(t, zero))); \
+        V second = VAND(ok, VGT(VADD(alpha, beta), one)); \
+        if (VANY(second)) { \
+            RAYSIMD_LOAD(E23x); RAYSIMD_LOAD(E23y); RAYSIMD_LOAD(E23z); \
+            RAYSIMD_LOAD(E21x); RAYSIMD_LOAD(E21y); RAYSIMD_LOAD(E21z); \
+            RAYSIMD_LOAD(P2x);  RAYSIMD_LOAD(P2y);  RAYSIMD_LOAD(P2z); \
+            RAYSIMD_CROSS(dx,dy,dz, E21x,E21y,E21z, vp2x,vp2y,vp2z); \
+            V det2 = RAYSIMD_DOT(E23x,E23y,E23z, vp2x,vp2y,vp2z); \
+            V vt2x = VSUB(ox, P2x), vt2y = VSUB(oy, P2y), vt2z = VSUB(oz, P2z); \
+            V inv2 = VDIV(one, det2); \
+            V alpha2 = VMUL(RAYSIMD_DOT(vt2x,vt2y,vt2z, vp2x,vp2y,vp2z), inv2); \
+            RAYSIMD_CROSS(vt2x,vt2y,vt2z, E23x,E23y,E23z, vq2x,vq2y,vq2z); \
+            V beta2 = VMUL(RAYSIMD_DOT(dx,dy,dz, vq2x,vq2y,vq2z), inv2); \
+            V ok2 = VAND(VNLT(VABS(det2), eps), VAND(VNLT(alpha2, zero), VNLT(beta2, zero))); \
+            ok = VANDNOT(VANDNOT(ok2, second), ok); /* Drop lanes that failed it */ \
+        } \
+        V nearer = VAND(ok, VLT(t, best_t)); \
+        best_t = VSEL(nearer, t, best_t); \
+        best_a = VSEL(nearer, alpha, best_a); \
+        best_b = VSEL(nearer, beta, best_b); \
+        best_i = VSEL(nearer, index, best_i); \
+    } \
+    float ts[W], as[W], bs[W], is[W]; \
+    VSTORE(ts, best_t); VSTORE(as, best_a); VSTORE(bs, best_b); VSTORE(is, best_i); \
+    RayKernelHit best = { ~0u, 0, 0, 0 }; \
+    for (unsigned l = 0; l < W; ++l) \
+        if (is[l] >= 0) NearerHit(best, w.Wall(unsigned(is[l])), ts[l], as[l], bs[l]); \
+    return best
+
+// One wall at a time; masks are plain bools.
+inline RayKernelHit RayKernelScalarRun(const WallSoA& w, size_t first, size_t last,
+                                       const float o[3], const float d[3]) {
+    typedef float V;
+    #define VSET1(x)        V(x)
+    #define VLOAD(p)        (*(p))
+    #define VSTORE(p, x)    (*(p) = (x))
+    #define VLANES          V(0)
+    #define VADD(a,b)       ((a) + (b))
+    #define VSUB(a,b)       ((a) - (b))
+    #define VMUL(a,b)       ((a) * (b))
+    #define VDIV(a,b)       ((a) / (b))
+    #define VABS(a)         std::abs(a)
+    #define VNLT(a,b)       V(!((a) < (b)))
+    #define VGE(a,b)        V((a) >= (b))
+    #define VGT(a,b)        V((a) > (b))
+    #define VLT(a,b)        V((a) < (b))
+    #define VAND(a,b)       V((a) != 0 && (b) != 0)
+    #define VANDNOT(a,b)    V((a) == 0 && (b) != 0)
+    #define VSEL(m,a,b)     ((m) != 0 ? (a) : (b))
+    #define VANY(m)         ((m) != 0)
+    RAYSIMD_KERNEL(1);
+    #undef VSET1
+    #undef VLOAD
+    #undef VSTORE
+    #undef VLANES
+    #undef VADD
+    #undef VSUB
+    #undef VMUL
+    #undef VDIV
+    #undef VABS
+    #undef VNLT
+    #undef VGE
+    #undef VGT
+    #undef VLT
+    #undef VAND
+    #undef VANDNOT
+    #undef VSEL
+    #undef VANY
+}
+
+#ifdef RAYSIMD_X86
+__attribute__((target("sse2")))
+inline RayKernelHit RayKernelSSERun(const WallSoA& w, size_t first, size_t last,
+                                    const float o[3], const float d[3]) {
+    typedef __m128 V;
+    #define VSET1(x)        _mm_set1_ps(x)
+    #define VLOAD(p)        _mm_loadu_ps(p)
+    #define VSTORE(p, x)    _mm_storeu_ps(p, x)
+    #define VLANES          _mm_setr_ps(0, 1, 2, 3)
+    #define VADD(a,b)       _mm_add_ps(a, b)
+    #define VSUB(a,b)       _mm_sub_ps(a, b)
+    #define VMUL(a,b)       _mm_mul_ps(a, b)
+    #define VDIV(a,b)       _mm_div_ps(a, b)
+    #define VABS(a)         _mm_andnot_ps(_mm_set1_ps(-0.f), a)
+    #define VNLT(a,b)       _mm_cmpnlt_ps(a, b)
+    #define VGE(a,b)        _mm_cmpge_ps(a, b)
+    #define VGT(a,b)        _mm_cmpgt_ps(a, b)
+    #define VLT(a,b)        _mm_cmplt_ps(a, b)
+    #define VAND(a,b)       _mm_and_ps(a, b)
+    #define VANDNOT(a,b)    _mm_andnot_ps(a, b)
+    #define VSEL(m,a,b)     _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b))
+    #define VANY(m)         (_mm_movemask_ps(m) != 0)
+    RAYSIMD_KERNEL(4);
+    #undef VSET1
+    #undef VLOAD
+    #undef VSTORE
+    #undef VLANES
+    #undef VADD
+    #undef VSUB
+    #undef VMUL
+    #undef VDIV
+    #undef VABS
+    #undef VNLT
+    #undef VGE
+    #undef VGT
+    #undef VLT
+    #undef VAND
+    #undef VANDNOT
+    #undef VSEL
+    #undef VANY
+}
+
+// No "fma" in the target, so that the compiler cannot fuse the multiplies
+// and adds, which would round differently from the other kernels.
+__attribute__((target("avx2")))
+inline RayKernelHit RayKernelAVX2Run(const WallSoA& w, size_t first, size_t last,
+                                     const float o[3], const float d[3]) {
+    typedef __m256 V;
+    #define VSET1(x)        _mm256_set1_ps(x)
+    #define VLOAD(p)        _mm256_loadu_ps(p)
+    #define VSTORE(p, x)    _mm256_storeu_ps(p, x)
+    #define VLANES          _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7)
+    #define VADD(a,b)       _mm256_add_ps(a, b)
+    #define VSUB(a,b)       _mm256_sub_ps(a, b)
+    #define VMUL(a,b)       _mm256_mul_ps(a, b)
+    #define VDIV(a,b)       _mm256_div_ps(a, b)
+    #define VABS(a)         _mm256_andnot_ps(_mm256_set1_ps(-0.f), a)
+    #define VNLT(a,b)       _mm256_cmp_ps(a, b, _CMP_NLT_UQ)
+    #define VGE(a,b)        _mm256_cmp_ps(a, b, _CMP_GE_OQ)
+    #define VGT(a,b)        _mm256_cmp_ps(a, b, _CMP_GT_OQ)
+    #define VLT(a,b)        _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+    #define VAND(a,b)       _mm256_and_ps(a, b)
+    #define VANDNOT(a,b)    _mm256_andnot_ps(a, b)
+    #define VSEL(m,a,b)     _mm256_blendv_ps(b, a, m)
+    #define VANY(m)         (_mm256_movemask_ps(m) != 0)
+    RAYSIMD_KERNEL(8);
+    #undef VSET1
+    #undef VLOAD
+    #undef VSTORE
+    #undef VLANES
+    #undef VADD
+    #undef VSUB
+    #undef VMUL
+    #undef VDIV
+    #undef VABS
+    #undef VNLT
+    #undef VGE
+    #undef VGT
+    #undef VLT
+    #undef VAND
+    #undef VANDNOT
+    #undef VSEL
+    #undef VANY
+}
+#endif
+
+#undef RAYSIMD_CROSS
+#undef RAYSIMD_DOT
+#undef RAYSIMD_LOAD
+#undef RAYSIMD_KERNEL
+
+// The kernel for BVH leaves, of up to four walls: AVX2 would leave half of
+// its lanes empty.
+inline RayKernel LeafRayKernel() {
+    static const RayKernel leaf = RayKernelSupported(RayKernelSSE) ? RayKernelSSE : RayKernelScalar;
+    return leaf;
+}
+
+// Runs kernel over the slots [first, last) of walls, a multiple of its width.
+inline RayKernelHit RunRayKernel(RayKernel kernel, const WallSoA& walls, size_t first, size_t last,
+                                 const float o[3], const float d[3]) {
+    switch (kernel) {
+#ifdef RAYSIMD_X86
+        case RayKernelAVX2: return RayKernelAVX2Run(walls, first, last, o, d);
+        case RayKernelSSE:  return RayKernelSSERun(walls, first, last, o, d);
+#endif
+        default:            return RayKernelScalarRun(walls, first, last, o, d);
+    }
+}
+
+// Same as IntersectRay(org, dir, map), but in float precision, testing the
+// walls of a WallSoA built from the map with the given kernel.
+template<typename T, typename K>
+HitRec IntersectRay(const XYZ<T>& org, const XYZ<K>& dir, const WallSoA& walls,
+                    RayKernel kernel = BestRayKernel()) {
+    const float o[3] = { float(org.d[0]), float(org.d[1]), float(org.d[2]) };
+    const float d[3] = { float(dir.d[0]), float(dir.d[1]), float(dir.d[2]) };
+    RayKernelHit h = RunRayKernel(kernel, walls, 0, walls.Padded(), o, d);
+    HitRec result;
+    if (h.wallno == ~0u) return result;
+    result.wallno   = h.wallno;
+    result.distance = h.t;
+    result.alpha    = h.alpha;
+    result.beta     = h.beta;
+    result.hit      = org + dir * result.distance;
+    return result;
+}
+
+// Same as IntersectRay(org, dir, map, bvh), but testing each leaf's walls
+// together in float precision, from a WallSoA built from the map and bvh.
+template<typename T, typename K>
+HitRec IntersectRay(const XYZ<T>& org, const XYZ<K>& dir, const BVH& bvh, const WallSoA& leaves) {
+    const RayKernel kernel = LeafRayKernel();
+    const float o[3] = { float(org.d[0]), float(org.d[1]), float(org.d[2]) };
+    const float d[3] = { float(dir.d[0]), float(dir.d[1]), float(dir.d[2]) };
+    return TraceBVH(org, dir, bvh, [&](uint32_t index, HitRec& result, T& best) {
+        RayKernelHit h = RunRayKernel(kernel, leaves, leaves.LeafFirst(index), leaves.LeafLast(index, bvh), o, d);
+        if (h.wallno == ~0u) return;
+        // Equal distances go to the lower wall number, as in the linear scan.
+        if (!result.set() || h.t < best || (h.t == best && h.wallno < result.wallno)) {
+            result.wallno   = h.wallno;
+            result.distance = h.t;
+            result.alpha    = h.alpha;
+            result.beta     = h.beta;
+            best = h.t;
+        }
+    });
+}
@@ -0,0 +1,189 @@
+// Rendering regression checks, for "demo -regress" (see main.cpp).
+// A fixed set of poses of the player and the portals is rendered offscreen,
+// each compared with a reference image stored for it, and timed. A pose
+// passes when few enough pixels differ by more than PixelTolerance in any
+// channel, which leaves room for the small differences between drivers and
+// between drawing orders of the same walls. The frame times and what was
+// submitted to OpenGL are written to a JSON report, one pose per line, for
+// scripts to compare against earlier runs.
+//
+// The median frame time of each pose is also checked against a baseline
+// stored with the reference images, from the renderer named in it: a pose
+// is too slow, and fails, when it takes SlowFactor times as long as its
+// baseline and at least SlowMargin ms more. Baselines from another
+// renderer say nothing about this one, so against those the times are
+// only reported.
+#pragma once
+
+#include <algorithm> // For std::sort, std::max
+#include <cstdint>   // For uint8_t
+#include <cstdio>    // For std::fopen, std::fprintf
+#include <cstdlib>   // For std::abs
+#include <cstring>   // For std::strcspn
+#include <string>    // For std::string
+#include <vector>    // For std::vector, in which we keep images and times
+
+#include "math.hpp"
+#include "debug.hpp"
+
+struct RegressPose {
+    const char* name;
+    XYZ<double> camera;      // Where the player stands
+    double look_angle, yaw;  // And looks, as in BlobActor
+    // Where the portals are shot from there, as look_angle and yaw; both
+    // zero leaves a portal where InitGame puts it, unplaced.
+    double portals[2][2];
+};
+
+// The starting place, the lit rooms in the middle of the level looking
+// every way, and three pairs of portals: side by side, around a corner,
+// and facing each other across the room, to show each other over and over.
+static const RegressPose RegressPoses[] = {
+    { "start",      {{ 4, 3, 7.25 }}, 170,  10, {{ 0, 0 }, { 0, 0 }} },
+    { "hall",       {{ 4, 3, 7.25 }},  80,   0, {{ 0, 0 }, { 0, 0 }} },
+    { "up",         {{ 4, 3, 7.25 }}, 260, -40, {{ 0, 0 }, { 0, 0 }} },
+    { "lights-0",   {{ 12, 3, 4 }},     0,   0, {{ 0, 0 }, { 0, 0 }} },
+    { "lights-90",  {{ 12, 3, 4 }},    90,   0, {{ 0, 0 }, { 0, 0 }} },
+    { "lights-180", {{ 12, 3, 4 }},   180,   0, {{ 0, 0 }, { 0, 0 }} },
+    { "lights-270", {{ 12, 3, 4 }},   270,   0, {{ 0, 0 }, { 0, 0 }} },
+    { "portals",    {{ 4, 3, 7.25 }}, 200,   0, {{ 185, -5 }, { 215, -5 }} },
+    { "through",    {{ 4, 3, 7.25 }}, 170,   0, {{ 160, 0 }, { 180, 0 }} },
+    { "facing",     {{ 9.5, 3, 4.5 }}, 270,  0, {{  90, 0 }, { 270, 0 }} },
+};
+
+// An 8-bit RGB image, rows top-down, as in a binary PPM.
+struct RegressImage {
+    unsigned w, h;
+    std::vector<uint8_t> rgb;
+
+    RegressImage() : w(0), h(0) {}
+
+    bool Read(const std::string& path) {
+        FILE* fp = std::fopen(path.c_str(), "rb");
+        if (!fp) return false;
+        unsigned maxval = 0;
+        bool ok = std::fscanf(fp, "P6 %u %u %u", &w, &h, &maxval) == 3 && maxval == 255 && std::fgetc(fp) != EOF;
+        if (ok) {
+            rgb.resize(size_t(w) * h * 3);
+            ok = std::fread(rgb.data(), 1, rgb.size(), fp) == rgb.size();
+        }
+        std::fclose(fp);
+        return ok;
+    }
+
+    bool Write(const std::string& path) const {
+        FILE* fp = std::fopen(path.c_str(), "wb");
+        if (!fp) return false;
+        std::fprintf(fp, "P6 %u %u 255\n", w, h);
+        bool ok = std::fwrite(rgb.data(), 1, rgb.size(), fp) == rgb.size();
+        return (std::fclose(fp) == 0) && ok;
+    }
+};
+
+struct RegressResult {
+    static const int PixelTolerance = 24;        // Per channel, out of 255
+    static constexpr double BadFraction = 0.002; // Of the pixels, that may differ by more
+    static constexpr double SlowFactor = 1.5, SlowMargin = 1.0; // See the top of the file
+
+    bool reference;         // Whether there was a reference image of the same size
+    unsigned max_diff;      // Largest difference in any channel
+    size_t pixels, bad_pixels; // Compared, and differing by more than PixelTolerance
+    std::vector<double> ms; // Time of each timed frame
+    double baseline_ms;     // Median in the baseline, or 0 if there is none
+    bool timed_against;     // Whether the baseline is from this renderer
+    GLCounts gl;            // Submitted in the last frame
+    CullCounts cull;        // Left out in the last frame
+
+    RegressResult() : reference(false), max_diff(0), pixels(0), bad_pixels(0), baseline_ms(0), timed_against(false) {}
+
+    void Compare(const RegressImage& got, const RegressImage& want) {
+        reference = got.w == want.w && got.h == want.h && got.rgb.size() == want.rgb.size();
+        pixels = reference ? size_t(got.w) * got.h : 0;
+        max_diff = 0;
+        bad_pixels = 0;
+        for (size_t p = 0; p < pixels * 3; p += 3) {
+            int diff = 0;
+            for (unsigned c = 0; c < 3; ++c) diff = std::max(diff, std::abs(int(got.rgb[p + c]) - int(want.rgb[p + c])));
+            max_diff = std::max(max_diff, unsigned(diff));
+            bad_pixels += diff > PixelTolerance;
+        }
+    }
+    bool Matches() const { return reference && bad_pixels <= BadFraction * pixels; }
+    bool Passed() const { return Matches() && !Slow(); }
+    bool Slow() const {
+        double median = Percentile(0.5);
+        return timed_against && baseline_ms > 0 && median > baseline_ms * SlowFactor && median > baseline_ms + SlowMargin;
+    }
+
+    // The frame time that fraction of the frames kept within.
+    double Percentile(double fraction) const {
+        if (ms.empty()) return 0;
+        std::vector<double> sorted(ms);
+        std::sort(sorted.begin(), sorted.end());
+        return sorted[std::min(sorted.size() - 1, size_t(fraction * sorted.size()))];
+    }
+};
+
+// Reads the baseline at path into results, results[n] being of
+// RegressPoses[n], marking them as timed against it if it is from renderer.
+// Returns false if there is no baseline.
+inline bool ReadRegressBaseline(const std::string& path, const char* renderer, std::vector<RegressResult>& results) {
+    FILE* fp = std::fopen(path.c_str(), "r");
+    if (!fp) return false;
+    char line[256];
+    bool same = std::fgets(line, sizeof(line), fp) != NULL
+             && std::string(line, std::strcspn(line, "\n")) == renderer;
+    char name[64];
+    double ms;
+    while (std::fscanf(fp, "%63s %lf", name, &ms) == 2)
+        for (size_t n = 0; n < results.size(); ++n)
+            if (name == std::string(RegressPoses[n].name)) {
+                results[n].baseline_ms = ms;
+                results[n].timed_against = same;
+            }
+    std::fclose(fp);
+    return true;
+}
+
+// Writes results as the baseline at path: the renderer on the first line,
+// then the name and median frame time of each pose.
+inline bool WriteRegressBaseline(const std::string& path, const char* renderer,
+                                 const std::vector<RegressResult>& results) {
+    FILE* fp = std::fopen(path.c_str(), "w");
+    if (!fp) return false;
+    std::fprintf(fp, "%s\n", renderer);
+    for (size_t n = 0; n < results.size(); ++n)
+        std::fprintf(fp, "%s %.3f\n", RegressPoses[n].name, results[n].Percentile(0.5));
+    return std::fclose(fp) == 0;
+}
+
+// Writes the report of a run at w*h on renderer, results[n] being of
+// RegressPoses[n].
+inline bool WriteRegressReport(const std::string& path, unsigned w, unsigned h, const char* renderer,
+                               const std::vector<RegressResult>& results) {
+    FILE* fp = std::fopen(path.c_str(), "w");
+    if (!fp) return false;
+    std::string escaped;
+    for (const char* c = renderer; *c; ++c) {
+        if (*c == '"' || *c == '\\') escaped += '\\';
+        escaped += *c;
+    }
+    std::fprintf(fp, "{\"width\": %u, \"height\": %u, \"renderer\": \"%s\", \"poses\": [\n", w, h, escaped.c_str());
+    for (size_t n = 0; n < results.size(); ++n) {
+        const RegressResult& r = results[n];
+        double mean = 0;
+        for (double t : r.ms) mean += t / r.ms.size();
+        std::fprintf(fp, "  {\"name\": \"%s\", \"passed\": %s, \"max_diff\": %u, \"bad_pixels\": %zu, "
+                     "\"frames\": %zu, \"ms_mean\": %.3f, \"ms_median\": %.3f, \"ms_p90\": %.3f, "
+                     "\"ms_baseline\": %.3f, \"slow\": %s, "
+                     "\"draw_calls\": %u, \"vertices\": %u, \"texture_binds\": %u, \"state_changes\": %u, "
+                     "\"culled_walls\": %u}%s\n",
+                     RegressPoses[n].name, r.Passed() ? "true" : "false", r.max_diff, r.bad_pixels,
+                     r.ms.size(), mean, r.Percentile(0.5), r.Percentile(0.9),
+                     r.baseline_ms, r.Slow() ? "true" : "false",
+                     r.gl.draw_calls, r.gl.vertices, r.gl.texture_binds, r.gl.state_changes,
+                     r.cull.pvs_walls + r.cull.frustum_walls, n + 1 < results.size() ? "," : "");
+    }
+    std::fprintf(fp, "]}\n");
+    return std::fclose(fp) == 0;
+}
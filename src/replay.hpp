@@ -0,0 +1,137 @@
+// Input recording and replay.
+// A recording holds the TickInput of every tick of a session, and a hash of
+// the state of the game after it, so that the same session can be run again,
+// windowed or headless, and any tick where the replay ends up somewhere else
+// than the recording did is reported.
+//
+// Layout (host byte order, which is little-endian on x86 and ARM; a
+// recording of the other byte order is refused rather than converted):
+//   ReplayHeader
+//   per tick:
+//     uint8_t flags: TickInput::keys in bits 0-5, ReplayHasAim, ReplayHasShots
+//     int16_t aim_x, aim_y                      if ReplayHasAim
+//     uint8_t count, count * (uint8_t portal,
+//                             double org[3], double dir[3])  if ReplayHasShots
+//     uint32_t state hash
+#pragma once
+
+#include <cstdint> // For uint8_t, int16_t, uint32_t
+#include <cstdio>  // For std::fopen, std::fread, std::fwrite
+#include <cstring> // For std::memcmp
+
+#include "tick.hpp"
+#include "timestep.hpp"
+
+struct ReplayHeader {
+    char     magic[4]; // "RPLY"
+    uint32_t version;
+    uint32_t ticks_per_second;
+    uint32_t byte_order; // ReplayByteOrder, as the recorder saw it
+};
+
+const uint32_t ReplayVersion = 2;
+const uint32_t ReplayByteOrder = 0x01020304;
+const uint8_t ReplayKeyMask = 0x3F, ReplayHasAim = 0x40, ReplayHasShots = 0x80;
+
+class InputRecorder {
+    public:
+    InputRecorder() : file(NULL) {}
+    ~InputRecorder() { Close(); }
+
+    bool Open(const char* path) {
+        Close();
+        file = std::fopen(path, "wb");
+        if (!file) return false;
+        ReplayHeader h = { {'R', 'P', 'L', 'Y'}, ReplayVersion, uint32_t(FixedTimestep::TicksPerSecond),
+                           ReplayByteOrder };
+        return std::fwrite(&h, sizeof(h), 1, file) == 1;
+    }
+    bool IsOpen() const { return file != NULL; }
+    void Close() {
+        if (file) std::fclose(file);
+        file = NULL;
+    }
+
+    void Write(const TickInput& in, uint32_t hash) {
+        if (!file) return;
+        uint8_t flags = in.keys & ReplayKeyMask;
+        if (in.aim_x || in.aim_y) flags |= ReplayHasAim;
+        if (!in.shots.empty()) flags |= ReplayHasShots;
+        Put(flags);
+        if (flags & ReplayHasAim) { Put(in.aim_x); Put(in.aim_y); }
+        if (flags & ReplayHasShots) {
+            Put(uint8_t(in.shots.size()));
+            for (const PortalShot& s : in.shots) { Put(s.portal); Put(s.org.d); Put(s.dir.d); }
+        }
+        Put(hash);
+    }
+
+    private:
+    FILE* file;
+    template<typename T>
+    void Put(const T& v) { std::fwrite(&v, sizeof(v), 1, file); }
+};
+
+class InputReplayer {
+    public:
+    InputReplayer() : file(NULL), ticks(0), diverged(0), first_divergence(0) {}
+    ~InputReplayer() { Close(); }
+
+    // Returns false (and leaves the replayer closed) if the file is not a
+    // recording this version of the game can replay.
+    bool Open(const char* path) {
+        Close();
+        file = std::fopen(path, "rb");
+        if (!file) return false;
+        ReplayHeader h;
+        if (!Get(h) || std::memcmp(h.magic, "RPLY", 4) || h.version != ReplayVersion
+            || h.byte_order != ReplayByteOrder
+            || h.ticks_per_second != uint32_t(FixedTimestep::TicksPerSecond)) {
+            std::fprintf(stderr, "%s: not a replay of this version\n", path);
+            Close();
+            return false;
+        }
+        return true;
+    }
+    bool IsOpen() const { return file != NULL; }
+    void Close() {
+        if (file) std::fclose(file);
+        file = NULL;
+    }
+
+    // Reads the next tick's input and the hash recorded after it. Returns
+    // false at the end of the recording.
+    bool Next(TickInput& in, uint32_t& hash) {
+        in.Clear();
+        uint8_t flags;
+        if (!file || !Get(flags)) return false;
+        in.keys = flags & ReplayKeyMask;
+        if ((flags & ReplayHasAim) && !(Get(in.aim_x) && Get(in.aim_y))) return false;
+        if (flags & ReplayHasShots) {
+            uint8_t count;
+            if (!Get(count)) return false;
+            in.shots.resize(count);
+            for (PortalShot& s : in.shots)
+                if (!(Get(s.portal) && Get(s.org.d) && Get(s.dir.d)) || s.portal > 1) return false;
+        }
+        return Get(hash);
+    }
+
+    // Compares the state after a replayed tick with the recorded hash.
+    bool Check(uint32_t recorded, uint32_t actual) {
+        ++ticks;
+        if (recorded == actual) return true;
+        if (!diverged++) first_divergence = ticks;
+        return false;
+    }
+
+    unsigned Ticks() const { return ticks; }
+    unsigned Diverged() const { return diverged; }
+    unsigned FirstDivergence() const { return first_divergence; } // Counting from 1
+
+    private:
+    FILE* file;
+    unsigned ticks, diverged, first_divergence;
+    template<typename T>
+    bool Get(T& v) { return std::fread(&v, sizeof(v), 1, file) == 1; }
+};
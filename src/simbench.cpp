@@ -0,0 +1,225 @@
+// Headless simulation benchmark.
+// Runs the game's simulation without a window or GL context: a number of
+// player-like BlobActors walk, turn, jump and fire portal rays around the
+// level in map.hpp under a scripted, repeatable sequence of movement
+// signals, while a pool of blobs thrown from the start position bounces
+// about. Reports ticks per second, the time spent in each phase of a tick,
+// and a checksum of the final state, which is the same for every run and
+// thread count with the same settings, so that it can be compared between
+// builds.
+//
+// With -r, runs a session recorded by the demo's -record option instead,
+// and reports any tick where the state differs from the recording.
+//
+// Usage: simbench [-n ticks] [-p players] [-b blobs] [-t threads] [-r replay]
+#include <chrono>  // For std::chrono::steady_clock
+#include <cstdint> // For uint32_t, uint64_t
+#include <cstdio>  // For std::printf
+#include <cstdlib> // For std::atoi
+#include <string>  // For std::string
+#include <vector>  // For std::vector, in which we store the actors
+
+#include "walldata.hpp"
+#include "actor.hpp"
+#include "blobs.hpp"
+#include "bvh.hpp"
+#include "jobs.hpp"
+#include "tick.hpp"
+#include "replay.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+static double Seconds(Clock::time_point since) {
+	return std::chrono::duration<double>(Clock::now() - since).count();
+}
+
+struct SimSettings {
+	unsigned ticks, players, blobs, threads;
+	std::string replay;
+};
+
+// Deterministic random numbers, one sequence per player.
+static unsigned Random(uint32_t &seed, unsigned range) {
+	seed = seed * 1664525u + 1013904223u;
+	return (seed >> 8) % range;
+}
+
+// What a scripted player does: walks in one direction for a while, then
+// another or stands still, turning at its own rate and jumping now and then.
+struct Script {
+	uint32_t seed;
+	int move_angle; // Or NoMove
+	int turn;       // Degrees per tick
+	enum { NoMove = 1000, StepTicks = 30, RayTicks = 10 };
+
+	void Signal(BlobActor &actor, unsigned tick) {
+		if (tick % StepTicks == 0) {
+			static const int angles[5] = { 0, 90, 180, -90, NoMove };
+			move_angle = angles[Random(seed, 5)];
+		}
+		if (move_angle != NoMove) actor.MovementSignal(BlobActor::sig_push, move_angle);
+		actor.MovementSignal(BlobActor::sig_aim, turn, 0);
+		if (Random(seed, 60) == 0) actor.MovementSignal(BlobActor::sig_jump);
+	}
+};
+
+// FNV-1a, over the bytes of the state.
+struct Checksum {
+	uint64_t h = 14695981039346656037ull;
+	template<typename T>
+	void Add(const T &v) {
+		const unsigned char *p = reinterpret_cast<const unsigned char*>(&v);
+		for (size_t n = 0; n < sizeof(v); ++n) h = (h ^ p[n]) * 1099511628211ull;
+	}
+};
+
+static bool ParseArgs(int argc, char **argv, SimSettings &s) {
+	s.ticks = 3600;
+	s.players = 64;
+	s.blobs = 1000;
+	s.threads = 0;
+	for (int a = 1; a < argc; ++a) {
+		std::string arg = argv[a];
+		if (a + 1 >= argc) return false;
+		const char *v = argv[++a];
+		if      (arg == "-n") s.ticks = std::max(1, std::atoi(v));
+		else if (arg == "-p") s.players = std::max(0, std::atoi(v));
+		else if (arg == "-b") s.blobs = std::max(0, std::atoi(v));
+		else if (arg == "-t") s.threads = std::max(0, std::atoi(v));
+		else if (arg == "-r") s.replay = v;
+		else return false;
+	}
+	return true;
+}
+
+// Runs a recorded session as the demo would, tick by tick.
+static int Replay(const char *path, const BVH &bvh, WorkStealingPool &pool) {
+	InputReplayer replayer;
+	if (!replayer.Open(path)) return 1;
+	BlobActor player;
+	Actor portals[2];
+	InitGame(player, portals);
+	BlobPool blobs;
+
+	TickInput in;
+	uint32_t recorded;
+	double run = 0, hash = 0;
+	while (replayer.Next(in, recorded)) {
+		Clock::time_point t0 = Clock::now();
+		RunTick(in, player, portals, blobs, pool, bvh);
+		Clock::time_point t1 = Clock::now();
+		if (!replayer.Check(recorded, StateHash::Of(player, portals, blobs)) && replayer.Diverged() == 1)
+			std::printf("diverged from the recording at tick %u\n", replayer.FirstDivergence());
+		hash += Seconds(t1);
+		run += std::chrono::duration<double>(t1 - t0).count();
+	}
+	std::printf("replayed %u ticks, %.0f ticks/s, %.3f ms per tick (%.3f ms hashing), %zu blobs, %u diverged\n",
+				replayer.Ticks(), replayer.Ticks() / run, run * 1e3 / std::max(1u, replayer.Ticks()),
+				hash * 1e3 / std::max(1u, replayer.Ticks()), blobs.Size(), replayer.Diverged());
+	return replayer.Diverged() ? 2 : 0;
+}
+
+int main(int argc, char **argv) {
+	SimSettings s;
+	if (!ParseArgs(argc, argv, s)) {
+		std::fprintf(stderr, "Usage: %s [-n ticks] [-p players] [-b blobs] [-t threads] [-r replay]\n", argv[0]);
+		return 1;
+	}
+
+	Clock::time_point t0 = Clock::now();
+	BVH LevelBVH;
+	LevelBVH.Build(mapData);
+	WorkStealingPool pool(s.threads);
+	if (!s.replay.empty()) return Replay(s.replay.c_str(), LevelBVH, pool);
+	std::printf("%u ticks, %u players, %u blobs, %u threads; BVH built in %.2f ms\n",
+				s.ticks, s.players, s.blobs, pool.Threads(), Seconds(t0) * 1e3);
+
+	// Everyone starts where the player of the demo does.
+	const XYZ<double> start = {{4, 3, 7.25}};
+	std::vector<BlobActor> players(s.players);
+	std::vector<Script> scripts(s.players);
+	for (unsigned p = 0; p < s.players; ++p) {
+		BlobActor &a = players[p];
+		a.fatness = {{0.2, 0.6, 0.2}};
+		a.center = {{0, 0.3, 0}};
+		a.camera = start;
+		a.look_angle = p * 360.0 / s.players;
+		a.yaw = 0;
+		a.Orient();
+		scripts[p].seed = p + 1;
+		scripts[p].move_angle = Script::NoMove;
+		scripts[p].turn = int(p % 7) - 3;
+	}
+
+	// Blobs are thrown in every direction, as with the B key.
+	BlobPool blobs;
+	std::vector<BlobHandle> handles;
+	uint32_t seed = 12345;
+	for (unsigned b = 0; b < s.blobs; ++b) {
+		XYZ<double> dir;
+		do {
+			for (unsigned c = 0; c < 3; ++c) dir.d[c] = Random(seed, 2001) / 1000.0 - 1;
+		} while (dir.Squared() < 1e-2 || dir.Squared() > 1);
+		dir = dir.Normalized();
+		handles.push_back(blobs.Spawn(start + dir * 0.2, dir * 0.2, XYZ<double>{{0.45, 0.45, 0.45}}));
+	}
+
+	// Phases of a tick, as in RunTick, with portal rays fired now and then.
+	enum { Signals, Players, Blobs, Rays, NumPhases };
+	static const char *const names[NumPhases] = { "signals", "players", "blobs", "rays" };
+	double phase[NumPhases] = { 0, 0, 0, 0 };
+	std::vector<int> hits(s.players, -1);
+	size_t awake = 0, rays = 0;
+
+	Clock::time_point start_time = Clock::now();
+	for (unsigned tick = 0; tick < s.ticks; ++tick) {
+		t0 = Clock::now();
+		for (unsigned p = 0; p < s.players; ++p) {
+			players[p].BeginTick();
+			scripts[p].Signal(players[p], tick);
+		}
+		Clock::time_point t1 = Clock::now();
+		phase[Signals] += std::chrono::duration<double>(t1 - t0).count();
+
+		pool.ParallelFor(0, s.players, 4, [&players](size_t first, size_t last, unsigned) {
+			for (size_t p = first; p < last; ++p) players[p].Update();
+		});
+		t0 = Clock::now();
+		phase[Players] += std::chrono::duration<double>(t0 - t1).count();
+
+		blobs.Update(pool);
+		awake += blobs.Awake();
+		t1 = Clock::now();
+		phase[Blobs] += std::chrono::duration<double>(t1 - t0).count();
+
+		if (tick % Script::RayTicks == 0) {
+			for (unsigned p = 0; p < s.players; ++p)
+				hits[p] = IntersectRay(players[p].camera, players[p].dir, mapData, LevelBVH).wallno;
+			rays += s.players;
+		}
+		phase[Rays] += Seconds(t1);
+	}
+	double total = Seconds(start_time);
+
+	Checksum sum;
+	for (unsigned p = 0; p < s.players; ++p) {
+		sum.Add(players[p].camera);
+		sum.Add(players[p].vel);
+		sum.Add(players[p].dir);
+		sum.Add(hits[p]);
+	}
+	for (const BlobHandle &h : handles) {
+		size_t n = blobs.Index(h);
+		sum.Add(blobs.camera[n]);
+		sum.Add(blobs.vel[n]);
+		sum.Add(blobs.fatness[n]);
+	}
+
+	std::printf("%.0f ticks/s, %.3f ms per tick, %.1f blobs awake on average, %zu rays\n",
+				s.ticks / total, total * 1e3 / s.ticks, double(awake) / s.ticks, rays);
+	for (unsigned n = 0; n < NumPhases; ++n)
+		std::printf("  %-8s %10.3f ms %8.4f ms/tick %5.1f%%\n", names[n],
+					phase[n] * 1e3, phase[n] * 1e3 / s.ticks, phase[n] * 100 / total);
+	std::printf("checksum %016llx\n", (unsigned long long)sum.h);
+	return 0;
+}
@@ -0,0 +1,127 @@
+// Software renderer benchmark.
+// Draws the level with the software rasterizer (softraster.hpp) from the
+// player's starting place, turning around it in eight steps, with the
+// lights as spheres and the walls culled to each view as the demo does.
+// Reports frames per second for 1, 2, 4... threads, up to the given
+// number, and checks that every thread count draws the same images.
+//
+// Usage: softbench [-w width] [-h height] [-f frames] [-t threads] [-l lightdir] [-o shot.ppm]
+#include <algorithm> // For std::min, std::max
+#include <chrono>    // For std::chrono::steady_clock
+#include <cstdint>   // For uint32_t, uint64_t
+#include <cstdio>    // For std::printf, std::fopen
+#include <cstdlib>   // For std::atoi
+#include <string>    // For std::string
+#include <thread>    // For std::thread::hardware_concurrency
+#include <vector>    // For std::vector, in which we store the image
+
+#include "walldata.hpp"
+#include "actor.hpp"
+#include "frustum.hpp"
+#include "jobs.hpp"
+#include "tick.hpp"
+#include "softworld.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+const unsigned nwalls = sizeof(map) / sizeof(*map);
+const double FoV = 90.0;
+const unsigned Poses = 8;
+
+static SoftWorld World;
+static BoxList WallBoxes;
+
+// Draws the player's view after turning pose eighths of the way around,
+// and returns a checksum of the image.
+static uint32_t Frame(BlobActor &player, unsigned pose, SoftTarget &target, WorkStealingPool &pool) {
+	BlobActor view = player;
+	view.look_angle += pose * 360.0 / Poses;
+	view.Orient();
+	const double aspect = double(target.width) / target.height;
+	World.Begin(target, view.camera, view.dir, view.up, FoV, aspect, 1e-3, Actor::ViewDistance);
+	const Frustum frustum = view.View(FoV, aspect);
+	for (const auto &l : lights) {
+		XYZ<double> pos = {{l.pos.d[0], l.pos.d[1], l.pos.d[2]}};
+		const XYZ<double> none = {{0, 0, 0}}, size = {{0.1, 0.1, 0.1}};
+		if (!frustum.Outside(pos, 0.1)) World.Sphere(pos, none, size, 1, 1, 1);
+	}
+	uint64_t visible[(nwalls + 63) / 64];
+	for (auto &w : visible) w = ~uint64_t(0);
+	frustum.Cull(WallBoxes, visible);
+	World.Walls(visible);
+	World.Finish(pool);
+
+	uint32_t hash = 2166136261u;
+	for (size_t n = 0; n < size_t(target.width) * target.height; ++n) hash = (hash ^ target.color[n]) * 16777619u;
+	return hash;
+}
+
+static bool WritePPM(const char *path, const SoftTarget &target) {
+	FILE *fp = std::fopen(path, "wb");
+	if (!fp) { std::perror(path); return false; }
+	std::fprintf(fp, "P6 %u %u 255\n", target.width, target.height);
+	for (size_t n = 0; n < size_t(target.width) * target.height; ++n) {
+		const uint32_t c = target.color[n];
+		const unsigned char rgb[3] = { (unsigned char)(c >> 16), (unsigned char)(c >> 8), (unsigned char)c };
+		std::fwrite(rgb, 1, 3, fp);
+	}
+	return std::fclose(fp) == 0;
+}
+
+int main(int argc, char **argv) {
+	unsigned width = 1024, height = 576, frames = 64, threads = 0;
+	std::string lightdir = "light", shot;
+	for (int a = 1; a < argc; ++a) {
+		std::string arg = argv[a];
+		if (a + 1 < argc && arg == "-w") width = std::max(16, std::atoi(argv[++a]));
+		else if (a + 1 < argc && arg == "-h") height = std::max(16, std::atoi(argv[++a]));
+		else if (a + 1 < argc && arg == "-f") frames = std::max(1, std::atoi(argv[++a]));
+		else if (a + 1 < argc && arg == "-t") threads = std::max(0, std::atoi(argv[++a]));
+		else if (a + 1 < argc && arg == "-l") lightdir = argv[++a];
+		else if (a + 1 < argc && arg == "-o") shot = argv[++a];
+		else {
+			std::fprintf(stderr, "Usage: %s [-w width] [-h height] [-f frames] [-t threads] [-l lightdir] [-o shot.ppm]\n",
+						 argv[0]);
+			return 1;
+		}
+	}
+	if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+
+	auto t = Clock::now();
+	const bool packed = World.Load(lightdir);
+	std::printf("Loaded %s in %.1f ms\n", packed ? (lightdir + "/lightmaps.pak").c_str() : "the .raw lightmaps",
+				std::chrono::duration<double, std::milli>(Clock::now() - t).count());
+	WallBoxes.AddWalls(mapData);
+
+	BlobActor player;
+	Actor portals[2];
+	InitGame(player, portals);
+	SoftTarget target;
+	target.Init(width, height);
+	std::printf("%ux%u, %u frames\n", width, height, frames);
+
+	std::vector<uint32_t> reference(Poses);
+	for (unsigned n = 1; ; n = std::min(n * 2, threads)) {
+		WorkStealingPool pool(n);
+		std::vector<uint32_t> hashes(Poses);
+		for (unsigned pose = 0; pose < Poses; ++pose) hashes[pose] = Frame(player, pose, target, pool); // Warm up
+		unsigned triangles = 0;
+		t = Clock::now();
+		for (unsigned f = 0; f < frames; ++f) {
+			Frame(player, f % Poses, target, pool);
+			triangles += World.raster.drawn;
+		}
+		const double secs = std::chrono::duration<double>(Clock::now() - t).count();
+		if (n == 1) reference = hashes;
+		std::printf("%2u threads: %7.1f frames/s, %6.2f ms/frame, %u triangles/frame%s\n", n, frames / secs,
+					secs * 1000 / frames, triangles / frames, hashes == reference ? "" : "  DIFFERENT IMAGE");
+		if (n == threads) break;
+	}
+
+	if (!shot.empty()) {
+		WorkStealingPool pool(threads);
+		Frame(player, 0, target, pool);
+		if (!WritePPM(shot.c_str(), target)) return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,461 @@
+// Tile-based software rasterizer.
+// Draws textured triangles on the CPU, for machines without OpenGL, into a
+// SoftTarget: 32-bit pixels laid out like the frames PC::Dither reads back
+// (0xAARRGGBB), but with rows running top-down, and a depth buffer.
+//
+// Drawing only transforms, clips and sets up triangles, and sorts them into
+// bins for the tiles of the target they may touch. Finish then gives the
+// tiles to the worker threads. Each tile belongs to one thread, so no two
+// threads write the same pixel, and a tile draws its triangles in the order
+// they were submitted. Within a tile, the edge functions and the depth test
+// are evaluated for four pixels at a time with SSE2. The pixels that
+// pass are then shaded one at a time, with attributes interpolated as
+// attribute/w over 1/w to be perspective-correct.
+//
+// As the fixed-function pipeline it stands in for, it clips against the
+// near and far planes, culls back faces (front faces are counter-clockwise),
+// and keeps the nearest fragment. Unlike GL, the depth buffer holds 1/w
+// rather than z/w: in floats, that tells apart surfaces as close together
+// as a portal and the wall behind it even far away, where z/w does not.
+// Textures are filtered bilinearly, and the repeating texture of the walls
+// is mipmapped.
+#pragma once
+
+#include <algorithm> // For std::min, std::max
+#include <cmath>     // For std::floor, std::ceil, std::ilogb
+#include <cstdint>   // For uint8_t, uint16_t, uint32_t
+#include <vector>    // For std::vector, in which we keep triangles and bins
+
+#include "math.hpp"
+#include "frustum.hpp"
+#include "jobs.hpp"
+
+#ifdef __SSE2__
+#define SOFTRASTER_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// Where a view is drawn.
+class SoftTarget {
+    public:
+    unsigned width, height;
+    uint32_t* color;          // width*height, 0xAARRGGBB, rows top-down
+    std::vector<float> depth; // 1/w of what is nearest, 0 for nothing; depth_stride per row
+    unsigned depth_stride;    // Rounded up to four pixels, which are tested together
+
+    SoftTarget() : width(0), height(0), color(NULL), depth_stride(0) {}
+    SoftTarget(const SoftTarget&) = delete;
+    SoftTarget& operator=(const SoftTarget&) = delete;
+
+    // Draws into pixels, which is resized to w*h.
+    void Init(unsigned w, unsigned h, std::vector<uint32_t>& pixels) {
+        width = w;
+        height = h;
+        pixels.resize(size_t(w) * h);
+        color = pixels.data();
+        depth_stride = (w + 3) & ~3u;
+        depth.assign(size_t(depth_stride) * h, 0.f);
+    }
+    // Draws into pixels of its own.
+    void Init(unsigned w, unsigned h) { Init(w, h, own); }
+
+    private:
+    std::vector<uint32_t> own;
+};
+
+// A luminance texture that repeats, with its mipmaps; the width and height
+// must be powers of two.
+struct SoftMipmaps {
+    struct Level { unsigned w, h; std::vector<uint8_t> texels; };
+    std::vector<Level> levels;
+
+    // From the w*h image and the levels BuildMipmaps made from it.
+    void Build(const float* image, unsigned w, unsigned h, const std::vector<std::vector<float> >& mipmaps) {
+        levels.clear();
+        for (size_t l = 0; l <= mipmaps.size(); ++l) {
+            const float* src = l ? mipmaps[l - 1].data() : image;
+            Level level = { w, h, std::vector<uint8_t>(size_t(w) * h) };
+            for (size_t n = 0; n < level.texels.size(); ++n) level.texels[n] = Byte(src[n]);
+            levels.push_back(std::move(level));
+            w = std::max(1u, w / 2);
+            h = std::max(1u, h / 2);
+        }
+    }
+
+    static uint8_t Byte(float v) { return uint8_t(std::min(std::max(v, 0.f), 1.f) * 255.f + 0.5f); }
+};
+
+// An RGB map across one wall, such as a lightmap: w*h texels surrounded by
+// pad texels copied from the edges, as in lightmaps.pak. Texels are stored
+// as 0x00RRGGBB.
+struct SoftLightmap {
+    unsigned w, h, pad;
+    std::vector<uint32_t> texels; // (w + pad * 2) * (h + pad * 2)
+
+    void Build(const float* rgb, unsigned w, unsigned h, unsigned pad) {
+        this->w = w;
+        this->h = h;
+        this->pad = pad;
+        texels.resize(size_t(w + pad * 2) * (h + pad * 2));
+        for (size_t n = 0; n < texels.size(); ++n)
+            texels[n] = uint32_t(SoftMipmaps::Byte(rgb[n * 3])) << 16
+                      | uint32_t(SoftMipmaps::Byte(rgb[n * 3 + 1])) << 8 | SoftMipmaps::Byte(rgb[n * 3 + 2]);
+    }
+};
+
+// How the pixels of a triangle are coloured, and what its attributes are.
+struct SoftMaterial {
+    enum Kind {
+        Flat,  // color
+        Image, // The pixels of image; attributes s and t, with t = 0 at the bottom as in GL
+        Lit    // texture (attributes 0 and 1, in repeats), times lightmap plus addmap
+               // (attributes 2 and 3, from 0 to 1 across the wall); addmap may be NULL
+    };
+    Kind kind;
+    uint32_t color;
+    const SoftTarget* image;
+    const SoftMipmaps* texture;
+    const SoftLightmap *lightmap, *addmap;
+
+    static SoftMaterial MakeFlat(uint32_t color) { return SoftMaterial{ Flat, color, NULL, NULL, NULL, NULL }; }
+    static SoftMaterial MakeImage(const SoftTarget& image) {
+        return SoftMaterial{ Image, 0, &image, NULL, NULL, NULL };
+    }
+    static SoftMaterial MakeLit(const SoftMipmaps& texture, const SoftLightmap& lightmap, const SoftLightmap* addmap) {
+        return SoftMaterial{ Lit, 0, NULL, &texture, &lightmap, addmap };
+    }
+};
+
+struct SoftVertex {
+    static const unsigned MaxAttribs = 4;
+    float pos[3];              // In the world
+    float attr[MaxAttribs];    // Interpolated across the triangle
+};
+
+class SoftRasterizer {
+    public:
+    static const unsigned TileSize = 64; // Pixels along each side of a tile
+
+    // Triangles set up and triangles drawn since Begin; the rest were
+    // culled or clipped away.
+    unsigned submitted, drawn;
+
+    SoftRasterizer() : submitted(0), drawn(0), target(NULL), clear(0), tiles_x(0), tiles_y(0) {}
+
+    // Starts a view of target, seen as with gluPerspective and gluLookAt.
+    // Finish clears it to clear_color first.
+    void Begin(SoftTarget& target, const XYZ<double>& eye, const XYZ<double>& dir, const XYZ<double>& up,
+               double fov, double aspect, double near, double far, uint32_t clear_color = 0xFF000000u) {
+        Begin(target, Frustum(eye, dir, up, fov, aspect, near, far), clear_color);
+    }
+
+    // The same, for any view (see Frustum::Through).
+    void Begin(SoftTarget& target, const Frustum& view, uint32_t clear_color = 0xFF000000u) {
+        this->target = &target;
+        clear = clear_color;
+        submitted = drawn = 0;
+        triangles.clear();
+        materials.clear();
+        tiles_x = (target.width + TileSize - 1) / TileSize;
+        tiles_y = (target.height + TileSize - 1) / TileSize;
+        bins.resize(tiles_x * tiles_y);
+        for (auto& bin : bins) bin.clear();
+
+        // The projection times the view.
+        view.Clip(matrix);
+    }
+
+    // Draws count/3 triangles of verts, each with nattr attributes.
+    void Triangles(const SoftVertex* verts, const uint16_t* indices, unsigned count, unsigned nattr,
+                   const SoftMaterial& material) {
+        const unsigned m = AddMaterial(material);
+        for (unsigned n = 0; n + 2 < count; n += 3)
+            Triangle(verts[indices[n]], verts[indices[n + 1]], verts[indices[n + 2]], nattr, m);
+    }
+
+    // Draws the quad v[0..3], as GL_QUADS would.
+    void Quad(const SoftVertex v[4], unsigned nattr, const SoftMaterial& material) {
+        const unsigned m = AddMaterial(material);
+        Triangle(v[0], v[1], v[2], nattr, m);
+        Triangle(v[0], v[2], v[3], nattr, m);
+    }
+
+    // Draws everything since Begin, spreading the tiles over the pool.
+    void Finish(WorkStealingPool& pool) {
+        pool.ParallelFor(0, bins.size(), 1, [this](size_t first, size_t last, unsigned) {
+            for (size_t tile = first; tile < last; ++tile) Tile(tile);
+        });
+    }
+
+    private:
+    // A triangle ready to be drawn, as planes a*x + b*y + c over the pixels
+    // of the target.
+    struct Setup {
+        float edge[3][3];  // Positive inside
+        int topleft[3];    // Whether pixels exactly on the edge are inside
+        float q[3];        // 1/w, which is also the depth
+        float attr[SoftVertex::MaxAttribs][3]; // Attribute/w
+        int x0, y0, x1, y1; // Pixels it may cover; x1 and y1 are past the end
+        unsigned nattr, material;
+    };
+    // A vertex in clip space.
+    struct Clipped { double c[4]; double attr[SoftVertex::MaxAttribs]; };
+
+    SoftTarget* target;
+    uint32_t clear;
+    double matrix[4][4];
+    unsigned tiles_x, tiles_y;
+    std::vector<Setup> triangles;
+    std::vector<SoftMaterial> materials;
+    std::vector<std::vector<uint32_t> > bins; // Triangles of each tile, in order
+
+    unsigned AddMaterial(const SoftMaterial& m) {
+        materials.push_back(m);
+        return materials.size() - 1;
+    }
+
+    void Triangle(const SoftVertex& a, const SoftVertex& b, const SoftVertex& c, unsigned nattr, unsigned material) {
+        ++submitted;
+        Clipped poly[2][8];
+        const SoftVertex* in[3] = { &a, &b, &c };
+        for (unsigned v = 0; v < 3; ++v) {
+            for (unsigned r = 0; r < 4; ++r)
+                poly[0][v].c[r] = matrix[r][0] * in[v]->pos[0] + matrix[r][1] * in[v]->pos[1]
+                                + matrix[r][2] * in[v]->pos[2] + matrix[r][3];
+            for (unsigned k = 0; k < nattr; ++k) poly[0][v].attr[k] = in[v]->attr[k];
+        }
+        // Against the near (z >= -w) and far (z <= w) planes.
+        unsigned count = 3, cur = 0;
+        for (int side = -1; side <= 1 && count >= 3; side += 2) {
+            const Clipped* src = poly[cur];
+            Clipped* dst = poly[cur ^ 1];
+            unsigned out = 0;
+            for (unsigned i = 0, j = count - 1; i < count; j = i++) {
+                const double di = src[i].c[3] - side * src[i].c[2], dj = src[j].c[3] - side * src[j].c[2];
+                if ((dj >= 0) != (di >= 0)) {
+                    const double t = dj / (dj - di);
+                    Clipped& v = dst[out++];
+                    for (unsigned r = 0; r < 4; ++r) v.c[r] = src[j].c[r] + (src[i].c[r] - src[j].c[r]) * t;
+                    for (unsigned k = 0; k < nattr; ++k)
+                        v.attr[k] = src[j].attr[k] + (src[i].attr[k] - src[j].attr[k]) * t;
+                }
+                if (di >= 0) dst[out++] = src[i];
+            }
+            count = out;
+            cur ^= 1;
+        }
+        for (unsigned n = 1; n + 1 < count; ++n) Project(poly[cur][0], poly[cur][n], poly[cur][n + 1], nattr, material);
+    }
+
+    void Project(const Clipped& a, const Clipped& b, const Clipped& c, unsigned nattr, unsigned material) {
+        const Clipped* in[3] = { &a, &b, &c };
+        double x[3], y[3], q[3];
+        for (unsigned v = 0; v < 3; ++v) {
+            q[v] = 1 / in[v]->c[3];
+            x[v] = (in[v]->c[0] * q[v] * 0.5 + 0.5) * target->width;
+            y[v] = (0.5 - in[v]->c[1] * q[v] * 0.5) * target->height;
+        }
+        // Rows run down, so front faces are clockwise here.
+        double area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+        if (!(area < 0)) return;
+        std::swap(in[1], in[2]);
+        std::swap(x[1], x[2]); std::swap(y[1], y[2]); std::swap(q[1], q[2]);
+        area = -area;
+
+        Setup t;
+        double lo[2] = { x[0], y[0] }, hi[2] = { x[0], y[0] };
+        for (unsigned v = 1; v < 3; ++v) {
+            lo[0] = std::min(lo[0], x[v]); hi[0] = std::max(hi[0], x[v]);
+            lo[1] = std::min(lo[1], y[v]); hi[1] = std::max(hi[1], y[v]);
+        }
+        // Pixels whose centres are within the bounds.
+        t.x0 = int(std::max(0.0, std::ceil(lo[0] - 0.5)));
+        t.y0 = int(std::max(0.0, std::ceil(lo[1] - 0.5)));
+        t.x1 = int(std::min(double(target->width), std::floor(hi[0] - 0.5) + 1));
+        t.y1 = int(std::min(double(target->height), std::floor(hi[1] - 0.5) + 1));
+        if (t.x0 >= t.x1 || t.y0 >= t.y1) return;
+
+        for (unsigned e = 0; e < 3; ++e) {
+            const unsigned i = e, j = (e + 1) % 3;
+            const double ea = y[i] - y[j], eb = x[j] - x[i];
+            t.edge[e][0] = ea;
+            t.edge[e][1] = eb;
+            t.edge[e][2] = -(ea * x[i] + eb * y[i]);
+            t.topleft[e] = ea > 0 || (ea == 0 && eb > 0);
+        }
+        auto Plane = [&](const double f[3], float out[3]) {
+            const double fx = ((f[1] - f[0]) * (y[2] - y[0]) - (f[2] - f[0]) * (y[1] - y[0])) / area;
+            const double fy = ((f[2] - f[0]) * (x[1] - x[0]) - (f[1] - f[0]) * (x[2] - x[0])) / area;
+            out[0] = fx;
+            out[1] = fy;
+            out[2] = f[0] - fx * x[0] - fy * y[0];
+        };
+        Plane(q, t.q);
+        for (unsigned k = 0; k < nattr; ++k) {
+            const double f[3] = { in[0]->attr[k] * q[0], in[1]->attr[k] * q[1], in[2]->attr[k] * q[2] };
+            Plane(f, t.attr[k]);
+        }
+        t.nattr = nattr;
+        t.material = material;
+
+        // Into the bin of each tile that it may cover, leaving out tiles
+        // that lie wholly outside one of its edges.
+        const uint32_t index = triangles.size();
+        triangles.push_back(t);
+        ++drawn;
+        for (int ty = t.y0 / TileSize; ty <= (t.y1 - 1) / int(TileSize); ++ty)
+            for (int tx = t.x0 / TileSize; tx <= (t.x1 - 1) / int(TileSize); ++tx) {
+                bool outside = false;
+                for (unsigned e = 0; e < 3 && !outside; ++e) {
+                    // The corner of the tile furthest inside this edge.
+                    const double cx = (tx + (t.edge[e][0] > 0)) * double(TileSize);
+                    const double cy = (ty + (t.edge[e][1] > 0)) * double(TileSize);
+                    outside = t.edge[e][0] * cx + t.edge[e][1] * cy + t.edge[e][2] < 0;
+                }
+                if (!outside) bins[ty * tiles_x + tx].push_back(index);
+            }
+    }
+
+    // Draws a tile's triangles, after clearing it.
+    void Tile(size_t tile) {
+        const int tx0 = tile % tiles_x * TileSize, ty0 = tile / tiles_x * TileSize;
+        const int tx1 = std::min<int>(tx0 + TileSize, target->width), ty1 = std::min<int>(ty0 + TileSize, target->height);
+        for (int y = ty0; y < ty1; ++y) {
+            std::fill(target->color + size_t(y) * target->width + tx0, target->color + size_t(y) * target->width + tx1, clear);
+            float* depth = &target->depth[size_t(y) * target->depth_stride];
+            std::fill(depth + tx0, depth + tx1, 0.f);
+        }
+        for (uint32_t index : bins[tile]) {
+            const Setup& t = triangles[index];
+            const int x0 = std::max(t.x0, tx0), x1 = std::min(t.x1, tx1);
+            const int y0 = std::max(t.y0, ty0), y1 = std::min(t.y1, ty1);
+            const SoftMaterial& m = materials[t.material];
+            switch (m.kind) {
+                case SoftMaterial::Flat:  Raster<SoftMaterial::Flat>(t, m, x0, y0, x1, y1); break;
+                case SoftMaterial::Image: Raster<SoftMaterial::Image>(t, m, x0, y0, x1, y1); break;
+                case SoftMaterial::Lit:   Raster<SoftMaterial::Lit>(t, m, x0, y0, x1, y1); break;
+            }
+        }
+    }
+
+    // Draws the part of t within x0..x1, y0..y1.
+    template <SoftMaterial::Kind K>
+    void Raster(const Setup& t, const SoftMaterial& m, int x0, int y0, int x1, int y1) {
+        for (int y = y0; y < y1; ++y) {
+            const float py = y + 0.5f;
+            uint32_t* color = target->color + size_t(y) * target->width;
+            float* depth = &target->depth[size_t(y) * target->depth_stride];
+#ifdef SOFTRASTER_SSE2
+            const __m128 zero = _mm_setzero_ps(), lanes = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+            __m128 ea[3], erow[3], tl[3];
+            for (unsigned e = 0; e < 3; ++e) {
+                ea[e] = _mm_set1_ps(t.edge[e][0]);
+                erow[e] = _mm_set1_ps(t.edge[e][1] * py + t.edge[e][2]);
+                tl[e] = _mm_castsi128_ps(_mm_set1_epi32(t.topleft[e] ? -1 : 0));
+            }
+            const __m128 qa = _mm_set1_ps(t.q[0]), qrow = _mm_set1_ps(t.q[1] * py + t.q[2]);
+            const __m128i first = _mm_set1_epi32(x0 - 1), end = _mm_set1_epi32(x1);
+            // In groups of four from a multiple of four, so that a group
+            // never reaches into a tile of another thread.
+            for (int x = x0 & ~3; x < x1; x += 4) {
+                const __m128 px = _mm_add_ps(_mm_set1_ps(float(x)), lanes);
+                const __m128i xs = _mm_add_epi32(_mm_set1_epi32(x), _mm_setr_epi32(0, 1, 2, 3));
+                __m128 in = _mm_castsi128_ps(_mm_and_si128(_mm_cmpgt_epi32(xs, first), _mm_cmplt_epi32(xs, end)));
+                for (unsigned e = 0; e < 3; ++e) {
+                    const __m128 v = _mm_add_ps(_mm_mul_ps(ea[e], px), erow[e]);
+                    in = _mm_and_ps(in, _mm_or_ps(_mm_cmpgt_ps(v, zero), _mm_and_ps(_mm_cmpeq_ps(v, zero), tl[e])));
+                }
+                if (!_mm_movemask_ps(in)) continue;
+                const __m128 q = _mm_add_ps(_mm_mul_ps(qa, px), qrow);
+                in = _mm_and_ps(in, _mm_cmpgt_ps(q, _mm_loadu_ps(depth + x)));
+                int mask = _mm_movemask_ps(in);
+                if (!mask) continue;
+                float qs[4];
+                _mm_storeu_ps(qs, q);
+                for (; mask; mask &= mask - 1) {
+                    const int lane = __builtin_ctz(mask);
+                    depth[x + lane] = qs[lane];
+                    color[x + lane] = Shade<K>(t, m, x + lane + 0.5f, py);
+                }
+            }
+#else
+            for (int x = x0; x < x1; ++x) {
+                const float px = x + 0.5f;
+                bool in = true;
+                for (unsigned e = 0; e < 3; ++e) {
+                    const float v = t.edge[e][0] * px + (t.edge[e][1] * py + t.edge[e][2]);
+                    in = in && (v > 0 || (v == 0 && t.topleft[e]));
+                }
+                const float q = t.q[0] * px + (t.q[1] * py + t.q[2]);
+                if (!in || !(q > depth[x])) continue;
+                depth[x] = q;
+                color[x] = Shade<K>(t, m, px, py);
+            }
+#endif
+        }
+    }
+
+    // The colour of the pixel centred at px, py.
+    template <SoftMaterial::Kind K>
+    static uint32_t Shade(const Setup& t, const SoftMaterial& m, float px, float py) {
+        if (K == SoftMaterial::Flat) return m.color;
+        const float q = t.q[0] * px + t.q[1] * py + t.q[2], w = 1 / q;
+        float a[SoftVertex::MaxAttribs];
+        for (unsigned k = 0; k < t.nattr; ++k) a[k] = (t.attr[k][0] * px + t.attr[k][1] * py + t.attr[k][2]) * w;
+        if (K == SoftMaterial::Image) {
+            const SoftTarget& img = *m.image;
+            const int x = std::min(std::max(int(a[0] * img.width), 0), int(img.width) - 1);
+            const int y = std::min(std::max(int((1 - a[1]) * img.height), 0), int(img.height) - 1);
+            return img.color[size_t(y) * img.width + x] | 0xFF000000u;
+        }
+
+        // The mipmap level where a texel is about a pixel across, from how
+        // fast the texture coordinates change along x and y here.
+        const SoftMipmaps& tex = *m.texture;
+        const float s = tex.levels[0].w, r = tex.levels[0].h;
+        const float dudx = (t.attr[0][0] - a[0] * t.q[0]) * w * s, dvdx = (t.attr[1][0] - a[1] * t.q[0]) * w * r;
+        const float dudy = (t.attr[0][1] - a[0] * t.q[1]) * w * s, dvdy = (t.attr[1][1] - a[1] * t.q[1]) * w * r;
+        const float rho2 = std::max(dudx * dudx + dvdx * dvdx, dudy * dudy + dvdy * dvdy);
+        const int level = rho2 > 1 ? std::min<int>((std::ilogb(rho2) + 1) / 2, tex.levels.size() - 1) : 0;
+        const SoftMipmaps::Level& l = tex.levels[level];
+        const uint32_t lum = Bilinear(l.texels.data(), l.w, l.h, a[0] * l.w - 0.5f, a[1] * l.h - 0.5f, true);
+
+        const SoftLightmap& lm = *m.lightmap;
+        const unsigned stride = lm.w + lm.pad * 2, rows = lm.h + lm.pad * 2;
+        const float lx = lm.pad + a[2] * lm.w - 0.5f, ly = lm.pad + a[3] * lm.h - 0.5f;
+        const uint32_t light = Bilinear(lm.texels.data(), stride, rows, lx, ly, false);
+        const uint32_t add = m.addmap ? Bilinear(m.addmap->texels.data(), stride, rows, lx, ly, false) : 0;
+        uint32_t out = 0xFF000000u;
+        for (unsigned c = 0; c < 24; c += 8) {
+            const uint32_t v = (lum * ((light >> c) & 0xFF) + 127) / 255 + ((add >> c) & 0xFF);
+            out |= std::min(v, 255u) << c;
+        }
+        return out;
+    }
+
+    // Filters the four texels around x, y (in texels, centres at whole
+    // numbers), wrapping around if repeat and clamping to the edges if not.
+    // Works on each byte of T separately.
+    template <typename T>
+    static uint32_t Bilinear(const T* texels, unsigned w, unsigned h, float x, float y, bool repeat) {
+        const float fx = std::floor(x), fy = std::floor(y);
+        const unsigned wx = unsigned((x - fx) * 256), wy = unsigned((y - fy) * 256);
+        int x0 = int(fx), y0 = int(fy), x1 = x0 + 1, y1 = y0 + 1;
+        if (repeat) {
+            // Power-of-two sizes.
+            x0 &= w - 1; x1 &= w - 1; y0 &= h - 1; y1 &= h - 1;
+        } else {
+            x0 = std::min(std::max(x0, 0), int(w) - 1); x1 = std::min(std::max(x1, 0), int(w) - 1);
+            y0 = std::min(std::max(y0, 0), int(h) - 1); y1 = std::min(std::max(y1, 0), int(h) - 1);
+        }
+        const uint32_t t00 = texels[y0 * w + x0], t01 = texels[y0 * w + x1];
+        const uint32_t t10 = texels[y1 * w + x0], t11 = texels[y1 * w + x1];
+        uint32_t out = 0;
+        for (unsigned c = 0; c < sizeof(T) * 8; c += 8) {
+            const uint32_t top = ((t00 >> c) & 0xFF) * (256 - wx) + ((t01 >> c) & 0xFF) * wx;
+            const uint32_t bottom = ((t10 >> c) & 0xFF) * (256 - wx) + ((t11 >> c) & 0xFF) * wx;
+            out |= ((top * (256 - wy) + bottom * wy + 32768) >> 16) << c;
+        }
+        return out;
+    }
+};
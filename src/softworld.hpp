@@ -0,0 +1,166 @@
+// The level as drawn by the software rasterizer (softraster.hpp).
+// Holds CPU copies of what the GL renderer uploads: the wall texture with
+// its mipmaps, each wall's lightmap and addmap, and the walls of the
+// current level (see levelfile.hpp) as quads with the texture coordinates
+// LevelMesh gives them. Each view draws the walls
+// it is given as visible, plus the spheres and portals its caller adds,
+// with the same colours as in GL.
+#pragma once
+
+#include <cstdio>  // For std::snprintf, std::fopen, std::fread
+#include <string>  // For std::string
+#include <vector>  // For std::vector, in which we keep the walls
+
+#include "levelfile.hpp"
+#include "loader.hpp"
+#include "lightpack.hpp"
+#include "spheremesh.hpp"
+#include "softraster.hpp"
+
+class SoftWorld {
+    public:
+    SoftRasterizer raster;
+
+    SoftWorld() {
+        // The vertices each level of the sphere uses.
+        for (unsigned l = 0; l < SphereMesh::Levels; ++l) {
+            sphere_first[l] = ~0u;
+            sphere_last[l] = 0;
+            for (unsigned i = sphere.first[l]; i < sphere.first[l] + sphere.count[l]; ++i) {
+                sphere_first[l] = std::min<unsigned>(sphere_first[l], sphere.indices[i]);
+                sphere_last[l] = std::max<unsigned>(sphere_last[l], sphere.indices[i] + 1);
+            }
+        }
+    }
+
+    // Makes the wall texture and the walls of the current level, and reads
+    // the lightmaps from dir/lightmaps.pak if it matches the level, or else
+    // from the .raw files under dir. Walls without a lightmap are left
+    // unlit. Returns whether the pack was used.
+    bool Load(const std::string& dir) {
+        const LevelSpan<WallData>& walls = LevelFile::Current().walls;
+        const unsigned nwalls = walls.size();
+        lightmaps.assign(nwalls, SoftLightmap());
+        addmaps.assign(nwalls, SoftLightmap());
+        has_addmap.assign(nwalls, false);
+        quads.resize(nwalls * 4);
+        for (unsigned wallno = 0; wallno < nwalls; ++wallno) {
+            const WallData& m = walls[wallno];
+            int width = m.width;   // Number of times the texture
+            int height = m.height; // is repeated across the surface.
+            for (unsigned e = 0; e < 4; ++e) {
+                SoftVertex& v = quads[wallno * 4 + e];
+                float s = !((e + 2) & 2), t = !((e + 3) & 2);
+                for (unsigned c = 0; c < 3; ++c) v.pos[c] = m.p[e].d[c];
+                v.attr[0] = width * s;
+                v.attr[1] = height * t;
+                v.attr[2] = s;
+                v.attr[3] = t;
+            }
+        }
+
+        const unsigned txW = 256, txH = 256;
+        std::vector<float> image(txW * txH);
+        std::vector<std::vector<float> > mipmaps;
+        WallTexels(image.data(), txW, txH);
+        BuildMipmaps(image.data(), txW, txH, 1, mipmaps);
+        texture.Build(image.data(), txW, txH, mipmaps);
+
+        LightPack pack;
+        bool packed = pack.Open((dir + "/lightmaps.pak").c_str()) && pack.Walls() == nwalls;
+        for (unsigned wallno = 0; packed && wallno < nwalls; ++wallno)
+            packed = pack.Entry(wallno).width == walls[wallno].lmap_w
+                  && pack.Entry(wallno).height == walls[wallno].lmap_h;
+        std::vector<float> raw;
+        for (unsigned wallno = 0; wallno < nwalls; ++wallno) {
+            const unsigned w = walls[wallno].lmap_w, h = walls[wallno].lmap_h;
+            if (packed) {
+                lightmaps[wallno].Build(pack.Lightmap(wallno), w, h, pack.Padding());
+                if (const float* add = pack.Addmap(wallno)) {
+                    addmaps[wallno].Build(add, w, h, pack.Padding());
+                    has_addmap[wallno] = true;
+                }
+                continue;
+            }
+            char Buf[64];
+            std::snprintf(Buf, 64, "/lmap/lmap%u.raw", wallno);
+            if (!ReadRaw(dir + Buf, w * h * 3, raw)) raw.assign(w * h * 3, 1.f);
+            lightmaps[wallno].Build(raw.data(), w, h, 0);
+            std::snprintf(Buf, 64, "/smap/smap%u.raw", wallno);
+            if (ReadRaw(dir + Buf, w * h * 3, raw)) {
+                addmaps[wallno].Build(raw.data(), w, h, 0);
+                has_addmap[wallno] = true;
+            }
+        }
+        return packed;
+    }
+
+    // Starts a view, as SoftRasterizer::Begin.
+    void Begin(SoftTarget& target, const XYZ<double>& eye, const XYZ<double>& dir, const XYZ<double>& up,
+               double fov, double aspect, double near, double far) {
+        this->eye = eye;
+        raster.Begin(target, eye, dir, up, fov, aspect, near, far);
+    }
+    // Starts view, as SoftRasterizer::Begin, with spheres detailed as seen
+    // from eye.
+    void Begin(SoftTarget& target, const XYZ<double>& eye, const Frustum& view) {
+        this->eye = eye;
+        raster.Begin(target, view);
+    }
+
+    // Draws the walls whose bits are set in visible (64 to a word).
+    void Walls(const uint64_t visible[]) {
+        for (unsigned wallno = 0; wallno < quads.size() / 4; ++wallno) {
+            if (!((visible[wallno / 64] >> (wallno % 64)) & 1)) continue;
+            raster.Quad(&quads[wallno * 4], 4,
+                        SoftMaterial::MakeLit(texture, lightmaps[wallno], has_addmap[wallno] ? &addmaps[wallno] : NULL));
+        }
+    }
+
+    // Draws a sphere, as SphereRenderer::Add.
+    void Sphere(const XYZ<double>& pos, const XYZ<double>& center, const XYZ<double>& scale,
+                float r, float g, float b) {
+        const unsigned l = SphereMesh::LevelFor(pos - center, scale, eye);
+        scratch.resize(sphere_last[l]);
+        for (unsigned n = sphere_first[l]; n < sphere_last[l]; ++n)
+            for (unsigned c = 0; c < 3; ++c)
+                scratch[n].pos[c] = sphere.verts[n * 3 + c] * scale.d[c] + pos.d[c] - center.d[c];
+        const uint32_t color = 0xFF000000u | uint32_t(SoftMipmaps::Byte(r)) << 16
+                             | uint32_t(SoftMipmaps::Byte(g)) << 8 | SoftMipmaps::Byte(b);
+        raster.Triangles(scratch.data(), &sphere.indices[sphere.first[l]], sphere.count[l], 0,
+                         SoftMaterial::MakeFlat(color));
+    }
+
+    // Draws a portal's quad showing view.
+    void Portal(const XYZ<double> corners[4], const SoftTarget& view) {
+        SoftVertex v[4];
+        for (unsigned e = 0; e < 4; ++e) {
+            for (unsigned c = 0; c < 3; ++c) v[e].pos[c] = corners[e].d[c];
+            v[e].attr[0] = !!((e + 0) & 2);
+            v[e].attr[1] = !!((e + 3) & 2);
+        }
+        raster.Quad(v, 2, SoftMaterial::MakeImage(view));
+    }
+
+    void Finish(WorkStealingPool& pool) { raster.Finish(pool); }
+
+    private:
+    SoftMipmaps texture;
+    std::vector<SoftLightmap> lightmaps, addmaps;
+    std::vector<bool> has_addmap;
+    std::vector<SoftVertex> quads; // Four corners per wall
+    SphereMesh sphere;
+    unsigned sphere_first[SphereMesh::Levels], sphere_last[SphereMesh::Levels]; // Vertices of each level
+    std::vector<SoftVertex> scratch; // The sphere being drawn
+    XYZ<double> eye;
+
+    // Reads a whole .raw lightmap of exactly count floats.
+    static bool ReadRaw(const std::string& path, size_t count, std::vector<float>& out) {
+        FILE* fp = std::fopen(path.c_str(), "rb");
+        if (!fp) return false;
+        out.resize(count);
+        size_t got = std::fread(&out[0], sizeof(float), count, fp);
+        std::fclose(fp);
+        return got == count;
+    }
+};
@@ -0,0 +1,61 @@
+// The unit sphere that lights, players and blobs are drawn with.
+// It is tessellated once at a few levels of detail into one vertex and
+// index array, each level being a range of the indices. Both the GL
+// renderer (spheres.hpp) and the software one (softworld.hpp) draw from it.
+#pragma once
+
+#include <algorithm> // For std::max
+#include <cmath>     // For std::sin, std::cos
+#include <cstdint>   // For uint16_t
+#include <vector>    // For std::vector, in which we keep the mesh
+
+#include "math.hpp"
+
+struct SphereMesh {
+    static const unsigned Levels = 3;
+    std::vector<float> verts;      // x, y, z; the vertices double as normals
+    std::vector<uint16_t> indices; // Triangles, counter-clockwise seen from outside
+    unsigned first[Levels], count[Levels]; // Range of each level in indices
+
+    SphereMesh() {
+        // Slices and stacks of each level; the first matches what
+        // gluSphere(..., 16, 16) used to draw.
+        static const unsigned detail[Levels][2] = { {16, 16}, {10, 8}, {6, 5} };
+        for (unsigned l = 0; l < Levels; ++l) {
+            first[l] = indices.size();
+            Tessellate(detail[l][0], detail[l][1]);
+            count[l] = indices.size() - first[l];
+        }
+    }
+
+    // Picks the level of detail from how large a sphere of radii scale at
+    // where looks from eye.
+    static unsigned LevelFor(const XYZ<double>& where, const XYZ<double>& scale, const XYZ<double>& eye) {
+        double radius = std::max(scale.d[0], std::max(scale.d[1], scale.d[2]));
+        double distance = (where - eye).Len();
+        if (radius > distance * 0.1) return 0;
+        if (radius > distance * 0.03) return 1;
+        return 2;
+    }
+
+    private:
+    // Appends a unit sphere of the given slices and stacks.
+    void Tessellate(unsigned slices, unsigned stacks) {
+        const unsigned base = verts.size() / 3;
+        for (unsigned i = 0; i <= stacks; ++i) {
+            double phi = M_PI * i / stacks; // From the +z pole
+            for (unsigned j = 0; j <= slices; ++j) {
+                double theta = 2 * M_PI * j / slices;
+                verts.push_back(std::sin(phi) * std::cos(theta));
+                verts.push_back(std::sin(phi) * std::sin(theta));
+                verts.push_back(std::cos(phi));
+            }
+        }
+        for (unsigned i = 0; i < stacks; ++i)
+            for (unsigned j = 0; j < slices; ++j) {
+                uint16_t a = base + i * (slices + 1) + j, b = a + slices + 1;
+                const uint16_t quad[6] = { a, b, uint16_t(a + 1), uint16_t(a + 1), b, uint16_t(b + 1) };
+                indices.insert(indices.end(), quad, quad + 6);
+            }
+    }
+};
@@ -0,0 +1,254 @@
+// Spheres for the lights, the player and the blobs.
+// The unit sphere of spheremesh.hpp is put, at all its levels of detail,
+// into a static vertex and index buffer. Each view collects the spheres it wants
+// drawn, as position, centre offset, scale and colour, and then draws them
+// with one instanced draw call per level of detail, the per-sphere values
+// coming from a buffer filled once per view. Without instancing support
+// (plain GL 2.1), each level is compiled into a display list instead, and
+// drawn once per sphere with the same transforms as before.
+#pragma once
+
+#define GL_SILENCE_DEPRECATION
+#include "GL/glew.h"
+
+#include <algorithm> // For std::max
+#include <cstddef>   // For offsetof
+#include <vector>    // For std::vector, in which we stage the spheres
+
+#include "math.hpp"
+#include "frustum.hpp"
+#include "spheremesh.hpp"
+#include "debug.hpp"
+#include "glcalls.hpp"
+
+struct SphereInstance {
+    GLfloat pos[3];    // Where the actor is (camera)
+    GLfloat center[3]; // Subtracted from pos, like Actor::center
+    GLfloat scale[3];  // Radius along each axis (fatness)
+    GLfloat color[3];
+};
+
+class SphereRenderer {
+    public:
+    static const unsigned Levels = SphereMesh::Levels;
+
+    SphereRenderer() : vbo(0), ibo(0), instance_vbo(0), program(0), instance_capacity(0), view(NULL) {}
+
+    // Uploads the levels, and sets up whichever way of drawing them the
+    // GL supports. Needs a current GL context.
+    void Init() {
+        const SphereMesh mesh;
+        const std::vector<GLfloat>& verts = mesh.verts;
+        const std::vector<GLushort>& indices = mesh.indices;
+        for (unsigned l = 0; l < Levels; ++l) {
+            level[l].first = mesh.first[l];
+            level[l].count = mesh.count[l];
+        }
+
+        glGenBuffers(1, &vbo);
+        GL::BindBuffer(GL_ARRAY_BUFFER, vbo);
+        GL::BufferData(GL_ARRAY_BUFFER, verts.size() * sizeof(GLfloat), &verts[0], GL_STATIC_DRAW);
+        GL::BindBuffer(GL_ARRAY_BUFFER, 0);
+        glGenBuffers(1, &ibo);
+        GL::BindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+        GL::BufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLushort), &indices[0], GL_STATIC_DRAW);
+        GL::BindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+        if (GLEW_VERSION_2_0 && GLEW_ARB_instanced_arrays && GLEW_ARB_draw_instanced)
+            program = BuildProgram();
+        if (program) {
+            glGenBuffers(1, &instance_vbo);
+        } else {
+            // The display lists copy the vertices at compile time.
+            for (unsigned l = 0; l < Levels; ++l) {
+                level[l].list = glGenLists(1);
+                glNewList(level[l].list, GL_COMPILE);
+                glBegin(GL_TRIANGLES);
+                for (unsigned i = level[l].first; i < level[l].first + level[l].count; ++i) {
+                    glNormal3fv(&verts[indices[i] * 3]);
+                    glVertex3fv(&verts[indices[i] * 3]);
+                }
+                glEnd();
+                glEndList();
+            }
+        }
+        CheckGLError("SphereRenderer::Init");
+    }
+
+    bool Instanced() const { return program != 0; }
+
+    // Starts collecting the spheres of a view seen from eye. Spheres outside
+    // view are left out.
+    void Begin(const XYZ<double>& eye, const Frustum& view) {
+        this->eye = eye;
+        this->view = &view;
+        for (unsigned l = 0; l < Levels; ++l) level[l].instances.clear();
+    }
+
+    void Add(const XYZ<double>& pos, const XYZ<double>& center, const XYZ<double>& scale,
+             GLfloat r, GLfloat g, GLfloat b) {
+        if (view->Outside(pos - center, std::max(scale.d[0], std::max(scale.d[1], scale.d[2])))) {
+            ++frameStats.cull.spheres;
+            return;
+        }
+        SphereInstance s;
+        for (unsigned c = 0; c < 3; ++c) {
+            s.pos[c] = pos.d[c];
+            s.center[c] = center.d[c];
+            s.scale[c] = scale.d[c];
+        }
+        s.color[0] = r;
+        s.color[1] = g;
+        s.color[2] = b;
+        level[SphereMesh::LevelFor(pos - center, scale, eye)].instances.push_back(s);
+    }
+
+    // Draws everything added since Begin. Errors are left for the
+    // once-per-frame CheckGLError in PC::Render.
+    void Draw() {
+        if (program) DrawInstanced();
+        else DrawLists();
+        GL::Color3f(1, 1, 1);
+    }
+
+    private:
+    struct Level {
+        unsigned first, count; // Range in the index buffer
+        GLuint list;           // Display list, without instancing
+        std::vector<SphereInstance> instances;
+    };
+    Level level[Levels];
+    GLuint vbo, ibo, instance_vbo, program;
+    size_t instance_capacity; // Of instance_vbo, in spheres
+    XYZ<double> eye;
+    const Frustum* view; // Of the view being collected
+
+    // Attribute locations; 0, 2 and 3 are avoided because some drivers
+    // alias them with gl_Vertex, gl_Normal and gl_Color.
+    enum { PosAttrib = 4, CenterAttrib, ScaleAttrib, ColorAttrib };
+
+    static GLuint Compile(GLenum type, const char* source) {
+        GLuint shader = glCreateShader(type);
+        glShaderSource(shader, 1, &source, NULL);
+        glCompileShader(shader);
+        GLint ok = 0;
+        glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+        if (!ok) {
+            char log[1024];
+            glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+            std::cout << "SphereRenderer: shader failed to compile: " << log << std::endl;
+            glDeleteShader(shader);
+            return 0;
+        }
+        return shader;
+    }
+
+    // Returns 0 if the program cannot be built, to fall back on lists.
+    static GLuint BuildProgram() {
+        GLuint vs = Compile(GL_VERTEX_SHADER,
+            "#version 120\n"
+            "attribute vec3 instance_pos, instance_center, instance_scale, instance_color;\n"
+            "void main() {\n"
+            "    vec3 p = gl_Vertex.xyz * instance_scale + instance_pos - instance_center;\n"
+            "    gl_Position = gl_ModelViewProjectionMatrix * vec4(p, 1.0);\n"
+            "    gl_FrontColor = vec4(instance_color, 1.0);\n"
+            "}\n");
+        GLuint fs = Compile(GL_FRAGMENT_SHADER,
+            "#version 120\n"
+            "void main() { gl_FragColor = gl_Color; }\n");
+        GLuint program = 0;
+        if (vs && fs) {
+            program = glCreateProgram();
+            glAttachShader(program, vs);
+            glAttachShader(program, fs);
+            glBindAttribLocation(program, PosAttrib, "instance_pos");
+            glBindAttribLocation(program, CenterAttrib, "instance_center");
+            glBindAttribLocation(program, ScaleAttrib, "instance_scale");
+            glBindAttribLocation(program, ColorAttrib, "instance_color");
+            glLinkProgram(program);
+            GLint ok = 0;
+            glGetProgramiv(program, GL_LINK_STATUS, &ok);
+            if (!ok) {
+                std::cout << "SphereRenderer: shader failed to link, using display lists" << std::endl;
+                glDeleteProgram(program);
+                program = 0;
+            }
+        }
+        if (vs) glDeleteShader(vs);
+        if (fs) glDeleteShader(fs);
+        return program;
+    }
+
+    void DrawInstanced() {
+        size_t total = 0;
+        for (unsigned l = 0; l < Levels; ++l) total += level[l].instances.size();
+        if (!total) return;
+
+        // Refill the instance buffer, growing it when needed; orphaning
+        // the old storage lets the driver keep drawing from it meanwhile.
+        GL::BindBuffer(GL_ARRAY_BUFFER, instance_vbo);
+        if (total > instance_capacity) instance_capacity = std::max(total, instance_capacity * 2);
+        GL::BufferData(GL_ARRAY_BUFFER, instance_capacity * sizeof(SphereInstance), NULL, GL_STREAM_DRAW);
+        size_t offset = 0;
+        for (unsigned l = 0; l < Levels; ++l) {
+            const auto& in = level[l].instances;
+            if (in.empty()) continue;
+            GL::BufferSubData(GL_ARRAY_BUFFER, offset * sizeof(SphereInstance),
+                            in.size() * sizeof(SphereInstance), &in[0]);
+            offset += in.size();
+        }
+
+        GL::UseProgram(program);
+        GL::BindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+        GL::BindBuffer(GL_ARRAY_BUFFER, vbo);
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glVertexPointer(3, GL_FLOAT, 0, 0);
+        GL::BindBuffer(GL_ARRAY_BUFFER, instance_vbo);
+        static const GLuint attribs[4] = { PosAttrib, CenterAttrib, ScaleAttrib, ColorAttrib };
+        for (GLuint a : attribs) {
+            glEnableVertexAttribArray(a);
+            glVertexAttribDivisorARB(a, 1);
+        }
+        offset = 0;
+        for (unsigned l = 0; l < Levels; ++l) {
+            const size_t n = level[l].instances.size();
+            if (!n) continue;
+            // Point the attributes at this level's run of instances.
+            const size_t stride = sizeof(SphereInstance), at = offset * stride;
+            glVertexAttribPointer(PosAttrib, 3, GL_FLOAT, GL_FALSE, stride,
+                                  (const GLvoid*)(at + offsetof(SphereInstance, pos)));
+            glVertexAttribPointer(CenterAttrib, 3, GL_FLOAT, GL_FALSE, stride,
+                                  (const GLvoid*)(at + offsetof(SphereInstance, center)));
+            glVertexAttribPointer(ScaleAttrib, 3, GL_FLOAT, GL_FALSE, stride,
+                                  (const GLvoid*)(at + offsetof(SphereInstance, scale)));
+            glVertexAttribPointer(ColorAttrib, 3, GL_FLOAT, GL_FALSE, stride,
+                                  (const GLvoid*)(at + offsetof(SphereInstance, color)));
+            GL::DrawElementsInstanced(GL_TRIANGLES, level[l].count, GL_UNSIGNED_SHORT,
+                                       (const GLvoid*)(level[l].first * sizeof(GLushort)), n);
+            frameStats.spheres += n;
+            offset += n;
+        }
+        for (GLuint a : attribs) {
+            glVertexAttribDivisorARB(a, 0);
+            glDisableVertexAttribArray(a);
+        }
+        glDisableClientState(GL_VERTEX_ARRAY);
+        GL::BindBuffer(GL_ARRAY_BUFFER, 0);
+        GL::BindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        GL::UseProgram(0);
+    }
+
+    void DrawLists() {
+        for (unsigned l = 0; l < Levels; ++l)
+            for (const auto& s : level[l].instances) {
+                GL::Color3fv(s.color);
+                glPushMatrix();
+                glTranslatef(s.pos[0], s.pos[1], s.pos[2]);
+                glTranslatef(-s.center[0], -s.center[1], -s.center[2]);
+                glScalef(s.scale[0], s.scale[1], s.scale[2]);
+                GL::CallList(level[l].list, level[l].count);
+                glPopMatrix();
+                ++frameStats.spheres;
+            }
+    }
+};
@@ -0,0 +1,108 @@
+// One tick of the game, as a function of the input sampled for it.
+// Everything that changes the state of the game happens here, from a
+// TickInput, rather than straight from SDL, so that the same ticks can be
+// run live, recorded and replayed (see replay.hpp), in the windowed game or
+// headless, and end up in the same state.
+#pragma once
+
+#include <cstdint> // For uint8_t, int16_t, uint32_t
+#include <vector>  // For std::vector, in which we store the portal shots
+
+#include "levelfile.hpp"
+#include "actor.hpp"
+#include "blobs.hpp"
+#include "bvh.hpp"
+#include "jobs.hpp"
+
+// A portal fired along a ray, usually the player's line of sight.
+struct PortalShot {
+    uint8_t portal;
+    XYZ<double> org, dir;
+};
+
+struct TickInput {
+    enum Key { Forward = 1, Back = 2, Left = 4, Right = 8, Jump = 16, Blob = 32 };
+    uint8_t keys;         // Held down during the tick
+    int16_t aim_x, aim_y; // Degrees, as passed to sig_aim
+    std::vector<PortalShot> shots;
+
+    TickInput() : keys(0), aim_x(0), aim_y(0) {}
+    void Clear() { keys = 0; aim_x = aim_y = 0; shots.clear(); }
+};
+
+// Where the player and the portals are when the game starts.
+// Those the level has no spawn points for are left where they are.
+inline void InitGame(BlobActor& player, Actor portals[2]) {
+    const LevelFile& level = LevelFile::Current();
+    player.fatness = {{0.2, 0.6, 0.2}}; // Shape of the ellipsoid
+    player.center = {{0, 0.3, 0}};      // representing the actor
+    if (const spawntype* s = level.Spawn(spawn_player)) {
+        player.camera = s->pos;         // Location thereof
+        player.look_angle = s->look_angle;
+        player.yaw = s->yaw; // Where it is facing
+    }
+    player.Orient();
+    player.BeginTick();
+
+    for (unsigned p = 0; p < 2; ++p)
+        if (const spawntype* s = level.Spawn(spawn_portal, p)) portals[p].camera = s->pos;
+}
+
+inline void FirePortal(const PortalShot& shot, const BlobActor& player, Actor portals[2], const BVH& bvh) {
+    Actor &portal = portals[shot.portal];
+    const LevelSpan<WallData>& walls = LevelFile::Current().walls;
+    HitRec r = IntersectRay(shot.org, shot.dir, walls, bvh);
+    if (!r.set()) return; // Out into the open: the portal stays where it was
+    portal.dir = walls[r.wallno].normal;
+    portal.camera = r.hit + portal.dir * 1e-4;
+    // Figure out where the "up" vector for the portal should go.
+    portal.up = portal.dir.Cross(shot.dir.Cross(player.up)).Normalized();
+    portal.up *= -1.0;
+}
+
+inline void RunTick(const TickInput& in, BlobActor& player, Actor portals[2],
+                    BlobPool& blobs, WorkStealingPool& workers, const BVH& bvh) {
+    player.BeginTick();
+    if (in.aim_x || in.aim_y) player.MovementSignal(BlobActor::sig_aim, in.aim_x, in.aim_y);
+    for (const PortalShot& shot : in.shots) FirePortal(shot, player, portals, bvh);
+
+    if (in.keys & TickInput::Forward) player.MovementSignal(BlobActor::sig_push,   0);
+    if (in.keys & TickInput::Back)    player.MovementSignal(BlobActor::sig_push, 180);
+    if (in.keys & TickInput::Left)    player.MovementSignal(BlobActor::sig_push, -90);
+    if (in.keys & TickInput::Right)   player.MovementSignal(BlobActor::sig_push,  90);
+    if (in.keys & TickInput::Jump)    player.MovementSignal(BlobActor::sig_jump);
+    if (in.keys & TickInput::Blob)
+        blobs.Spawn(player.camera + player.dir * 0.2, player.dir * 0.2 + player.vel,
+                    XYZ<double>{{0.45, 0.45, 0.45}});
+
+    player.Update();
+    blobs.Update(workers);
+}
+
+// FNV-1a over the state a tick changes, to tell when a replay diverges
+// from its recording.
+class StateHash {
+    public:
+    StateHash() : h(2166136261u) {}
+    template<typename T>
+    void Add(const T& v) {
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(&v);
+        for (size_t n = 0; n < sizeof(v); ++n) h = (h ^ p[n]) * 16777619u;
+    }
+    uint32_t Value() const { return h; }
+
+    static uint32_t Of(const BlobActor& player, const Actor portals[2], const BlobPool& blobs) {
+        StateHash s;
+        s.Add(player.camera); s.Add(player.vel);
+        s.Add(player.look_angle); s.Add(player.yaw);
+        for (unsigned p = 0; p < 2; ++p) {
+            s.Add(portals[p].camera); s.Add(portals[p].dir); s.Add(portals[p].up);
+        }
+        s.Add(blobs.Size());
+        for (size_t n = 0; n < blobs.Size(); ++n) s.Add(blobs.camera[n]);
+        return s.Value();
+    }
+
+    private:
+    uint32_t h;
+};
@@ -0,0 +1,38 @@
+// Fixed-timestep simulation.
+// The game is simulated in ticks of a fixed length, however fast or slow
+// frames are rendered: the time each frame took is added to an accumulator,
+// and as many whole ticks are run as fit in it. Movement constants (gravity,
+// jump, walking speed) are therefore per tick, not per frame. When a frame
+// took so long that catching up would take more than MaxTicksPerFrame ticks,
+// the rest is dropped; the game slows down instead of spending ever longer
+// on simulation. What is left in the accumulator, as a fraction of a tick,
+// tells the renderer how far to interpolate between the last two ticks.
+#pragma once
+
+class FixedTimestep {
+    public:
+    static constexpr double TicksPerSecond = 60;
+    static constexpr unsigned MaxTicksPerFrame = 5;
+
+    FixedTimestep() : accumulator(0) {}
+
+    // Adds the time a frame took, in seconds, and returns how many ticks
+    // to run for it.
+    unsigned Advance(double seconds) {
+        if (seconds > 0) accumulator += seconds * TicksPerSecond;
+        unsigned ticks = accumulator;
+        if (ticks > MaxTicksPerFrame) {
+            ticks = MaxTicksPerFrame;
+            accumulator = ticks;
+        }
+        accumulator -= ticks;
+        return ticks;
+    }
+
+    // How far from the second last tick towards the last one to render,
+    // from 0 to 1.
+    double Alpha() const { return accumulator; }
+
+    private:
+    double accumulator; // In ticks
+};
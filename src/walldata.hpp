@@ -0,0 +1,162 @@
+// Per-wall data derived from the level map, computed by the compiler.
+// Since map[] is a constant table, everything that follows from it (edges,
+// lengths, planes, bounds, lightmap sizes) is worked out once at compile
+// time into mapData[], instead of again in every frame, ray or collision
+// test. Each WallData also repeats the wall's own corners and normal, so
+// mapData can be passed anywhere map can.
+#pragma once
+
+#include <cstddef> // For size_t
+
+#include "map.hpp"
+
+struct WallData {
+    XYZ<GLfloat> normal, p[4]; // As in map
+    XYZ<GLfloat> edge[4];      // p[1]-p[0], p[3]-p[0], p[3]-p[2], p[1]-p[2]
+    GLfloat width, height;     // Lengths of p[3]-p[0] and p[1]-p[0]
+    GLfloat inv_width, inv_height;
+    GLfloat plane;             // normal.Dot(p[0]), the same for every corner
+    XYZ<GLfloat> lo, hi;       // Bounding box
+    unsigned lmap_w, lmap_h;   // Lightmap size in texels
+};
+
+const unsigned LightmapTexelsPerUnit = 32;
+const unsigned MaxWallLength = 128; // Units, so at most 4096 lightmap texels across
+
+// Which of WallData::edge holds p[B]-p[A].
+constexpr unsigned WallEdgeIndex(unsigned A, unsigned B) {
+    return A == 0 ? (B == 1 ? 0 : 1) : (B == 3 ? 2 : 3);
+}
+
+// The edges IntersectRay needs, without computing them.
+template<unsigned A, unsigned B>
+const XYZ<GLfloat>& WallEdge(const WallData& w) { return w.edge[WallEdgeIndex(A, B)]; }
+
+template<size_t N>
+struct WallTable {
+    WallData w[N];
+    constexpr const WallData& operator[](size_t n) const { return w[n]; }
+    constexpr const WallData* begin() const { return w; }
+    constexpr const WallData* end() const { return w + N; }
+    constexpr size_t size() const { return N; }
+};
+
+// The XYZ operators are not constexpr, hence these.
+constexpr XYZ<GLfloat> WallSub(const XYZ<GLfloat>& a, const XYZ<GLfloat>& b) {
+    return {{ a.d[0] - b.d[0], a.d[1] - b.d[1], a.d[2] - b.d[2] }};
+}
+constexpr GLfloat WallDot(const XYZ<GLfloat>& a, const XYZ<GLfloat>& b) {
+    return a.d[0] * b.d[0] + a.d[1] * b.d[1] + a.d[2] * b.d[2];
+}
+constexpr GLfloat WallAbs(GLfloat a) { return a < 0 ? -a : a; }
+// Number of nonzero components: 1 for a vector along an axis.
+constexpr unsigned WallAxes(const XYZ<GLfloat>& a) {
+    return (a.d[0] != 0) + (a.d[1] != 0) + (a.d[2] != 0);
+}
+// Length of a vector along an axis, which needs no square root.
+constexpr GLfloat WallAxisLength(const XYZ<GLfloat>& a) {
+    return WallAbs(a.d[0]) + WallAbs(a.d[1]) + WallAbs(a.d[2]);
+}
+
+// Whether a length is a whole number of units, from 1 to MaxWallLength.
+constexpr bool WallWholeUnits(GLfloat a) {
+    return a >= 1 && a <= MaxWallLength && a == unsigned(a);
+}
+
+// The WallData of a wall with this normal and these corners.
+constexpr WallData DeriveWall(const XYZ<GLfloat>& normal, const XYZ<GLfloat> (&p)[4]) {
+    WallData w{};
+    w.normal = normal;
+    for (unsigned a = 0; a < 4; ++a) w.p[a] = p[a];
+    w.edge[WallEdgeIndex(0, 1)] = WallSub(p[1], p[0]);
+    w.edge[WallEdgeIndex(0, 3)] = WallSub(p[3], p[0]);
+    w.edge[WallEdgeIndex(2, 3)] = WallSub(p[3], p[2]);
+    w.edge[WallEdgeIndex(2, 1)] = WallSub(p[1], p[2]);
+    w.width  = WallAxisLength(w.edge[WallEdgeIndex(0, 3)]);
+    w.height = WallAxisLength(w.edge[WallEdgeIndex(0, 1)]);
+    w.inv_width  = 1 / w.width;
+    w.inv_height = 1 / w.height;
+    w.plane = WallDot(normal, p[0]);
+    w.lo = w.hi = p[0];
+    for (unsigned a = 1; a < 4; ++a)
+        for (unsigned c = 0; c < 3; ++c) {
+            if (p[a].d[c] < w.lo.d[c]) w.lo.d[c] = p[a].d[c];
+            if (p[a].d[c] > w.hi.d[c]) w.hi.d[c] = p[a].d[c];
+        }
+    // Lengths that are not whole units (see FirstWallOfBadSize) get no
+    // lightmap, rather than an undefined conversion.
+    w.lmap_w = WallWholeUnits(w.width)  ? unsigned(w.width)  * LightmapTexelsPerUnit : 0;
+    w.lmap_h = WallWholeUnits(w.height) ? unsigned(w.height) * LightmapTexelsPerUnit : 0;
+    return w;
+}
+
+template<size_t N>
+constexpr WallTable<N> DeriveWalls(const maptype (&map)[N]) {
+    WallTable<N> t{};
+    for (size_t n = 0; n < N; ++n) t.w[n] = DeriveWall(map[n].normal, map[n].p);
+    return t;
+}
+
+static constexpr auto mapData = DeriveWalls(map);
+
+// What the code above and the renderer take for granted about the map.
+// Each returns the number of the first wall that breaks the rule, or the
+// number of walls if none does. They take mapData here, and the walls of
+// a level file when it is opened (see LevelFile::Validate).
+template<typename Walls>
+constexpr size_t FirstWallWithoutUnitAxisNormal(const Walls& t) {
+    for (size_t n = 0; n < t.size(); ++n)
+        if (WallAxes(t[n].normal) != 1 || WallDot(t[n].normal, t[n].normal) != 1) return n;
+    return t.size();
+}
+template<typename Walls>
+constexpr size_t FirstNonPlanarWall(const Walls& t) {
+    for (size_t n = 0; n < t.size(); ++n)
+        for (unsigned a = 1; a < 4; ++a)
+            if (WallDot(t[n].normal, t[n].p[a]) != t[n].plane) return n;
+    return t.size();
+}
+template<typename Walls>
+constexpr size_t FirstWallNotAxisAlignedRectangle(const Walls& t) {
+    for (size_t n = 0; n < t.size(); ++n) {
+        const WallData& w = t[n];
+        const XYZ<GLfloat> &e01 = w.edge[WallEdgeIndex(0, 1)], &e03 = w.edge[WallEdgeIndex(0, 3)];
+        // Edges along the axes, at right angles, and p[2] opposite p[0].
+        if (WallAxes(e01) != 1 || WallAxes(e03) != 1 || WallDot(e01, e03) != 0) return n;
+        for (unsigned c = 0; c < 3; ++c)
+            if (w.p[2].d[c] != w.p[0].d[c] + e01.d[c] + e03.d[c]) return n;
+    }
+    return t.size();
+}
+template<typename Walls>
+constexpr size_t FirstWallOfBadSize(const Walls& t) {
+    for (size_t n = 0; n < t.size(); ++n)
+        if (!WallWholeUnits(t[n].width) || !WallWholeUnits(t[n].height)) return n;
+    return t.size();
+}
+// Whose stored data, lightmap size included, is not what DeriveWall makes
+// of its normal and corners.
+template<typename Walls>
+constexpr size_t FirstWallNotAsDerived(const Walls& t) {
+    for (size_t n = 0; n < t.size(); ++n) {
+        const WallData &w = t[n], d = DeriveWall(w.normal, w.p);
+        bool same = w.width == d.width && w.height == d.height && w.inv_width == d.inv_width
+                 && w.inv_height == d.inv_height && w.plane == d.plane
+                 && w.lmap_w == d.lmap_w && w.lmap_h == d.lmap_h;
+        for (unsigned c = 0; c < 3; ++c) {
+            same = same && w.lo.d[c] == d.lo.d[c] && w.hi.d[c] == d.hi.d[c];
+            for (unsigned e = 0; e < 4; ++e) same = same && w.edge[e].d[c] == d.edge[e].d[c];
+        }
+        if (!same) return n;
+    }
+    return t.size();
+}
+
+static_assert(FirstWallWithoutUnitAxisNormal(mapData) == mapData.size(),
+              "every wall normal must be a unit vector along an axis");
+static_assert(FirstNonPlanarWall(mapData) == mapData.size(),
+              "every wall must be flat");
+static_assert(FirstWallNotAxisAlignedRectangle(mapData) == mapData.size(),
+              "every wall must be a rectangle with edges along the axes");
+static_assert(FirstWallOfBadSize(mapData) == mapData.size(),
+              "walls must be a whole number of units across, up to MaxWallLength, for their textures and lightmaps");
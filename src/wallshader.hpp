@@ -0,0 +1,150 @@
+// GLSL shading of the walls.
+// The fixed-function path lights a wall by stacking texture environments:
+// the wall texture on unit 0, GL_MODULATE with the lightmap on unit 1,
+// GL_ADD with the addmap on unit 2 and GL_DECAL with the decal on unit 3,
+// each enabled, bound and set per page or per wall. Here one fragment
+// shader does the same sums, with the samplers fixed to those units,
+// whether a wall has an addmap coming from its vertices (see LevelVertex)
+// and whether it has a decal from a uniform set around the wall's own
+// draw, so that a view only binds textures and draws.
+//
+// The program is built from GLSL 3.30 core where the GL has 3.3, and from
+// GLSL 1.20 otherwise; neither uses the fixed-function matrices, the clip
+// matrix coming from the view's Frustum instead.
+#pragma once
+
+#define GL_SILENCE_DEPRECATION
+#include "GL/glew.h"
+
+#include <iostream> // For std::cout
+
+#include "frustum.hpp"
+#include "levelmesh.hpp"
+#include "glcalls.hpp"
+
+class WallShader {
+    public:
+    WallShader() : program(0), clip(-1), decal_shown(-1), version(0) {}
+
+    // Builds the program. Returns false, leaving the walls to the texture
+    // environments, if the GL has no GLSL or the program does not build.
+    // Needs a current GL context.
+    bool Init() {
+        if (GLEW_VERSION_3_3) program = BuildProgram(330);
+        if (!program && GLEW_VERSION_2_0) program = BuildProgram(120);
+        if (!program) return false;
+        clip = glGetUniformLocation(program, "clip");
+        decal_shown = glGetUniformLocation(program, "decal_shown");
+        static const char* samplers[] = { "wall", "lightmap", "addmap", "decal" };
+        GL::UseProgram(program);
+        for (unsigned u = 0; u < 4; ++u) glUniform1i(glGetUniformLocation(program, samplers[u]), u);
+        GL::UseProgram(0);
+        CheckGLError("WallShader::Init");
+        return true;
+    }
+
+    bool Ready() const { return program != 0; }
+    unsigned Version() const { return version; } // Of the GLSL built from
+
+    // Draws the walls until End as seen in view. The textures are bound
+    // to units 0 to 3 as for the fixed-function path, and need not be enabled.
+    void Begin(const Frustum& view) {
+        GLfloat m[16];
+        view.Clip(m);
+        GL::UseProgram(program);
+        GL::UniformMatrix4fv(clip, m);
+    }
+    void End() { GL::UseProgram(0); }
+
+    // Shows the decal on unit 3 in what is drawn until it is hidden again.
+    // Walls start without.
+    void ShowDecal(bool shown) { GL::Uniform1f(decal_shown, shown); }
+
+    private:
+    GLuint program;
+    GLint clip;        // Location of the clip matrix
+    GLint decal_shown; // And of whether the decal is shown
+    unsigned version;
+
+    // Shared by both versions, which differ in what the preludes define.
+    static const char* VertexSource() {
+        return
+            "uniform mat4 clip;\n"
+            "IN vec3 pos;\n"
+            "IN vec2 tex, lightmap_st;\n"
+            "IN vec4 decal_flags; // Decal coordinates, then whether the addmap is shown\n"
+            "OUT vec2 v_tex, v_lightmap;\n"
+            "OUT vec4 v_decal;\n"
+            "void main() {\n"
+            "    v_tex = tex;\n"
+            "    v_lightmap = lightmap_st;\n"
+            "    v_decal = decal_flags;\n"
+            "    gl_Position = clip * vec4(pos, 1.0);\n"
+            "}\n";
+    }
+    static const char* FragmentSource() {
+        return
+            "uniform sampler2D wall, lightmap, addmap, decal;\n"
+            "uniform float decal_shown;\n"
+            "IN vec2 v_tex, v_lightmap;\n"
+            "IN vec4 v_decal;\n"
+            "void main() {\n"
+            "    vec3 c = TEXTURE(wall, v_tex).rgb * TEXTURE(lightmap, v_lightmap).rgb; // GL_MODULATE\n"
+            "    c = min(c + TEXTURE(addmap, v_lightmap).rgb * v_decal.z, 1.0);         // GL_ADD\n"
+            "    vec4 d = TEXTURE(decal, v_decal.xy);\n"
+            "    COLOR = vec4(mix(c, d.rgb, d.a * decal_shown), 1.0);                  // GL_DECAL\n"
+            "}\n";
+    }
+
+    static GLuint Compile(GLenum type, const char* prelude, const char* source) {
+        GLuint shader = glCreateShader(type);
+        const char* sources[2] = { prelude, source };
+        glShaderSource(shader, 2, sources, NULL);
+        glCompileShader(shader);
+        GLint ok = 0;
+        glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+        if (!ok) {
+            char log[1024];
+            glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+            std::cout << "WallShader: shader failed to compile: " << log << std::endl;
+            glDeleteShader(shader);
+            return 0;
+        }
+        return shader;
+    }
+
+    // Returns 0 if the program cannot be built from GLSL glsl (330 or 120).
+    GLuint BuildProgram(unsigned glsl) {
+        const bool core = glsl == 330;
+        GLuint vs = Compile(GL_VERTEX_SHADER, core
+            ? "#version 330 core\n#define IN in\n#define OUT out\n"
+            : "#version 120\n#define IN attribute\n#define OUT varying\n", VertexSource());
+        GLuint fs = Compile(GL_FRAGMENT_SHADER, core
+            ? "#version 330 core\n#define IN in\n#define TEXTURE texture\nout vec4 fragment;\n#define COLOR fragment\n"
+            : "#version 120\n#define IN varying\n#define TEXTURE texture2D\n#define COLOR gl_FragColor\n",
+            FragmentSource());
+        GLuint program = 0;
+        if (vs && fs) {
+            program = glCreateProgram();
+            glAttachShader(program, vs);
+            glAttachShader(program, fs);
+            glBindAttribLocation(program, LevelMesh::PosAttrib, "pos");
+            glBindAttribLocation(program, LevelMesh::TexAttrib, "tex");
+            glBindAttribLocation(program, LevelMesh::LightmapAttrib, "lightmap_st");
+            glBindAttribLocation(program, LevelMesh::DecalAttrib, "decal_flags");
+            if (core) glBindFragDataLocation(program, 0, "fragment");
+            glLinkProgram(program);
+            GLint ok = 0;
+            glGetProgramiv(program, GL_LINK_STATUS, &ok);
+            if (!ok) {
+                std::cout << "WallShader: GLSL " << glsl << " program failed to link" << std::endl;
+                glDeleteProgram(program);
+                program = 0;
+            }
+        }
+        if (vs) glDeleteShader(vs);
+        if (fs) glDeleteShader(fs);
+        if (program) version = glsl;
+        return program;
+    }
+};